@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include "picam_v4l2_ctrl.h"
+#include "replay_source.h"
+#include "decode_pipeline.h"
+#include "pupil_detector.h"
+#include "luma.h"
+#include "latency_histogram.h"
+#include "exposure_control.h"
+
+#define XRES 640
+#define YRES 480
+#define N_FRAMES 600
+#define REPLAY_FPS 60
+#define DECODE_WORKERS 2
+#define DECODE_DEPTH 8
+
+using namespace std;
+
+/*
+	bench_capture - where the time goes between DQBUF and a pupil result
+	Runs the capture pipeline against a camera (vivid works, use -y since
+	it has no MJPEG) or a recorded session and reports
+
+	hold		sink consume(), the V4L2 buffer is out of the queue meanwhile
+	deliver		sensor timestamp to consume(), driver and wake-up latency
+	queue		DecodePipeline submit to decode start
+	decode		JPEG to luma
+	reorder		decode end to in-order delivery
+	luma		extract_luma() for raw formats, inside hold
+	detect		PupilDetector::detect()
+	e2e			sensor timestamp to pupil result
+
+	as p50 / p99 / p99.9 / max, plus sustained frame and result rates.
+	With -m fast the capture stage waits for a free decode slot instead of
+	dropping, so the result rate is the pipeline throughput.
+	-j writes the same numbers as JSON for tracking between builds.
+
+	-a lets Picam pick the lowest-latency mode for XRES x YRES at -f fps.
+	-e runs ExposureController on the camera, steering the pupil region
+	(the whole frame until one is found), and adds its write latency.
+
+	usage : bench_capture [-d device [-y | -a] [-e] | -p session.pcam|dir] [-n frames]
+				[-m original|fast|fixed] [-f fps] [-j report.json]
+*/
+
+// end of the pipeline, pupil detection on every luma frame //
+class DetectStage : public LumaSink{
+public:
+	DetectStage(unsigned int width, unsigned int height, ExposureController *exposure = NULL) :
+		detector(width, height), results(0), found(0), first(0), last(0), exposure(exposure) {}
+
+	void consume(const luma_frame& frame)
+	{
+		uint64_t t = monotonic_ns();
+		pupil p = detector.detect(frame);
+		uint64_t now = monotonic_ns();
+
+		detect.record(now - t);
+		// replay stamps frames on the same clock, a live camera too //
+		if(now > frame.timestamp_ns)
+			e2e.record(now - frame.timestamp_ns);
+		if(!first)
+			first = now;
+		last = now;
+		results++;
+		if(p.found)
+			found++;
+
+		if(exposure){
+			if(p.found){
+				// the pupil and a ring of iris, what the detector has to separate //
+				int r = (int)(p.radius * 2 + 0.5f);
+				int x = (int)p.x - r, y = (int)p.y - r;
+				pupil_roi roi;
+
+				roi.x = x > 0 ? x : 0;
+				roi.y = y > 0 ? y : 0;
+				roi.width = roi.height = 2 * r;
+				exposure->update(frame, roi);
+			}else{
+				exposure->update(frame);
+			}
+		}
+	}
+
+	PupilDetector detector;
+	LatencyHistogram detect;
+	LatencyHistogram e2e;
+	atomic<unsigned long> results;
+	unsigned long found;
+	uint64_t first, last;
+	ExposureController *exposure;
+};
+
+// head of the pipeline, what the capture loop calls with the buffer held //
+class CaptureStage : public FrameSink{
+public:
+	CaptureStage(DecodePipeline *decode, DetectStage *detect, unsigned int width, unsigned int height,
+			unsigned int pixfmt, size_t stride, bool throttle) :
+		frames(0), first(0), last(0), decode(decode), detect(detect), width(width), height(height),
+		pixfmt(pixfmt), stride(stride), throttle(throttle), scratch((size_t)width * height) {}
+
+	void consume(const void *p, size_t size, const frame_info& info)
+	{
+		uint64_t t = monotonic_ns();
+
+		if(t > info.timestamp_ns)
+			deliver.record(t - info.timestamp_ns);
+
+		if(decode){
+			// a source faster than the pipeline would only measure drops //
+			while(throttle && frames - detect->results >= DECODE_DEPTH)
+				this_thread::yield();
+			decode->consume(p, size, info);
+		}else{
+			luma_frame f;
+			uint64_t l = monotonic_ns();
+
+			extract_luma(p, stride ? stride : size / height, width, height, pixfmt, &scratch[0]);
+			luma.record(monotonic_ns() - l);
+
+			f.frame_number = info.frame_number;
+			f.timestamp_ns = info.timestamp_ns;
+			f.width = width;
+			f.height = height;
+			f.stride = width;
+			f.data = &scratch[0];
+			detect->consume(f);
+		}
+
+		last = monotonic_ns();
+		hold.record(last - t);
+		if(!first)
+			first = t;
+		frames++;
+	}
+
+	LatencyHistogram hold;
+	LatencyHistogram deliver;
+	LatencyHistogram luma;
+	unsigned long frames;
+	uint64_t first, last;
+private:
+	DecodePipeline *decode;
+	DetectStage *detect;
+	unsigned int width, height;
+	unsigned int pixfmt;
+	size_t stride;
+	bool throttle;
+	vector<unsigned char> scratch;
+};
+
+static double rate(unsigned long n, uint64_t first, uint64_t last)
+{
+	return n > 1 && last > first ? (n - 1) * 1e9 / (last - first) : 0;
+}
+
+static void print_hist(const char *name, const LatencyHistogram& h)
+{
+	if(!h.count())
+		return;
+	printf("%-8s n %-7llu p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n", name,
+			(unsigned long long)h.count(), h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+			h.percentile(99.9) / 1e3, h.max() / 1e3);
+}
+
+static void json_hist(FILE *f, const char *name, const LatencyHistogram& h, bool comma)
+{
+	fprintf(f, "    \"%s\": {\"count\": %llu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+			"\"p999_us\": %.1f, \"max_us\": %.1f}%s\n", name, (unsigned long long)h.count(),
+			h.mean() / 1e3, h.percentile(50) / 1e3, h.percentile(99) / 1e3,
+			h.percentile(99.9) / 1e3, h.max() / 1e3, comma ? "," : "");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage : %s [-d device [-y | -a] [-e] | -p session.pcam|dir] [-n frames]\n"
+			"\t\t[-m original|fast|fixed] [-f fps] [-j report.json]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	string device = "/dev/video0", replay, report;
+	unsigned int pixfmt = V4L2_PIX_FMT_MJPEG;
+	enum replay_timing timing = REPLAY_ORIGINAL;
+	unsigned int fps = REPLAY_FPS;
+	int n_frames = N_FRAMES;
+	unique_ptr<Picam> picam;
+	unique_ptr<ReplaySource> player;
+	unique_ptr<ExposureController> exposure;
+	CaptureSource *source;
+	size_t stride = 0;
+	uint64_t t0, t1;
+	bool auto_mode = false;
+	bool control = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:yaep:n:m:f:j:")) != -1){
+		switch(opt){
+		case 'd': device = optarg; break;
+		case 'y': pixfmt = V4L2_PIX_FMT_YUYV; break;
+		case 'a': auto_mode = true; break;
+		case 'e': control = true; break;
+		case 'p': replay = optarg; break;
+		case 'n': n_frames = atoi(optarg); break;
+		case 'f': fps = atoi(optarg); break;
+		case 'j': report = optarg; break;
+		case 'm':
+			if(strcmp(optarg, "fast") == 0)
+				timing = REPLAY_FAST;
+			else if(strcmp(optarg, "fixed") == 0)
+				timing = REPLAY_FIXED;
+			else if(strcmp(optarg, "original") == 0)
+				timing = REPLAY_ORIGINAL;
+			else{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	try{
+		if(!replay.empty()){
+			player.reset(new ReplaySource(replay, timing, fps));
+			// a short recording is played as often as needed //
+			player->set_loop(true);
+			source = player.get();
+		}else{
+			if(auto_mode){
+				mode_request req;
+
+				req.width = XRES;
+				req.height = YRES;
+				req.fps = fps;
+				picam.reset(new Picam(device, req));
+				printf("mode : %.4s %ux%u at %.2f fps, estimated latency %.2f ms\n",
+						(const char*)&picam->mode().pixelformat, picam->width(), picam->height(),
+						picam->frame_rate(), picam->mode().latency_ns / 1e6);
+			}else{
+				picam.reset(new Picam(device, XRES, YRES, pixfmt));
+			}
+			stride = picam->bytes_per_line();
+			source = picam.get();
+			if(control){
+				exposure.reset(new ExposureController(picam.get()));
+				printf("exposure : capped at %.1f ms%s\n", exposure->exposure_limit() / 10.0,
+						exposure->has_gain() ? ", gain above it" : ", no gain control");
+			}
+		}
+
+		if(source->pixel_format() != V4L2_PIX_FMT_MJPEG && !luma_supported(source->pixel_format()))
+			throw runtime_error("unsupported pixel format");
+
+		DetectStage detect(source->width(), source->height(), exposure.get());
+		unique_ptr<DecodePipeline> decode;
+
+		if(source->pixel_format() == V4L2_PIX_FMT_MJPEG)
+			decode.reset(new DecodePipeline(&detect, source->max_frame_size(), source->width(),
+					source->height(), DECODE_WORKERS, 1, DECODE_DEPTH));
+
+		CaptureStage capture(decode.get(), &detect, source->width(), source->height(),
+				source->pixel_format(), stride, player && timing == REPLAY_FAST);
+
+		source->set_sink(&capture);
+
+		t0 = monotonic_ns();
+		source->run(1, n_frames);
+		if(decode)
+			decode->flush();
+		t1 = monotonic_ns();
+
+		printf("%s %ux%u : %lu frames in %.2f s, capture %.1f fps, results %.1f fps, pupil found %lu\n",
+				replay.empty() ? device.c_str() : replay.c_str(), source->width(), source->height(),
+				capture.frames, (t1 - t0) / 1e9, rate(capture.frames, capture.first, capture.last),
+				rate(detect.results.load(), detect.first, detect.last), detect.found);
+		if(decode){
+			decode_stats ds = decode->stats();
+			printf("decode : submitted %lu dropped %lu failed %lu sink errors %lu\n", ds.submitted, ds.dropped,
+					ds.failed, ds.errors);
+		}
+		if(picam)
+			printf("driver : starved %lu sequence drops %lu\n", picam->starved(), picam->sequence_drops());
+
+		print_hist("hold", capture.hold);
+		print_hist("deliver", capture.deliver);
+		print_hist("luma", capture.luma);
+		if(decode){
+			print_hist("queue", decode->queue_latency());
+			print_hist("decode", decode->decode_latency());
+			print_hist("reorder", decode->reorder_latency());
+		}
+		print_hist("detect", detect.detect);
+		print_hist("e2e", detect.e2e);
+		if(exposure){
+			exposure_stats es = exposure->stats();
+
+			printf("exposure : %.1f ms gain %d mean %u, %lu writes of %lu requests, %lu errors\n",
+					es.exposure / 10.0, es.gain, es.mean, es.writes, es.requests, es.errors);
+			print_hist("control", exposure->write_latency());
+		}
+
+		if(!report.empty()){
+			FILE *f = fopen(report.c_str(), "w");
+			LatencyHistogram none;
+
+			if(!f)
+				throw runtime_error(report + " : cannot open! ");
+
+			fprintf(f, "{\n  \"source\": \"%s\",\n", replay.empty() ? device.c_str() : replay.c_str());
+			fprintf(f, "  \"width\": %u,\n  \"height\": %u,\n", source->width(), source->height());
+			fprintf(f, "  \"frames\": %lu,\n  \"results\": %lu,\n  \"found\": %lu,\n",
+					capture.frames, detect.results.load(), detect.found);
+			fprintf(f, "  \"seconds\": %.3f,\n", (t1 - t0) / 1e9);
+			fprintf(f, "  \"capture_fps\": %.2f,\n  \"result_fps\": %.2f,\n",
+					rate(capture.frames, capture.first, capture.last),
+					rate(detect.results.load(), detect.first, detect.last));
+			fprintf(f, "  \"dropped\": %lu,\n", decode ? decode->stats().dropped : 0UL);
+			fprintf(f, "  \"latency\": {\n");
+			json_hist(f, "hold", capture.hold, true);
+			json_hist(f, "deliver", capture.deliver, true);
+			json_hist(f, "luma", capture.luma, true);
+			json_hist(f, "queue", decode ? decode->queue_latency() : none, true);
+			json_hist(f, "decode", decode ? decode->decode_latency() : none, true);
+			json_hist(f, "reorder", decode ? decode->reorder_latency() : none, true);
+			json_hist(f, "detect", detect.detect, true);
+			json_hist(f, "e2e", detect.e2e, false);
+			fprintf(f, "  }\n}\n");
+			fclose(f);
+		}
+	}catch(const exception& e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+
+#include "replay_source.h"
+#include "jpeg_luma.h"
+#include "pupil_detector.h"
+#include "pipeline_stages.h"
+#include "latency_histogram.h"
+
+#define ITERATIONS 3
+
+using namespace std;
+
+/*
+	bench_dc - coarse-to-fine pupil search against full MJPEG decode
+	Runs every frame of a recording through
+
+	full		libjpeg-turbo, grayscale at 1/1, then PupilDetector on the frame
+	turbo/8		libjpeg-turbo at 1/8, the library's own DC-only scale
+	coarse		turbo/8, coarse_region() on the thumbnail, decode_region() of
+				that region at 1/1 and PupilDetector inside it
+
+	and reports mean / p50 / p99 per frame and how often coarse finds the
+	pupil full does, within 2 px.
+
+	usage : bench_dc session.pcam|dir [iterations]
+*/
+
+// keeps a copy of every frame the replay hands out //
+class Collector : public FrameSink{
+public:
+	void consume(const void *p, size_t size, const frame_info& info)
+	{
+		(void)info;
+		frames.push_back(vector<unsigned char>((const unsigned char*)p, (const unsigned char*)p + size));
+	}
+
+	vector<vector<unsigned char> > frames;
+};
+
+static void report(const char *name, const LatencyHistogram& h, double full_mean)
+{
+	printf("%-8s mean %8.1f us  p50 %8.1f us  p99 %8.1f us  %5.2fx\n", name,
+			h.mean() / 1000.0, h.percentile(50) / 1000.0, h.percentile(99) / 1000.0,
+			h.mean() ? full_mean / h.mean() : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = ITERATIONS;
+	unsigned int i, it;
+
+	if(argc < 2){
+		fprintf(stderr, "usage : %s session.pcam|dir [iterations]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 2)
+		iterations = atoi(argv[2]);
+
+	try{
+		ReplaySource replay(argv[1], REPLAY_FAST);
+		Collector rec;
+
+		if(replay.pixel_format() != V4L2_PIX_FMT_MJPEG)
+			throw runtime_error(string(argv[1]) + " : not an MJPEG recording");
+		replay.set_sink(&rec);
+		replay.run(1, replay.frames());
+		if(rec.frames.empty())
+			throw runtime_error(string(argv[1]) + " : no frames");
+
+		unsigned int w = replay.width(), h = replay.height();
+		vector<unsigned char> full((size_t)w * h), small((size_t)w * h), region((size_t)w * h);
+		JpegLumaDecoder turbo;
+		PupilDetector detector(w, h);
+		LatencyHistogram t_full, t_turbo8, t_coarse;
+		unsigned long found_full = 0, found_coarse = 0, agree = 0, no_region = 0;
+		size_t bytes = 0;
+
+		for(it = 0; it < (unsigned int)iterations; ++it){
+			for(i = 0; i < rec.frames.size(); ++i){
+				const vector<unsigned char>& jpeg = rec.frames[i];
+				luma_frame f_full, f_turbo8, f_region;
+				pupil p_full, p_coarse = pupil();
+				pupil_roi roi;
+				uint64_t t;
+
+				bytes += jpeg.size();
+
+				t = monotonic_ns();
+				if(!turbo.decode(&jpeg[0], jpeg.size(), 1, &full[0], full.size(), &f_full))
+					throw runtime_error(string("full decode : ") + turbo.last_error());
+				p_full = detector.detect(f_full);
+				t_full.record(monotonic_ns() - t);
+
+				t = monotonic_ns();
+				if(!turbo.decode(&jpeg[0], jpeg.size(), COARSE_SCALE, &small[0], small.size(), &f_turbo8))
+					throw runtime_error(string("1/8 decode : ") + turbo.last_error());
+				t_turbo8.record(monotonic_ns() - t);
+
+				// the whole coarse-to-fine path, thumbnail included //
+				t = monotonic_ns();
+				if(turbo.decode(&jpeg[0], jpeg.size(), COARSE_SCALE, &small[0], small.size(), &f_turbo8)
+						&& detector.coarse_region(f_turbo8, COARSE_SCALE, w, h, COARSE_RADIUS, COARSE_MARGIN, COARSE_CONTRAST, &roi)
+						&& turbo.decode_region(&jpeg[0], jpeg.size(), &roi, &region[0], region.size(), &f_region)){
+					p_coarse = detector.detect(f_region);
+					p_coarse.x += roi.x;
+					p_coarse.y += roi.y;
+				}else{
+					no_region++;
+				}
+				t_coarse.record(monotonic_ns() - t);
+
+				if(p_full.found)
+					found_full++;
+				if(p_coarse.found)
+					found_coarse++;
+				if(p_full.found && p_coarse.found && hypotf(p_full.x - p_coarse.x, p_full.y - p_coarse.y) <= 2.0f)
+					agree++;
+			}
+		}
+
+		printf("%s : %zu frames %ux%u, %d passes, %zu bytes per frame\n", argv[1], rec.frames.size(), w, h,
+				iterations, bytes / (rec.frames.size() * iterations));
+		report("full", t_full, t_full.mean());
+		report("turbo/8", t_turbo8, t_full.mean());
+		report("coarse", t_coarse, t_full.mean());
+		printf("pupil found : full %lu, coarse %lu, within 2 px %lu, no coarse region %lu\n",
+				found_full, found_coarse, agree, no_region);
+	}catch(const exception& e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
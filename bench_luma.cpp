@@ -0,0 +1,138 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <jpeglib.h>
+#include <linux/videodev2.h>
+
+#include "luma.h"
+#include "jpeg_luma.h"
+#include "latency_histogram.h"
+
+#define XRES 640
+#define YRES 480
+#define ITERATIONS 500
+
+using namespace std;
+
+/*
+	bench_luma - per-frame cost of getting a luma plane
+	Compares the raw YUYV path (SIMD and scalar) with MJPEG decode at full,
+	1/2 and 1/4 scale. Pass a captured frameN.jpg to use a real frame,
+	otherwise a synthetic 4:2:2 JPEG like the UVC camera sends is used.
+
+	usage : bench_luma [frame.jpg] [iterations]
+*/
+
+static vector<unsigned char> synthetic_jpeg(const vector<unsigned char>& yuyv)
+{
+	struct jpeg_compress_struct c;
+	struct jpeg_error_mgr err;
+	unsigned char *out = NULL;
+	unsigned long size = 0;
+	vector<unsigned char> row(XRES * 3);
+	JSAMPROW r = &row[0];
+	unsigned int x;
+
+	c.err = jpeg_std_error(&err);
+	jpeg_create_compress(&c);
+	jpeg_mem_dest(&c, &out, &size);
+
+	c.image_width = XRES;
+	c.image_height = YRES;
+	c.input_components = 3;
+	c.in_color_space = JCS_YCbCr;
+	jpeg_set_defaults(&c);
+	jpeg_set_quality(&c, 80, TRUE);
+	c.comp_info[0].h_samp_factor = 2;
+	c.comp_info[0].v_samp_factor = 1;
+
+	jpeg_start_compress(&c, TRUE);
+	while(c.next_scanline < YRES){
+		const unsigned char *s = &yuyv[c.next_scanline * XRES * 2];
+		for(x = 0; x < XRES; ++x){
+			row[3 * x] = s[2 * x];
+			row[3 * x + 1] = s[(x & ~1u) * 2 + 1];
+			row[3 * x + 2] = s[(x & ~1u) * 2 + 3];
+		}
+		jpeg_write_scanlines(&c, &r, 1);
+	}
+	jpeg_finish_compress(&c);
+	jpeg_destroy_compress(&c);
+
+	vector<unsigned char> jpeg(out, out + size);
+	free(out);
+	return jpeg;
+}
+
+static void report(const char *name, const LatencyHistogram& h)
+{
+	printf("%-24s mean %8.1f us  p50 %8.1f us  p99 %8.1f us\n", name,
+			h.mean() / 1000.0, h.percentile(50) / 1000.0, h.percentile(99) / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	vector<unsigned char> yuyv(XRES * YRES * 2), jpeg, luma(XRES * YRES);
+	JpegLumaDecoder decoder;
+	luma_frame frame;
+	int iterations = ITERATIONS;
+	unsigned int i, y, x, scale;
+	uint64_t t;
+
+	// soft blob on a gradient, close enough to an eye image for entropy coding //
+	for(y = 0; y < YRES; ++y){
+		for(x = 0; x < XRES; ++x){
+			int dx = (int)x - XRES / 2, dy = (int)y - YRES / 2;
+			yuyv[(y * XRES + x) * 2] = (dx * dx + dy * dy < 60 * 60) ? 20 : 100 + (x + y) / 16;
+			yuyv[(y * XRES + x) * 2 + 1] = 128;
+		}
+	}
+
+	if(argc > 1){
+		ifstream in(argv[1], ios::binary);
+		if(!in){
+			cerr << argv[1] << " : cannot open! " << endl;
+			return EXIT_FAILURE;
+		}
+		jpeg.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}else{
+		jpeg = synthetic_jpeg(yuyv);
+	}
+	if(argc > 2)
+		iterations = atoi(argv[2]);
+
+	LatencyHistogram simd, scalar, dec[3];
+
+	for(i = 0; i < (unsigned int)iterations; ++i){
+		t = monotonic_ns();
+		extract_luma(&yuyv[0], XRES * 2, XRES, YRES, V4L2_PIX_FMT_YUYV, &luma[0]);
+		simd.record(monotonic_ns() - t);
+
+		t = monotonic_ns();
+		for(y = 0; y < YRES; ++y)
+			luma_row_yuyv_scalar(&yuyv[y * XRES * 2], &luma[y * XRES], XRES);
+		scalar.record(monotonic_ns() - t);
+
+		for(scale = 0; scale < 3; ++scale){
+			t = monotonic_ns();
+			if(!decoder.decode(&jpeg[0], jpeg.size(), 1u << scale, &luma[0], luma.size(), &frame)){
+				cerr << "decode : " << decoder.last_error() << endl;
+				return EXIT_FAILURE;
+			}
+			dec[scale].record(monotonic_ns() - t);
+		}
+	}
+
+	printf("%d iterations, %ux%u, jpeg %zu bytes\n", iterations, XRES, YRES, jpeg.size());
+	report("yuyv luma (simd)", simd);
+	report("yuyv luma (scalar)", scalar);
+	report("mjpeg luma 1/1", dec[0]);
+	report("mjpeg luma 1/2", dec[1]);
+	report("mjpeg luma 1/4", dec[2]);
+
+	return 0;
+}
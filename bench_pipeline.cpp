@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include "picam_v4l2_ctrl.h"
+#include "replay_source.h"
+#include "stage_graph.h"
+#include "pipeline_stages.h"
+#include "luma.h"
+#include "latency_histogram.h"
+
+#define XRES 640
+#define YRES 480
+#define N_FRAMES 600
+#define N_ITEMS 16
+
+using namespace std;
+
+/*
+	bench_pipeline - the same pipeline on 1, 2 and 4 cores
+	Builds a StageGraph of
+
+	decode		MJPEG to luma (extract_luma() for raw formats), parallel, in order;
+				-m coarse decodes only the region around the 1/8 thumbnail's
+				darkest spot (DECODE_COARSE)
+	detect		PupilDetector, parallel, in order
+	track		serial, checks it sees frames in capture order
+
+	around a camera or a recording and runs it once per -c entry with the
+	capture thread on cpu 0 and a worker on each of cpus 0 .. n-1. Reports
+	the result rate, per-stage p50 / p99, steals, drops and whether
+	pinning worked (it fails for cpus the machine does not have). A
+	recording is replayed as fast as the graph takes it, so its result
+	rate is the pipeline throughput; a camera drops what it cannot take.
+
+	usage : bench_pipeline [-d device [-y] | -p session.pcam|dir] [-n frames] [-c 1,2,4] [-m full|coarse]
+*/
+
+// stand-in for a tracker or recorder, anything that needs frames in order //
+class TrackStage : public PipelineStage{
+public:
+	TrackStage() : results(0), found(0), out_of_order(0), last_seq(0), first(0), last(0) {}
+
+	bool process(pipe_item& item, unsigned int worker)
+	{
+		uint64_t now = monotonic_ns();
+
+		(void)worker;
+		if(results && item.seq <= last_seq)
+			out_of_order++;
+		last_seq = item.seq;
+		if(!first)
+			first = now;
+		last = now;
+		results++;
+		if(item.result.found)
+			found++;
+		return true;
+	}
+
+	unsigned long results, found, out_of_order;
+	uint64_t last_seq;
+	uint64_t first, last;
+};
+
+static double rate(unsigned long n, uint64_t first, uint64_t last)
+{
+	return n > 1 && last > first ? (n - 1) * 1e9 / (last - first) : 0;
+}
+
+static void print_hist(const char *name, const LatencyHistogram& h)
+{
+	if(!h.count())
+		return;
+	printf("  %-8s n %-7llu p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+			(unsigned long long)h.count(), h.percentile(50) / 1e3, h.percentile(99) / 1e3, h.max() / 1e3);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage : %s [-d device [-y] | -p session.pcam|dir] [-n frames] [-c 1,2,4] [-m full|coarse]\n",
+			prog);
+}
+
+int main(int argc, char *argv[])
+{
+	string device = "/dev/video0", replay;
+	string cores = "1,2,4";
+	unsigned int pixfmt = V4L2_PIX_FMT_MJPEG;
+	int n_frames = N_FRAMES;
+	unique_ptr<Picam> picam;
+	unique_ptr<ReplaySource> player;
+	CaptureSource *source;
+	vector<unsigned int> configs;
+	enum decode_mode mode = DECODE_FULL;
+	size_t stride = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:yp:n:c:m:")) != -1){
+		switch(opt){
+		case 'd': device = optarg; break;
+		case 'y': pixfmt = V4L2_PIX_FMT_YUYV; break;
+		case 'p': replay = optarg; break;
+		case 'n': n_frames = atoi(optarg); break;
+		case 'c': cores = optarg; break;
+		case 'm':
+			if(strcmp(optarg, "full") == 0)
+				mode = DECODE_FULL;
+			else if(strcmp(optarg, "coarse") == 0)
+				mode = DECODE_COARSE;
+			else{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for(const char *c = cores.c_str(); *c; ){
+		char *end;
+		long n = strtol(c, &end, 10);
+
+		if(end == c || n < 1){
+			usage(argv[0]);
+			return 1;
+		}
+		configs.push_back(n);
+		c = *end == ',' ? end + 1 : end;
+	}
+
+	try{
+		if(!replay.empty()){
+			player.reset(new ReplaySource(replay, REPLAY_FAST));
+			player->set_loop(true);
+			source = player.get();
+		}else{
+			picam.reset(new Picam(device, XRES, YRES, pixfmt));
+			stride = picam->bytes_per_line();
+			source = picam.get();
+		}
+
+		if(source->pixel_format() != V4L2_PIX_FMT_MJPEG && !luma_supported(source->pixel_format()))
+			throw runtime_error("unsupported pixel format");
+
+		printf("%s %ux%u, %d frames per run, %ld cpus online\n", replay.empty() ? device.c_str() : replay.c_str(),
+				source->width(), source->height(), n_frames, sysconf(_SC_NPROCESSORS_ONLN));
+
+		for(size_t k = 0; k < configs.size(); ++k){
+			DecodeStage decode(source->width(), source->height(), source->pixel_format(), stride, mode);
+			DetectStage detect(source->width(), source->height());
+			TrackStage track;
+			// a recording waits for the graph, a camera cannot //
+			StageGraph graph(source->max_frame_size(), source->width(), source->height(),
+					graph_config::cores(configs[k], N_ITEMS, player != NULL));
+			unsigned int i;
+
+			graph.add_stage("decode", &decode, configs[k], true);
+			graph.add_stage("detect", &detect, configs[k], true);
+			graph.add_stage("track", &track, 1, false);
+
+			if(player)
+				player->rewind();
+			graph.run(source, 1, n_frames);
+
+			graph_stats gs = graph.stats();
+
+			printf("%u core%s : %.1f results/s, %lu captured, %lu completed, %lu dropped, %lu waits, "
+					"%lu stolen, pupil found %lu, out of order %lu, pinned %s\n",
+					configs[k], configs[k] > 1 ? "s" : "", rate(track.results, track.first, track.last),
+					gs.captured, gs.completed, gs.dropped, gs.waits, gs.stolen, track.found,
+					track.out_of_order, gs.pinned ? "yes" : "no");
+			for(i = 0; i < graph.stages(); ++i){
+				stage_stats ss = graph.stats(i);
+
+				printf("  %-8s x%u peak %u, %lu dropped\n", ss.name.c_str(), ss.max_parallel,
+						ss.peak_parallel, ss.dropped);
+				print_hist(ss.name.c_str(), graph.stage_latency(i));
+			}
+			if(mode == DECODE_COARSE)
+				printf("  decoded whole, no coarse region : %lu\n", decode.fallbacks());
+			print_hist("e2e", graph.total_latency());
+		}
+	}catch(const exception& e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
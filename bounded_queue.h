@@ -0,0 +1,109 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+/*
+	BoundedQueue - fixed-capacity lock-free FIFO, any number of producers
+	and consumers. Same sequence scheme as AsyncFrameSink's ring: a cell's
+	seq tells whether it is free for the push at position pos (seq == pos)
+	or holds the value for the pop at pos (seq == pos + 1), so push and
+	pop each cost one CAS on their index. T must be cheap to copy.
+*/
+template <typename T>
+class BoundedQueue{
+public:
+	BoundedQueue(size_t capacity = 0) { reset(capacity); }
+
+	// not thread safe, before the queue is shared //
+	void reset(size_t capacity)
+	{
+		size_t i;
+
+		cells = std::vector<cell>(capacity ? capacity : 1);
+		for(i = 0; i < cells.size(); ++i)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	// false if full //
+	bool push(const T& v)
+	{
+		size_t pos = head.load(std::memory_order_relaxed);
+
+		for(;;){
+			cell& c = cells[pos % cells.size()];
+			intptr_t diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+
+			if(diff == 0){
+				if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+					c.value = v;
+					c.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}else if(diff < 0){
+				return false;
+			}else{
+				pos = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// false if empty //
+	bool pop(T *v)
+	{
+		size_t pos = tail.load(std::memory_order_relaxed);
+
+		for(;;){
+			cell& c = cells[pos % cells.size()];
+			intptr_t diff = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+
+			if(diff == 0){
+				if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+					*v = c.value;
+					c.seq.store(pos + cells.size(), std::memory_order_release);
+					return true;
+				}
+			}else if(diff < 0){
+				return false;
+			}else{
+				pos = tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// a hint only while other threads push or pop //
+	bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+	size_t capacity() const { return cells.size(); }
+private:
+	BoundedQueue(const BoundedQueue&);
+	BoundedQueue& operator=(const BoundedQueue&);
+
+	struct cell{
+		std::atomic<size_t> seq;
+		T value;
+
+		cell() : seq(0), value() {}
+		cell(const cell& o) : seq(o.seq.load(std::memory_order_relaxed)), value(o.value) {}
+		cell& operator=(const cell& o)
+		{
+			seq.store(o.seq.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			value = o.value;
+			return *this;
+		}
+	};
+
+	std::vector<cell> cells;
+	// producers and consumers on separate lines //
+	char pad0[64];
+	std::atomic<size_t> head;
+	char pad1[64];
+	std::atomic<size_t> tail;
+	char pad2[64];
+};
+
+#endif
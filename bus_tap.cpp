@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+
+#include "frame_bus.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+/*
+	bus_tap [-n frames] [-s every] [-b name] : attach to the frame bus of
+	a running grab -b, print rate, lost frames and sensor-to-reader latency
+	once a second. -s N also saves every Nth MJPEG frame as busN.jpg.
+	A reader of the bus can be killed or stopped at any time.
+*/
+int main(int argc, char *argv[])
+{
+	const char *name = FRAME_BUS_NAME;
+	long n_frames = -1;
+	unsigned int every = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:s:b:")) != -1){
+		switch(opt){
+		case 'n': n_frames = atol(optarg); break;
+		case 's': every = atoi(optarg); break;
+		case 'b': name = optarg; break;
+		default:
+			fprintf(stderr, "usage : %s [-n frames] [-s every] [-b name]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	try{
+		FrameBusReader bus(name);
+		JpegFileSink jpeg("bus");
+		LatencyHistogram lat;
+		unsigned long frames = 0, torn = 0, window = 0;
+		uint64_t start = monotonic_ns();
+
+		printf("%s : %ux%u, frames up to %zu bytes\n", name, bus.width(), bus.height(), bus.max_frame_size());
+
+		while(n_frames < 0 || (long)frames < n_frames){
+			bus_frame f;
+			uint64_t now;
+
+			if(!bus.next(&f, 1000)){
+				if(!bus.connected()){
+					printf("bus closed\n");
+					break;
+				}
+				continue;
+			}
+
+			now = monotonic_ns();
+			if(now > f.info.timestamp_ns)
+				lat.record(now - f.info.timestamp_ns);
+
+			if(every && f.pixelformat == V4L2_PIX_FMT_MJPEG && f.info.frame_number % every == 0){
+				// written straight from the shared slot, checked afterwards //
+				jpeg.consume(f.data, f.size, f.info);
+				if(!bus.valid(f))
+					torn++;
+			}
+			frames++;
+			window++;
+
+			if(now - start >= 1000000000ULL){
+				printf("%.1f fps, lost %lu, torn %lu, latency p50 %.2f ms max %.2f ms\n",
+						window * 1e9 / (now - start), bus.lost(), torn,
+						lat.percentile(50) / 1e6, lat.max() / 1e6);
+				lat.reset();
+				window = 0;
+				start = now;
+			}
+		}
+	}catch(const exception& e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
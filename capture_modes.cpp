@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+
+#include <linux/videodev2.h>
+
+#include "capture_modes.h"
+#include "luma.h"
+
+#define CLEAR(x) memset(&(x),0, sizeof(x))
+#define CACHE_MAGIC "picam-modes 2"	// 1 could hold a phantom 1..16384 mode for stepwise drivers
+
+using namespace std;
+
+static int xioctl(int fh, unsigned long int request, void *arg)
+{
+	int r;
+
+	do{
+		r = ioctl(fh, request, arg);
+	}while(-1 == r && EINTR == errno);
+
+	return r;
+}
+
+struct interval_range{
+	uint32_t num, den;			// fastest
+	uint32_t max_num, max_den;	// slowest
+};
+
+// frame intervals of one format and size; {0, 0} if the driver cannot tell //
+static vector<interval_range> enumerate_intervals(int fd, uint32_t pixelformat, unsigned int w, unsigned int h)
+{
+	vector<interval_range> out;
+	struct v4l2_frmivalenum iv;
+	interval_range r;
+
+	CLEAR(iv);
+	iv.pixel_format = pixelformat;
+	iv.width = w;
+	iv.height = h;
+
+	for(iv.index = 0; 0 == xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &iv); ++iv.index){
+		if(iv.type == V4L2_FRMIVAL_TYPE_DISCRETE){
+			r.num = r.max_num = iv.discrete.numerator;
+			r.den = r.max_den = iv.discrete.denominator;
+			out.push_back(r);
+		}else{
+			r.num = iv.stepwise.min.numerator;
+			r.den = iv.stepwise.min.denominator;
+			r.max_num = iv.stepwise.max.numerator;
+			r.max_den = iv.stepwise.max.denominator;
+			out.push_back(r);
+			break;
+		}
+	}
+
+	if(out.empty()){
+		CLEAR(r);
+		out.push_back(r);
+	}
+	return out;
+}
+
+static void add_modes(int fd, vector<capture_mode>& out, uint32_t pixelformat,
+		unsigned int min_w, unsigned int max_w, unsigned int step_w,
+		unsigned int min_h, unsigned int max_h, unsigned int step_h)
+{
+	// a range is probed at its largest size, the slowest it gets; select_mode() probes again at the size it picks //
+	vector<interval_range> iv = enumerate_intervals(fd, pixelformat, max_w, max_h);
+	size_t i;
+
+	for(i = 0; i < iv.size(); ++i){
+		capture_mode m;
+
+		m.pixelformat = pixelformat;
+		m.min_width = min_w;
+		m.max_width = max_w;
+		m.step_width = step_w ? step_w : 1;
+		m.min_height = min_h;
+		m.max_height = max_h;
+		m.step_height = step_h ? step_h : 1;
+		m.interval_num = iv[i].num;
+		m.interval_den = iv[i].den;
+		m.max_interval_num = iv[i].max_num;
+		m.max_interval_den = iv[i].max_den;
+		out.push_back(m);
+	}
+}
+
+vector<capture_mode> enumerate_modes(int fd)
+{
+	vector<capture_mode> out;
+	struct v4l2_fmtdesc fd_desc;
+
+	CLEAR(fd_desc);
+	fd_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	for(fd_desc.index = 0; 0 == xioctl(fd, VIDIOC_ENUM_FMT, &fd_desc); ++fd_desc.index){
+		struct v4l2_frmsizeenum fs;
+		uint32_t f = fd_desc.pixelformat;
+		bool any_size = false;
+
+		// only what Picam can hand on //
+		if(f != V4L2_PIX_FMT_MJPEG && !luma_supported(f))
+			continue;
+
+		CLEAR(fs);
+		fs.pixel_format = f;
+		for(fs.index = 0; 0 == xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &fs); ++fs.index){
+			any_size = true;
+			if(fs.type == V4L2_FRMSIZE_TYPE_DISCRETE){
+				add_modes(fd, out, f, fs.discrete.width, fs.discrete.width, 1,
+						fs.discrete.height, fs.discrete.height, 1);
+			}else{
+				add_modes(fd, out, f, fs.stepwise.min_width, fs.stepwise.max_width, fs.stepwise.step_width,
+						fs.stepwise.min_height, fs.stepwise.max_height, fs.stepwise.step_height);
+				break;
+			}
+		}
+
+		// no ENUM_FRAMESIZES: anything goes, S_FMT will say //
+		if(!any_size)
+			add_modes(fd, out, f, 1, 16384, 1, 1, 16384, 1);
+	}
+
+	return out;
+}
+
+static string cache_path(const string& key)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	string dir, name;
+	size_t i;
+
+	if(xdg && *xdg)
+		dir = xdg;
+	else if(home && *home)
+		dir = string(home) + "/.cache";
+	else
+		return "";
+
+	mkdir(dir.c_str(), 0755);
+	dir += "/picam";
+	mkdir(dir.c_str(), 0755);
+
+	for(i = 0; i < key.size(); ++i)
+		name += isalnum((unsigned char)key[i]) ? key[i] : '_';
+	return dir + "/" + name + ".modes";
+}
+
+static bool load_cache(const string& path, vector<capture_mode> *out)
+{
+	ifstream in(path.c_str());
+	string line;
+
+	if(path.empty() || !in || !getline(in, line) || line != CACHE_MAGIC)
+		return false;
+
+	out->clear();
+	while(getline(in, line)){
+		istringstream s(line);
+		capture_mode m;
+
+		s >> hex >> m.pixelformat >> dec >> m.min_width >> m.max_width >> m.step_width
+			>> m.min_height >> m.max_height >> m.step_height
+			>> m.interval_num >> m.interval_den >> m.max_interval_num >> m.max_interval_den;
+		if(!s)
+			return false;
+		out->push_back(m);
+	}
+
+	return !out->empty();
+}
+
+static void save_cache(const string& path, const vector<capture_mode>& modes)
+{
+	string tmp = path + ".tmp";
+	size_t i;
+
+	if(path.empty())
+		return;
+
+	{
+		ofstream o(tmp.c_str());
+
+		if(!o)
+			return;
+		o << CACHE_MAGIC << "\n";
+		for(i = 0; i < modes.size(); ++i){
+			const capture_mode& m = modes[i];
+
+			o << hex << m.pixelformat << dec << " " << m.min_width << " " << m.max_width << " " << m.step_width
+				<< " " << m.min_height << " " << m.max_height << " " << m.step_height
+				<< " " << m.interval_num << " " << m.interval_den
+				<< " " << m.max_interval_num << " " << m.max_interval_den << "\n";
+		}
+		if(!o)
+			return;
+	}
+
+	// readers never see a half-written cache //
+	rename(tmp.c_str(), path.c_str());
+}
+
+vector<capture_mode> device_modes(int fd, const string& key, bool refresh)
+{
+	static mutex lock;
+	static map<string, vector<capture_mode> > cache;
+	lock_guard<mutex> lk(lock);
+	string path = cache_path(key);
+	vector<capture_mode> modes;
+
+	if(!refresh){
+		map<string, vector<capture_mode> >::const_iterator it = cache.find(key);
+
+		if(it != cache.end())
+			return it->second;
+		if(load_cache(path, &modes)){
+			cache[key] = modes;
+			return modes;
+		}
+	}
+
+	modes = enumerate_modes(fd);
+	if(!modes.empty()){
+		cache[key] = modes;
+		save_cache(path, modes);
+	}
+	return modes;
+}
+
+// bytes of one raw frame, MJPEG estimated at a tenth of YUYV //
+static uint64_t frame_bytes(uint32_t pixelformat, unsigned int w, unsigned int h)
+{
+	uint64_t px = (uint64_t)w * h;
+
+	switch(pixelformat){
+	case V4L2_PIX_FMT_GREY:
+		return px;
+	case V4L2_PIX_FMT_NV12:
+		return px * 3 / 2;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		return px * 2;
+	default:
+		return px * 2 / 10;
+	}
+}
+
+// size on the range closest to want from above, false if want is past max //
+static bool fit(unsigned int want, unsigned int lo, unsigned int hi, unsigned int step, unsigned int *out)
+{
+	uint64_t v;
+
+	if(want == 0){
+		*out = hi;
+		return true;
+	}
+	if(want <= lo){
+		*out = lo;
+		return true;
+	}
+
+	v = lo + ((uint64_t)want - lo + step - 1) / step * step;
+	if(v > hi)
+		return false;
+	*out = v;
+	return true;
+}
+
+static bool same_range(const capture_mode& a, const capture_mode& b)
+{
+	return a.pixelformat == b.pixelformat
+		&& a.min_width == b.min_width && a.max_width == b.max_width && a.step_width == b.step_width
+		&& a.min_height == b.min_height && a.max_height == b.max_height && a.step_height == b.step_height;
+}
+
+// size ranges narrowed to the size req programs on them, with the intervals the driver gives there //
+static vector<capture_mode> probe_ranges(int fd, const vector<capture_mode>& modes, const mode_request& req)
+{
+	vector<capture_mode> out;
+	size_t i, j, k;
+
+	for(i = 0; i < modes.size(); i = j){
+		const capture_mode& m = modes[i];
+		vector<interval_range> iv;
+		unsigned int w, h;
+
+		// the cache has one mode per interval of a range, in a row //
+		for(j = i + 1; j < modes.size() && same_range(modes[j], m); ++j)
+			;
+
+		if((m.min_width != m.max_width || m.min_height != m.max_height)
+				&& fit(req.width, m.min_width, m.max_width, m.step_width, &w)
+				&& fit(req.height, m.min_height, m.max_height, m.step_height, &h))
+			iv = enumerate_intervals(fd, m.pixelformat, w, h);
+
+		// discrete, out of reach or no intervals at that size: as enumerated //
+		if(iv.empty() || iv[0].num == 0){
+			out.insert(out.end(), modes.begin() + i, modes.begin() + j);
+			continue;
+		}
+
+		for(k = 0; k < iv.size(); ++k){
+			capture_mode n = m;
+
+			n.min_width = n.max_width = w;
+			n.min_height = n.max_height = h;
+			n.interval_num = iv[k].num;
+			n.interval_den = iv[k].den;
+			n.max_interval_num = iv[k].max_num;
+			n.max_interval_den = iv[k].max_den;
+			out.push_back(n);
+		}
+	}
+
+	return out;
+}
+
+bool select_mode(const vector<capture_mode>& all, const mode_request& req, mode_choice *out, int fd)
+{
+	vector<capture_mode> probed = fd >= 0 ? probe_ranges(fd, all, req) : vector<capture_mode>();
+	const vector<capture_mode>& modes = fd >= 0 ? probed : all;
+	bool found = false;
+	bool best_exact = false, best_raw = false;
+	uint64_t best_area = 0;
+	size_t i;
+
+	for(i = 0; i < modes.size(); ++i){
+		const capture_mode& m = modes[i];
+		bool raw = m.pixelformat != V4L2_PIX_FMT_MJPEG;
+		mode_choice c;
+		uint64_t bytes, period, transfer, area;
+		bool exact;
+
+		if(!fit(req.width, m.min_width, m.max_width, m.step_width, &c.width)
+				|| !fit(req.height, m.min_height, m.max_height, m.step_height, &c.height))
+			continue;
+
+		c.pixelformat = m.pixelformat;
+		c.interval_num = m.interval_num;
+		c.interval_den = m.interval_den;
+		bytes = frame_bytes(m.pixelformat, c.width, c.height);
+
+		// a raw stream the link cannot carry: slow a stepwise rate down to fit //
+		if(raw && req.bandwidth && c.interval_num && bytes * c.interval_den > req.bandwidth * c.interval_num){
+			if(m.max_interval_num == m.interval_num && m.max_interval_den == m.interval_den)
+				continue;
+			c.interval_num = 1;
+			c.interval_den = req.bandwidth / bytes;
+			if(c.interval_den == 0 || (uint64_t)m.max_interval_den > (uint64_t)m.max_interval_num * c.interval_den)
+				continue;
+		}
+
+		// unknown interval: whatever S_PARM grants, assumed to be req.fps //
+		if(c.interval_num == 0){
+			c.interval_num = 1;
+			c.interval_den = req.fps ? req.fps : 30;
+		}
+
+		if(req.fps && (uint64_t)c.interval_den < (uint64_t)req.fps * c.interval_num)
+			continue;
+
+		period = (uint64_t)c.interval_num * 1000000000ULL / c.interval_den;
+		transfer = req.bandwidth ? bytes * 1000000000ULL / req.bandwidth : 0;
+		c.latency_ns = period + transfer;
+		if(req.max_latency_ns && c.latency_ns > req.max_latency_ns)
+			continue;
+
+		raw = raw && req.prefer_raw;
+		exact = c.width == req.width && c.height == req.height;
+		area = (uint64_t)c.width * c.height;
+
+		if(found){
+			if(exact != best_exact){
+				if(!exact)
+					continue;
+			}else if(raw != best_raw){
+				if(!raw)
+					continue;
+			}else if(c.latency_ns != out->latency_ns){
+				if(c.latency_ns > out->latency_ns)
+					continue;
+			}else if(area >= best_area){
+				continue;
+			}
+		}
+
+		*out = c;
+		found = true;
+		best_exact = exact;
+		best_raw = raw;
+		best_area = area;
+	}
+
+	return found;
+}
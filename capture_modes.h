@@ -0,0 +1,68 @@
+#ifndef CAPTURE_MODES_H
+#define CAPTURE_MODES_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+	One entry of the VIDIOC_ENUM_FMT / ENUM_FRAMESIZES / ENUM_FRAMEINTERVALS
+	tree. Discrete sizes have min == max; stepwise and continuous ones
+	(bcm2835-v4l2, vivid) keep their range and step. Intervals are in
+	seconds per frame, fastest first; a discrete interval list becomes
+	one mode per interval.
+*/
+struct capture_mode{
+	uint32_t pixelformat;
+	unsigned int min_width, max_width, step_width;
+	unsigned int min_height, max_height, step_height;
+	uint32_t interval_num, interval_den;			// fastest frame period
+	uint32_t max_interval_num, max_interval_den;	// slowest, same as fastest if discrete
+};
+
+// what the caller needs; 0 leaves a field unconstrained //
+struct mode_request{
+	unsigned int width, height;
+	unsigned int fps;				// at least this many frames per second
+	uint64_t max_latency_ns;		// frame period plus estimated transfer time
+	uint64_t bandwidth;				// bytes per second the link sustains
+	bool prefer_raw;				// raw over MJPEG when bandwidth allows
+
+	mode_request() :
+		width(640), height(480), fps(60), max_latency_ns(0),
+		bandwidth(24000000), prefer_raw(true) {}
+};
+
+// a concrete mode to program with S_FMT / S_PARM //
+struct mode_choice{
+	uint32_t pixelformat;
+	unsigned int width, height;
+	uint32_t interval_num, interval_den;
+	uint64_t latency_ns;			// the estimate the choice was ranked by
+};
+
+// every mode of the open device fd, straight from the driver //
+std::vector<capture_mode> enumerate_modes(int fd);
+
+/*
+	enumerate_modes() through a cache keyed by key (driver, card, bus and
+	version from VIDIOC_QUERYCAP). The cache lives in this process and in
+	$XDG_CACHE_HOME/picam (~/.cache/picam), so later starts skip the
+	enumeration, which takes hundreds of ioctls on some UVC cameras.
+	refresh drops the cached entry and probes again.
+*/
+std::vector<capture_mode> device_modes(int fd, const std::string& key, bool refresh = false);
+
+/*
+	Best mode for req: the requested size (or the smallest larger one),
+	at least req.fps, within max_latency_ns and bandwidth. Among those,
+	exact size first, then raw formats Picam can read luma from when
+	prefer_raw, then the lowest latency estimate. false if none fits.
+	Stepwise ranges carry the intervals of their largest size; given the
+	device's fd they are probed again at the size that would be
+	programmed, so a range competes with its real frame rate.
+*/
+bool select_mode(const std::vector<capture_mode>& modes, const mode_request& req, mode_choice *out,
+		int fd = -1);
+
+#endif
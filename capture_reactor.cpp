@@ -0,0 +1,252 @@
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <stdexcept>
+
+#include "capture_reactor.h"
+#include "latency_histogram.h"
+
+#define MAX_EVENTS 8
+#define STOP_TAG UINT64_MAX
+#define GPIO_TAG (1ULL << 32)		// tag of gpio input i is GPIO_TAG | i
+#define REARM_POLL_NS 10000000ULL	// recheck period for a camera taken out of epoll
+
+using namespace std;
+
+CaptureReactor::CaptureReactor() :
+	stopping(false)
+{
+	struct epoll_event ev;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(-1 == epfd)
+		throw runtime_error("epoll_create1");
+
+	stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(-1 == stopfd){
+		close(epfd);
+		throw runtime_error("eventfd");
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = STOP_TAG;
+	if(-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &ev)){
+		close(stopfd);
+		close(epfd);
+		throw runtime_error("epoll_ctl");
+	}
+}
+
+CaptureReactor::~CaptureReactor()
+{
+	close(stopfd);
+	close(epfd);
+}
+
+unsigned int CaptureReactor::add(Picam *cam, FrameHandler *handler, int watchdog_ms)
+{
+	camera c;
+
+	if(!cam || !handler)
+		throw runtime_error("CaptureReactor : camera and handler are required");
+
+	c.cam = cam;
+	c.handler = handler;
+	c.watchdog_ns = (uint64_t)watchdog_ms * 1000000ULL;
+	c.last_frame = monotonic_ns();
+	c.armed = false;
+	memset(&c.st, 0, sizeof(c.st));
+
+	cam->start_capturing();
+
+	cams.push_back(c);
+	arm(cams.size() - 1, true);
+	return cams.size() - 1;
+}
+
+unsigned int CaptureReactor::add_gpio(Raspi2Gpio *gpio, EdgeHandler *handler)
+{
+	struct epoll_event ev;
+	gpio_input g;
+
+	if(!gpio || !handler)
+		throw runtime_error("CaptureReactor : gpio and handler are required");
+
+	g.gpio = gpio;
+	g.handler = handler;
+	g.next_seq = 0;
+	memset(&g.st, 0, sizeof(g.st));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = GPIO_TAG | gpios.size();
+	if(-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, gpio->file_descriptor(), &ev))
+		throw runtime_error("CaptureReactor : epoll_ctl gpio");
+
+	gpios.push_back(g);
+	return gpios.size() - 1;
+}
+
+void CaptureReactor::arm(unsigned int index, bool on)
+{
+	camera& c = cams[index];
+	struct epoll_event ev;
+
+	if(c.armed == on)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = index;
+	if(-1 == epoll_ctl(epfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, c.cam->file_descriptor(), &ev))
+		throw runtime_error(c.cam->device_name() + " : epoll_ctl");
+
+	c.armed = on;
+}
+
+void CaptureReactor::stop()
+{
+	uint64_t one = 1;
+
+	if(write(stopfd, &one, sizeof(one)) < 0){
+		// counter already non-zero, the loop is waking up anyway //
+	}
+}
+
+unsigned int CaptureReactor::dispatch(camera& c)
+{
+	unsigned int n = 0;
+
+	// drain everything that is ready, the fd is level triggered //
+	for(;;){
+		FrameRef frame = c.cam->read_frame();
+		if(!frame)
+			break;
+
+		c.last_frame = monotonic_ns();
+		c.st.frames++;
+		n++;
+		c.handler->on_frame(*c.cam, frame);
+	}
+
+	return n;
+}
+
+void CaptureReactor::dispatch_edges(gpio_input& g)
+{
+	raspi2_gpio_event ev;
+
+	while(g.gpio->read_event(&ev, 0)){
+		if(g.st.edges && ev.seq != g.next_seq)
+			g.st.lost += ev.seq - g.next_seq;
+		g.next_seq = ev.seq + 1;
+		g.st.edges++;
+		g.handler->on_edge(*g.gpio, ev);
+	}
+}
+
+void CaptureReactor::check_watchdogs(uint64_t now)
+{
+	unsigned int i;
+
+	for(i = 0; i < cams.size(); ++i){
+		camera& c = cams[i];
+
+		// a queue with buffers in it no longer reports EPOLLERR //
+		if(!c.armed && c.cam->is_streaming() && c.cam->frames_leased() < c.cam->buffer_count())
+			arm(i, true);
+
+		if(c.watchdog_ns == 0 || now - c.last_frame < c.watchdog_ns)
+			continue;
+
+		c.st.stalls++;
+		c.last_frame = now;
+		try{
+			c.cam->restart_capturing();
+			c.st.restarts++;
+		}catch(const exception&){
+			c.st.errors++;
+		}
+		c.handler->on_stall(*c.cam);
+	}
+}
+
+int CaptureReactor::next_deadline_ms(uint64_t now, int max_wait_ms) const
+{
+	uint64_t wait = (uint64_t)max_wait_ms * 1000000ULL;
+	unsigned int i;
+
+	for(i = 0; i < cams.size(); ++i){
+		uint64_t due;
+
+		if(!cams[i].armed && wait > REARM_POLL_NS)
+			wait = REARM_POLL_NS;
+		if(cams[i].watchdog_ns == 0)
+			continue;
+		due = cams[i].last_frame + cams[i].watchdog_ns;
+		if(due <= now)
+			return 0;
+		if(due - now < wait)
+			wait = due - now;
+	}
+
+	// round up so we never wake just before a deadline and spin //
+	return (int)((wait + 999999) / 1000000);
+}
+
+unsigned int CaptureReactor::poll_once(int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	unsigned int n = 0;
+	int i, r;
+
+	r = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+	if(-1 == r){
+		if(EINTR == errno)
+			return 0;
+		throw runtime_error("epoll_wait");
+	}
+
+	for(i = 0; i < r; ++i){
+		uint64_t tag = events[i].data.u64;
+
+		if(tag == STOP_TAG){
+			uint64_t count;
+			if(read(stopfd, &count, sizeof(count)) == sizeof(count))
+				stopping = true;
+			continue;
+		}
+
+		if(tag & GPIO_TAG){
+			dispatch_edges(gpios[tag & ~GPIO_TAG]);
+			continue;
+		}
+
+		if(events[i].events & EPOLLERR){
+			/*
+				V4L2 reports EPOLLERR while the stream is off or every
+				buffer is leased, and epoll keeps reporting it. Take the fd
+				out until a buffer is back or the watchdog restarts it.
+			*/
+			cams[tag].st.errors++;
+			arm(tag, false);
+			continue;
+		}
+
+		n += dispatch(cams[tag]);
+	}
+
+	check_watchdogs(monotonic_ns());
+	return n;
+}
+
+void CaptureReactor::run(int max_wait_ms)
+{
+	stopping = false;
+	while(!stopping)
+		poll_once(next_deadline_ms(monotonic_ns(), max_wait_ms));
+}
@@ -0,0 +1,102 @@
+#ifndef CAPTURE_REACTOR_H
+#define CAPTURE_REACTOR_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "picam_v4l2_ctrl.h"
+#include "raspi2_gpio.h"
+
+// per-camera consumer called on the reactor thread //
+class FrameHandler{
+public:
+	virtual ~FrameHandler() {}
+
+	virtual void on_frame(Picam& cam, const FrameRef& frame) = 0;
+	// the watchdog restarted cam's stream after no frame for watchdog_ms //
+	virtual void on_stall(Picam& cam) { (void)cam; }
+};
+
+// GPIO edge consumer, also called on the reactor thread //
+class EdgeHandler{
+public:
+	virtual ~EdgeHandler() {}
+
+	virtual void on_edge(Raspi2Gpio& gpio, const raspi2_gpio_event& ev) = 0;
+};
+
+struct camera_stats{
+	unsigned long frames;		// frames dispatched
+	unsigned long stalls;		// watchdog expiries
+	unsigned long restarts;		// successful STREAMOFF / STREAMON cycles
+	unsigned long errors;		// EPOLLERR or failed restarts
+};
+
+struct edge_stats{
+	unsigned long edges;		// events dispatched
+	unsigned long lost;			// sequence gaps, the driver fifo overflowed
+};
+
+/*
+	CaptureReactor - one thread driving several cameras
+	Every camera fd is registered with epoll, an eventfd wakes the loop
+	for stop(). The epoll timeout is the nearest watchdog deadline, so an
+	idle reactor sleeps and a stalled camera is restarted instead of
+	throwing like Picam::mainloop(). GPIO inputs with edge events enabled
+	(Raspi2Gpio::set_edge()) sit in the same epoll set, so a trigger line
+	and the cameras it controls are served by one thread.
+*/
+class CaptureReactor{
+public:
+	CaptureReactor();
+	~CaptureReactor();
+
+	// returns the camera index used by stats() //
+	unsigned int add(Picam *cam, FrameHandler *handler, int watchdog_ms = 500);
+	// returns the input index used by gpio_stats() //
+	unsigned int add_gpio(Raspi2Gpio *gpio, EdgeHandler *handler);
+
+	// dispatch until stop(); max_wait_ms bounds a single epoll_wait //
+	void run(int max_wait_ms = 100);
+	// one epoll_wait of at most timeout_ms, returns frames dispatched //
+	unsigned int poll_once(int timeout_ms);
+	// safe from any thread and from signal handlers //
+	void stop();
+
+	camera_stats stats(unsigned int index) const { return cams[index].st; }
+	unsigned int cameras() const { return cams.size(); }
+	edge_stats gpio_stats(unsigned int index) const { return gpios[index].st; }
+private:
+	CaptureReactor(const CaptureReactor&);
+	CaptureReactor& operator=(const CaptureReactor&);
+
+	struct camera{
+		Picam *cam;
+		FrameHandler *handler;
+		uint64_t watchdog_ns;
+		uint64_t last_frame;
+		bool armed;
+		camera_stats st;
+	};
+
+	struct gpio_input{
+		Raspi2Gpio *gpio;
+		EdgeHandler *handler;
+		uint32_t next_seq;
+		edge_stats st;
+	};
+
+	void arm(unsigned int index, bool on);
+	unsigned int dispatch(camera& c);
+	void dispatch_edges(gpio_input& g);
+	void check_watchdogs(uint64_t now);
+	int next_deadline_ms(uint64_t now, int max_wait_ms) const;
+
+	int epfd;
+	int stopfd;
+	bool stopping;
+	std::vector<camera> cams;
+	std::vector<gpio_input> gpios;
+};
+
+#endif
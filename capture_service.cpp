@@ -0,0 +1,352 @@
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <stdexcept>
+
+#include "capture_service.h"
+#include "local_socket.h"
+
+#define WATCHDOG_MS 1000
+#define COMMAND_MAX 512
+#define SESSION_SLACK_MS 5000	// beyond frames / fps before a session gives up
+
+using namespace std;
+
+void CaptureService::SessionSink::consume(const void *p, size_t size, const frame_info& info)
+{
+	lock_guard<mutex> lk(lock);
+
+	// frames of an aborted session still in the queue are dropped //
+	if(target)
+		target->consume(p, size, info);
+}
+
+void CaptureService::SessionSink::set(FrameSink *t)
+{
+	lock_guard<mutex> lk(lock);
+	target = t;
+}
+
+CaptureService::CaptureService(const string& device, unsigned int width, unsigned int height,
+		StrobeScheduler *strobe, int flash_output, const string& control) :
+	t_created(monotonic_ns()),
+	cam(new Picam(device, width, height)),
+	strobe(strobe), flash_output(flash_output), head(NULL),
+	control(control), listen_fd(-1), stop_fd(-1),
+	state(SESSION_IDLE), quitting(false), t_request(0), want(0), got(0), first_frame(0),
+	flash_first(0), flash_last(0), flash_scheduled(false), ttff(0)
+{
+	memset(&st, 0, sizeof(st));
+
+	async.reset(new AsyncFrameSink(&session_sink, cam->max_frame_size(), SERVICE_SINK_DEPTH, BP_DROP_OLDEST));
+	if(strobe){
+		tap.reset(new StrobeTap(strobe, async.get()));
+		head = tap.get();
+	}else{
+		head = async.get();
+	}
+
+	listen_fd = local_listen(control, 4);
+	if(-1 == listen_fd)
+		throw runtime_error(control + " : cannot listen, is another service running?");
+
+	// streaming from here on, the cold start ends with the first frame //
+	reactor.add(cam.get(), this, WATCHDOG_MS);
+
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	thread = std::thread(&CaptureService::serve, this);
+}
+
+CaptureService::~CaptureService()
+{
+	{
+		lock_guard<mutex> lk(lock);
+		quitting = true;
+	}
+	changed.notify_all();
+	wake_eventfd(stop_fd);
+	thread.join();
+
+	close(stop_fd);
+	close(listen_fd);
+
+	async->flush();
+	session_sink.set(NULL);
+	cam->stop_capturing();
+}
+
+void CaptureService::run()
+{
+	reactor.run();
+}
+
+void CaptureService::stop()
+{
+	reactor.stop();
+}
+
+service_stats CaptureService::stats() const
+{
+	lock_guard<mutex> lk(lock);
+	return st;
+}
+
+void CaptureService::register_metrics(MetricsRegistry *reg, const string& prefix)
+{
+	reg->add(prefix + ".sessions", METRIC_COUNTER, [this]() { return (int64_t)stats().sessions; });
+	reg->add(prefix + ".cold_ttff_ns", METRIC_GAUGE, [this]() { return (int64_t)stats().cold_ttff_ns; });
+	reg->add(prefix + ".warm_ttff_ns", &warm);
+}
+
+void CaptureService::on_frame(Picam&, const FrameRef& frame)
+{
+	const frame_info& info = frame.info();
+	uint64_t now = monotonic_ns();
+	bool feed = false;
+
+	{
+		lock_guard<mutex> lk(lock);
+
+		if(st.frames++ == 0)
+			st.cold_ttff_ns = now - t_created;
+
+		if(state == SESSION_ARMED && info.timestamp_ns >= t_request){
+			state = SESSION_RUNNING;
+			first_frame = info.frame_number;
+			ttff = now - t_request;
+			if(strobe && flash_output >= 0 && flash_last >= flash_first && flash_first > 0){
+				strobe->schedule(flash_output, first_frame + flash_first - 1, first_frame + flash_last - 1);
+				flash_scheduled = true;
+			}
+		}
+		feed = state == SESSION_RUNNING;
+	}
+
+	if(!feed){
+		// idle frames only keep the strobe's frame clock running //
+		if(strobe)
+			strobe->observe(info);
+		return;
+	}
+
+	head->consume(frame.data(), frame.size(), info);
+
+	{
+		lock_guard<mutex> lk(lock);
+
+		// the control thread may have given up on the session meanwhile //
+		if(state == SESSION_RUNNING && ++got == want){
+			state = SESSION_DONE;
+			changed.notify_all();
+		}
+	}
+}
+
+void CaptureService::on_stall(Picam&)
+{
+	lock_guard<mutex> lk(lock);
+	st.stalls++;
+}
+
+string CaptureService::start_session(unsigned int frames, const string& path, int first, int last)
+{
+	uint64_t t0 = monotonic_ns();
+	ostringstream reply;
+	unique_ptr<ContainerWriter> writer;
+	sink_stats before, after;
+	double fps = cam->frame_rate();
+	uint64_t limit_ms = SESSION_SLACK_MS + (uint64_t)(frames * 1000 / (fps > 0 ? fps : 30));
+	bool complete;
+	unsigned int n;
+	uint64_t took;
+
+	writer.reset(new ContainerWriter(path, cam->width(), cam->height(), cam->pixel_format()));
+	before = async->stats();
+	session_sink.set(writer.get());
+
+	{
+		unique_lock<mutex> lk(lock);
+
+		t_request = t0;
+		want = frames;
+		got = 0;
+		flash_first = first;
+		flash_last = last;
+		flash_scheduled = false;
+		state = SESSION_ARMED;
+
+		complete = changed.wait_for(lk, chrono::milliseconds(limit_ms),
+				[this]() { return state == SESSION_DONE || quitting; }) && state == SESSION_DONE;
+		n = got;
+		took = ttff;
+		state = SESSION_IDLE;
+		if(complete)
+			st.sessions++;
+		// the client is told it failed, so its flash must not fire on idle frames //
+		else if(flash_scheduled)
+			strobe->unschedule(flash_output, first_frame + flash_first - 1, first_frame + flash_last - 1);
+		flash_scheduled = false;
+	}
+
+	async->flush();
+	session_sink.set(NULL);
+	writer->close();
+	after = async->stats();
+
+	if(complete){
+		warm.record(took);
+		reply << "done";
+	}else{
+		reply << "error timeout";
+	}
+	reply << " frames=" << n << " ttff_us=" << took / 1000
+		<< " dropped=" << after.dropped - before.dropped << " path=" << path;
+	return reply.str();
+}
+
+string CaptureService::command(const string& line)
+{
+	istringstream in(line);
+	ostringstream reply;
+	string cmd;
+
+	in >> cmd;
+
+	if(cmd == "start"){
+		unsigned int frames = 0;
+		vector<string> args;
+		string path, word;
+		int first = 0, last = 0;
+
+		if(!(in >> frames) || frames == 0)
+			return "error usage: start <frames> [<file>] [<flash_first> <flash_last>]";
+		while(in >> word)
+			args.push_back(word);
+
+		if(!args.empty() && args[0].find_first_not_of("0123456789") != string::npos){
+			path = args[0];
+			args.erase(args.begin());
+		}else{
+			lock_guard<mutex> lk(lock);
+			path = "session" + to_string(st.sessions + 1) + ".pcam";
+		}
+		try{
+			if(args.size() >= 1)
+				first = last = stoi(args[0]);
+			if(args.size() >= 2)
+				last = stoi(args[1]);
+			return start_session(frames, path, first, last);
+		}catch(const exception& e){
+			session_sink.set(NULL);
+			return string("error ") + e.what();
+		}
+	}else if(cmd == "status"){
+		service_stats s = stats();
+
+		reply << "ok frames=" << s.frames << " cold_ttff_us=" << s.cold_ttff_ns / 1000
+			<< " sessions=" << s.sessions << " stalls=" << s.stalls
+			<< " warm_ttff_p50_us=" << warm.percentile(50) / 1000
+			<< " warm_ttff_max_us=" << warm.max() / 1000
+			<< " fps=" << cam->frame_rate();
+		return reply.str();
+	}else if(cmd == "quit"){
+		reactor.stop();
+		return "ok";
+	}
+
+	return "error unknown command " + cmd;
+}
+
+// one client at a time, a start blocks the channel until its session ends //
+void CaptureService::serve()
+{
+	struct pollfd fds[2];
+
+	fds[0].fd = stop_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = listen_fd;
+	fds[1].events = POLLIN;
+
+	for(;;){
+		char buf[COMMAND_MAX];
+		struct pollfd pfd;
+		ssize_t n;
+		int c;
+
+		fds[0].revents = fds[1].revents = 0;
+		if(poll(fds, 2, -1) < 0){
+			if(EINTR == errno)
+				continue;
+			break;
+		}
+		if(fds[0].revents)
+			break;
+		if(!(fds[1].revents & POLLIN))
+			continue;
+
+		c = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if(-1 == c)
+			continue;
+
+		pfd.fd = c;
+		pfd.events = POLLIN;
+		for(;;){
+			struct pollfd both[2] = { fds[0], pfd };
+
+			both[0].revents = both[1].revents = 0;
+			if(poll(both, 2, -1) < 0 && EINTR != errno)
+				break;
+			if(both[0].revents)
+				break;
+			if(!(both[1].revents & POLLIN))
+				continue;
+
+			n = recv(c, buf, sizeof(buf) - 1, 0);
+			if(n <= 0)
+				break;
+			buf[n] = '\0';
+
+			string reply = command(buf);
+			if(send(c, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+				break;
+		}
+		close(c);
+	}
+}
+
+ServiceClient::ServiceClient(const string& control)
+{
+	sock = local_connect(control);
+	if(-1 == sock)
+		throw runtime_error(control + " : no capture service");
+}
+
+ServiceClient::~ServiceClient()
+{
+	close(sock);
+}
+
+string ServiceClient::request(const string& line)
+{
+	char buf[COMMAND_MAX];
+	ssize_t n;
+
+	if(send(sock, line.data(), line.size(), MSG_NOSIGNAL) < 0)
+		throw runtime_error("capture service : send");
+
+	do{
+		n = recv(sock, buf, sizeof(buf), 0);
+	}while(n < 0 && EINTR == errno);
+	if(n <= 0)
+		throw runtime_error("capture service : connection closed");
+
+	return string(buf, n);
+}
@@ -0,0 +1,136 @@
+#ifndef CAPTURE_SERVICE_H
+#define CAPTURE_SERVICE_H
+
+#include <stdint.h>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "picam_v4l2_ctrl.h"
+#include "capture_reactor.h"
+#include "strobe_scheduler.h"
+#include "frame_container.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+
+#define SERVICE_NAME "picam-ctl"	// abstract unix socket of the control channel
+#define SERVICE_SINK_DEPTH 32
+
+struct service_stats{
+	uint64_t cold_ttff_ns;		// constructor to first frame: open, REQBUFS, mmap, STREAMON, sensor start
+	unsigned long frames;		// dequeued since start
+	unsigned long sessions;		// completed
+	unsigned long stalls;		// watchdog restarts of the stream
+};
+
+/*
+	CaptureService - keep the camera streaming between measurements
+	The device is opened and streaming from construction on; frames are
+	dequeued and given straight back while idle, so the sensor and its
+	exposure loop stay settled. A session is requested on the control
+	socket:
+
+		start <frames> [<file>] [<flash_first> <flash_last>]
+		status
+		quit
+
+	and begins with the first frame exposed after the request (timestamp
+	not before it, as in Picam::trigger_loop()). Its frames go to a
+	session container <file>, default session<n>.pcam, through one
+	AsyncFrameSink kept for the life of the service. Flash frames count
+	from 1 at the session's first frame and are scheduled on strobe when
+	that frame arrives, so flash_first needs a couple of frames of lead;
+	a session that times out takes its flash back off strobe.
+	start is answered when the session is complete with
+	"done frames=... ttff_us=...", where ttff is request to first session
+	frame dequeued: the warm counterpart of cold_ttff_ns.
+*/
+class CaptureService : public FrameHandler{
+public:
+	CaptureService(const std::string& device, unsigned int width, unsigned int height,
+			StrobeScheduler *strobe = NULL, int flash_output = -1,
+			const std::string& control = SERVICE_NAME);
+	~CaptureService();
+
+	// dispatch frames until quit or stop() //
+	void run();
+	void stop();
+
+	service_stats stats() const;
+	const LatencyHistogram& warm_ttff() const { return warm; }
+	Picam& camera() { return *cam; }
+	// "<prefix>.": sessions, cold_ttff_ns, warm_ttff_ns //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "service");
+
+	void on_frame(Picam& cam, const FrameRef& frame);
+	void on_stall(Picam& cam);
+private:
+	CaptureService(const CaptureService&);
+	CaptureService& operator=(const CaptureService&);
+
+	enum session_state { SESSION_IDLE, SESSION_ARMED, SESSION_RUNNING, SESSION_DONE };
+
+	// forwards to the open session container, set between sessions //
+	class SessionSink : public FrameSink{
+	public:
+		SessionSink() : target(NULL) {}
+		void consume(const void *p, size_t size, const frame_info& info);
+		void set(FrameSink *t);
+	private:
+		std::mutex lock;
+		FrameSink *target;
+	};
+
+	void serve();
+	std::string command(const std::string& line);
+	std::string start_session(unsigned int frames, const std::string& path, int flash_first, int flash_last);
+
+	uint64_t t_created;
+	std::unique_ptr<Picam> cam;
+	StrobeScheduler *strobe;
+	int flash_output;
+
+	SessionSink session_sink;
+	std::unique_ptr<AsyncFrameSink> async;
+	std::unique_ptr<StrobeTap> tap;
+	FrameSink *head;
+
+	CaptureReactor reactor;
+	std::string control;
+	int listen_fd;
+	int stop_fd;
+	std::thread thread;
+
+	// session state, shared by the reactor and control threads //
+	mutable std::mutex lock;
+	std::condition_variable changed;
+	enum session_state state;
+	bool quitting;
+	uint64_t t_request;
+	unsigned int want, got;
+	unsigned int first_frame;
+	int flash_first, flash_last;
+	bool flash_scheduled;
+	uint64_t ttff;
+
+	service_stats st;
+	LatencyHistogram warm;
+};
+
+// one connection to a CaptureService, request() sends a command and waits for the reply //
+class ServiceClient{
+public:
+	ServiceClient(const std::string& control = SERVICE_NAME);
+	~ServiceClient();
+
+	std::string request(const std::string& line);
+private:
+	ServiceClient(const ServiceClient&);
+	ServiceClient& operator=(const ServiceClient&);
+
+	int sock;
+};
+
+#endif
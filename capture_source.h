@@ -0,0 +1,28 @@
+#ifndef CAPTURE_SOURCE_H
+#define CAPTURE_SOURCE_H
+
+#include <stddef.h>
+
+#include "frame_sink.h"
+
+/*
+	CaptureSource - where frames come from
+	Everything downstream only sees FrameSink::consume() and the format
+	below, so a live Picam and a ReplaySource are interchangeable.
+*/
+class CaptureSource{
+public:
+	virtual ~CaptureSource() {}
+
+	// deliver up to count frames to the sink, returns how many were delivered //
+	virtual unsigned int run(int timeout, int count) = 0;
+	// the source does not own sink //
+	virtual void set_sink(FrameSink *sink) = 0;
+
+	virtual unsigned int width() const = 0;
+	virtual unsigned int height() const = 0;
+	virtual unsigned int pixel_format() const = 0;
+	virtual size_t max_frame_size() const = 0;
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include <string.h>
+
+#include <stdexcept>
+
+#include "decode_pipeline.h"
+#include "jpeg_luma.h"
+
+using namespace std;
+
+DecodePipeline::DecodePipeline(LumaSink *out, size_t max_frame_size, unsigned int width, unsigned int height,
+		unsigned int n_workers, unsigned int scale_denom, unsigned int depth) :
+	out(out), max_frame_size(max_frame_size), scale_denom(scale_denom), jobs(depth),
+	running(true),
+	n_submitted(0), n_delivered(0), n_dropped(0), n_failed(0), n_errors(0)
+{
+	unsigned int i;
+
+	if(!out)
+		throw runtime_error("DecodePipeline : no output sink");
+	if(scale_denom != 1 && scale_denom != 2 && scale_denom != 4 && scale_denom != 8)
+		throw runtime_error("DecodePipeline : scale must be 1, 2, 4 or 8");
+	if(n_workers == 0 || depth < n_workers)
+		throw runtime_error("DecodePipeline : need at least one job slot per worker");
+
+	for(i = 0; i < depth; ++i){
+		jobs[i].state = JOB_FREE;
+		jobs[i].jpeg.resize(max_frame_size);
+		jobs[i].luma.resize((size_t)width * height);
+		free_jobs.push_back(i);
+	}
+
+	for(i = 0; i < n_workers; ++i)
+		workers.push_back(thread(&DecodePipeline::worker, this));
+}
+
+DecodePipeline::~DecodePipeline()
+{
+	unsigned int i;
+
+	{
+		lock_guard<mutex> lk(lock);
+		running = false;
+	}
+	work_ready.notify_all();
+
+	for(i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+void DecodePipeline::consume(const void *p, size_t size, const frame_info& info)
+{
+	unsigned int idx;
+	job *j;
+
+	if(size > max_frame_size){
+		n_dropped++;
+		return;
+	}
+
+	{
+		lock_guard<mutex> lk(lock);
+		if(free_jobs.empty()){
+			n_dropped++;
+			return;
+		}
+		idx = free_jobs.front();
+		free_jobs.pop_front();
+
+		// reserve the delivery position before the copy //
+		j = &jobs[idx];
+		pending.push_back(idx);
+	}
+
+	memcpy(&j->jpeg[0], p, size);
+	j->size = size;
+	j->info = info;
+	j->t_submit = monotonic_ns();
+
+	{
+		lock_guard<mutex> lk(lock);
+		j->state = JOB_QUEUED;
+		work.push_back(idx);
+	}
+	n_submitted++;
+	work_ready.notify_one();
+}
+
+void DecodePipeline::worker()
+{
+	JpegLumaDecoder decoder;
+	unsigned int idx;
+	job *j;
+	bool ok;
+
+	for(;;){
+		{
+			unique_lock<mutex> lk(lock);
+			while(running && work.empty())
+				work_ready.wait(lk);
+			// accepted frames are still decoded and delivered after the stop //
+			if(work.empty())
+				return;
+
+			idx = work.front();
+			work.pop_front();
+			j = &jobs[idx];
+			j->state = JOB_BUSY;
+		}
+
+		j->t_start = monotonic_ns();
+		ok = decoder.decode(&j->jpeg[0], j->size, scale_denom, &j->luma[0], j->luma.size(), &j->frame);
+		j->t_done = monotonic_ns();
+		j->frame.frame_number = j->info.frame_number;
+		j->frame.timestamp_ns = j->info.timestamp_ns;
+
+		{
+			lock_guard<mutex> lk(lock);
+			j->state = ok ? JOB_DONE : JOB_FAILED;
+		}
+
+		deliver();
+	}
+}
+
+void DecodePipeline::deliver()
+{
+	lock_guard<mutex> dl(deliver_lock);
+	unsigned int idx;
+	job *j;
+
+	for(;;){
+		{
+			lock_guard<mutex> lk(lock);
+			if(pending.empty())
+				return;
+			idx = pending.front();
+			j = &jobs[idx];
+			if(j->state != JOB_DONE && j->state != JOB_FAILED)
+				return;
+			pending.pop_front();
+		}
+
+		if(j->state == JOB_DONE){
+			uint64_t now;
+
+			try{
+				out->consume(j->frame);
+				now = monotonic_ns();
+
+				queue_lat.record(j->t_start - j->t_submit);
+				decode_lat.record(j->t_done - j->t_start);
+				reorder_lat.record(now - j->t_done);
+				total_lat.record(now - j->t_submit);
+				n_delivered++;
+			}catch(const exception&){
+				// a failing consumer must not take the decode workers down //
+				n_errors++;
+			}
+		}else{
+			n_failed++;
+		}
+
+		{
+			lock_guard<mutex> lk(lock);
+			j->state = JOB_FREE;
+			free_jobs.push_back(idx);
+		}
+		idle.notify_all();
+	}
+}
+
+void DecodePipeline::flush()
+{
+	unique_lock<mutex> lk(lock);
+
+	while(n_delivered.load() + n_failed.load() + n_errors.load() < n_submitted.load())
+		idle.wait(lk);
+}
+
+decode_stats DecodePipeline::stats() const
+{
+	decode_stats st;
+
+	st.submitted = n_submitted.load();
+	st.delivered = n_delivered.load();
+	st.dropped = n_dropped.load();
+	st.failed = n_failed.load();
+	st.errors = n_errors.load();
+
+	return st;
+}
@@ -0,0 +1,96 @@
+#ifndef DECODE_PIPELINE_H
+#define DECODE_PIPELINE_H
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+#include "frame_sink.h"
+#include "luma_frame.h"
+#include "latency_histogram.h"
+
+struct decode_stats{
+	unsigned long submitted;	// frames accepted by consume()
+	unsigned long delivered;	// luma frames handed to the output
+	unsigned long dropped;		// no free job slot or frame too large
+	unsigned long failed;		// corrupt JPEG
+	unsigned long errors;		// the output sink threw, the frame is lost
+};
+
+/*
+	DecodePipeline - MJPEG to luma decode stage
+	consume() copies the JPEG into a free job slot and returns, worker
+	threads decode the Y plane in parallel and a reorder buffer hands the
+	results to out strictly in submission (frame_number) order. If every
+	slot is busy the incoming frame is dropped so capture never waits.
+	The destructor lets the workers finish every frame already accepted.
+*/
+class DecodePipeline : public FrameSink{
+public:
+	DecodePipeline(LumaSink *out, size_t max_frame_size, unsigned int width, unsigned int height,
+			unsigned int n_workers = 2, unsigned int scale_denom = 1, unsigned int depth = 8);
+	~DecodePipeline();
+
+	void consume(const void *p, size_t size, const frame_info& info);
+
+	// wait until every submitted frame has been delivered or failed //
+	void flush();
+	decode_stats stats() const;
+
+	// submit -> decode start, decode, decode end -> delivery, submit -> delivery //
+	const LatencyHistogram& queue_latency() const { return queue_lat; }
+	const LatencyHistogram& decode_latency() const { return decode_lat; }
+	const LatencyHistogram& reorder_latency() const { return reorder_lat; }
+	const LatencyHistogram& total_latency() const { return total_lat; }
+private:
+	enum job_state { JOB_FREE, JOB_QUEUED, JOB_BUSY, JOB_DONE, JOB_FAILED };
+
+	struct job{
+		enum job_state state;
+		size_t size;
+		frame_info info;
+		uint64_t t_submit;
+		uint64_t t_start;
+		uint64_t t_done;
+		luma_frame frame;
+		std::vector<unsigned char> jpeg;
+		std::vector<unsigned char> luma;
+	};
+
+	void worker();
+	void deliver();
+
+	LumaSink *out;
+	size_t max_frame_size;
+	unsigned int scale_denom;
+
+	std::vector<job> jobs;
+	std::deque<unsigned int> free_jobs;
+	std::deque<unsigned int> work;
+	// job indices in submission order, still waiting for delivery //
+	std::deque<unsigned int> pending;
+
+	std::mutex lock;
+	std::mutex deliver_lock;
+	std::condition_variable work_ready;
+	std::condition_variable idle;
+	bool running;
+	std::vector<std::thread> workers;
+
+	std::atomic<unsigned long> n_submitted;
+	std::atomic<unsigned long> n_delivered;
+	std::atomic<unsigned long> n_dropped;
+	std::atomic<unsigned long> n_failed;
+	std::atomic<unsigned long> n_errors;
+
+	LatencyHistogram queue_lat;
+	LatencyHistogram decode_lat;
+	LatencyHistogram reorder_lat;
+	LatencyHistogram total_lat;
+};
+
+#endif
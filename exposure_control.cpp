@@ -0,0 +1,274 @@
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+#include <chrono>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+
+#include "exposure_control.h"
+#include "luma.h"
+
+using namespace std;
+
+static int32_t clamp_control(const camera_control& c, int64_t v)
+{
+	if(v < c.minimum)
+		return c.minimum;
+	if(v > c.maximum)
+		return c.maximum;
+	if(c.step > 1)
+		v = c.minimum + (v - c.minimum) / c.step * c.step;
+	return v;
+}
+
+ExposureController::ExposureController(Picam *cam, const exposure_params& params) :
+	cam(cam), prm(params), gain_id(0), limit(0),
+	quit(false), pending(false), want_exposure(0), want_gain(0), last_frame(0), settle_until(0)
+{
+	const mode_choice& m = cam->mode();
+	vector<control_value> setup;
+	camera_control c;
+	control_value v;
+
+	memset(&st, 0, sizeof(st));
+
+	if(!cam->query_control(V4L2_CID_EXPOSURE_ABSOLUTE, &exposure_ctrl))
+		throw runtime_error(cam->device_name() + " : no manual exposure control");
+
+	if(cam->query_control(V4L2_CID_GAIN, &gain_ctrl))
+		gain_id = V4L2_CID_GAIN;
+#ifdef V4L2_CID_ANALOGUE_GAIN
+	else if(cam->query_control(V4L2_CID_ANALOGUE_GAIN, &gain_ctrl))
+		gain_id = V4L2_CID_ANALOGUE_GAIN;
+#endif
+
+	// exposure is in 100 us units, the interval in seconds per frame //
+	limit = exposure_ctrl.maximum;
+	if(m.interval_num && m.interval_den){
+		double cap = 10000.0 * m.interval_num / m.interval_den * prm.interval_fraction;
+
+		if(cap < limit)
+			limit = clamp_control(exposure_ctrl, (int64_t)cap);
+	}
+
+	if(cam->query_control(V4L2_CID_EXPOSURE_AUTO, &c)){
+		v.id = V4L2_CID_EXPOSURE_AUTO;
+		v.value = V4L2_EXPOSURE_MANUAL;
+		setup.push_back(v);
+	}
+	// with priority on, UVC cameras drop frames to honour the exposure //
+	if(cam->query_control(V4L2_CID_EXPOSURE_AUTO_PRIORITY, &c)){
+		v.id = V4L2_CID_EXPOSURE_AUTO_PRIORITY;
+		v.value = 0;
+		setup.push_back(v);
+	}
+	cam->set_controls(setup);
+
+	// the exposure control only accepts writes once auto exposure is off //
+	st.exposure = clamp_control(exposure_ctrl, cam->get_control(V4L2_CID_EXPOSURE_ABSOLUTE));
+	if(st.exposure > limit)
+		st.exposure = limit;
+	setup.clear();
+	v.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+	v.value = st.exposure;
+	setup.push_back(v);
+	if(gain_id)
+		st.gain = clamp_control(gain_ctrl, cam->get_control(gain_id));
+	cam->set_controls(setup);
+
+	thread = std::thread(&ExposureController::run, this);
+}
+
+ExposureController::~ExposureController()
+{
+	{
+		lock_guard<mutex> lk(lock);
+		quit = true;
+	}
+	wake.notify_all();
+	thread.join();
+}
+
+exposure_stats ExposureController::stats() const
+{
+	lock_guard<mutex> lk(lock);
+	return st;
+}
+
+void ExposureController::register_metrics(MetricsRegistry *reg, const string& prefix)
+{
+	reg->add(prefix + ".mean", METRIC_GAUGE, [this]() { return (int64_t)stats().mean; });
+	reg->add(prefix + ".exposure", METRIC_GAUGE, [this]() { return (int64_t)stats().exposure; });
+	reg->add(prefix + ".gain", METRIC_GAUGE, [this]() { return (int64_t)stats().gain; });
+	reg->add(prefix + ".writes", METRIC_COUNTER, [this]() { return (int64_t)stats().writes; });
+	reg->add(prefix + ".errors", METRIC_COUNTER, [this]() { return (int64_t)stats().errors; });
+	reg->add(prefix + ".write_ns", &write_time);
+}
+
+// histogram mean of roi with the brightest glint_fraction left out //
+unsigned int ExposureController::region_mean(const luma_frame& frame, const pupil_roi& roi) const
+{
+	uint32_t hist[256];
+	uint64_t n = (uint64_t)roi.width * roi.height;
+	uint64_t sum, skip, drop;
+	int i;
+
+	sum = luma_histogram(frame.data + (size_t)roi.y * frame.stride + roi.x, frame.stride,
+			roi.width, roi.height, hist);
+
+	skip = (uint64_t)(n * prm.glint_fraction);
+	for(i = 255; i >= 0 && skip; --i){
+		drop = hist[i] < skip ? hist[i] : skip;
+		sum -= drop * i;
+		n -= drop;
+		skip -= drop;
+	}
+
+	return n ? sum / n : 0;
+}
+
+void ExposureController::update(const luma_frame& frame)
+{
+	pupil_roi all;
+
+	all.x = all.y = 0;
+	all.width = frame.width;
+	all.height = frame.height;
+	update(frame, all);
+}
+
+void ExposureController::update(const luma_frame& frame, const pupil_roi& roi)
+{
+	pupil_roi r = roi;
+	unsigned int mean;
+	int32_t exposure, gain;
+	float ratio;
+
+	if(r.x >= frame.width || r.y >= frame.height)
+		return;
+	if(r.width > frame.width - r.x)
+		r.width = frame.width - r.x;
+	if(r.height > frame.height - r.y)
+		r.height = frame.height - r.y;
+	if(!r.width || !r.height)
+		return;
+
+	{
+		lock_guard<mutex> lk(lock);
+
+		last_frame = frame.frame_number;
+		st.frames++;
+		if(pending || frame.frame_number < settle_until){
+			st.settling++;
+			return;
+		}
+		exposure = st.exposure;
+		gain = st.gain;
+	}
+
+	// the histogram is the only per-frame cost, outside the lock //
+	mean = region_mean(frame, r);
+
+	ratio = (float)prm.target / (mean ? mean : 1);
+	if(ratio > prm.max_step)
+		ratio = prm.max_step;
+	if(ratio < 1.0f / prm.max_step)
+		ratio = 1.0f / prm.max_step;
+
+	if(mean + prm.deadband < prm.target){
+		// brighter : longer exposure up to the cap, then gain //
+		float want = (exposure > 0 ? exposure : 1) * ratio;
+		int64_t e = (int64_t)ceilf(want);
+		float rest;
+
+		if(e > limit)
+			e = limit;
+		rest = want / (e ? e : 1);
+		exposure = clamp_control(exposure_ctrl, e);
+
+		if(gain_id && rest > 1.01f){
+			int64_t span = (int64_t)gain_ctrl.maximum - gain_ctrl.minimum;
+			int64_t step = (int64_t)((rest - 1.0f) * span / 4);
+
+			gain = clamp_control(gain_ctrl, (int64_t)gain + (step > gain_ctrl.step ? step : gain_ctrl.step));
+		}
+	}else if(mean > prm.target + prm.deadband){
+		// darker : gain back to its minimum first, noise before motion blur //
+		if(gain_id && gain > gain_ctrl.minimum){
+			int64_t span = (int64_t)gain_ctrl.maximum - gain_ctrl.minimum;
+			int64_t step = (int64_t)((1.0f - ratio) * span / 4);
+
+			gain = clamp_control(gain_ctrl, (int64_t)gain - (step > gain_ctrl.step ? step : gain_ctrl.step));
+		}else{
+			exposure = clamp_control(exposure_ctrl, (int64_t)floorf(exposure * ratio));
+		}
+	}
+
+	lock_guard<mutex> lk(lock);
+
+	st.mean = mean;
+	if(exposure == st.exposure && gain == st.gain)
+		return;
+
+	want_exposure = exposure;
+	want_gain = gain;
+	pending = true;
+	st.requests++;
+	wake.notify_one();
+}
+
+// control writes, off the capture and detection threads //
+void ExposureController::run()
+{
+	chrono::steady_clock::time_point next = chrono::steady_clock::now();
+	unique_lock<mutex> lk(lock);
+
+	for(;;){
+		vector<control_value> batch;
+		control_value v;
+		uint64_t t;
+		bool ok = true;
+
+		wake.wait(lk, [this]() { return quit || pending; });
+		if(quit)
+			break;
+
+		// rate limit, a pending request is written late rather than dropped //
+		if(wake.wait_until(lk, next, [this]() { return quit; }))
+			break;
+
+		if(want_exposure != st.exposure){
+			v.id = V4L2_CID_EXPOSURE_ABSOLUTE;
+			v.value = want_exposure;
+			batch.push_back(v);
+		}
+		if(gain_id && want_gain != st.gain){
+			v.id = gain_id;
+			v.value = want_gain;
+			batch.push_back(v);
+		}
+
+		lk.unlock();
+		t = monotonic_ns();
+		try{
+			cam->set_controls(batch);
+		}catch(const exception&){
+			ok = false;
+		}
+		write_time.record(monotonic_ns() - t);
+		next = chrono::steady_clock::now() + chrono::milliseconds(prm.min_interval_ms);
+		lk.lock();
+
+		if(ok){
+			st.exposure = want_exposure;
+			st.gain = want_gain;
+			st.writes++;
+		}else{
+			st.errors++;
+		}
+		settle_until = last_frame + prm.settle_frames + 1;
+		pending = false;
+	}
+}
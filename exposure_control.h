@@ -0,0 +1,102 @@
+#ifndef EXPOSURE_CONTROL_H
+#define EXPOSURE_CONTROL_H
+
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+#include "picam_v4l2_ctrl.h"
+#include "pupil_detector.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+
+struct exposure_params{
+	unsigned int target;			// mean luma the region is steered to
+	unsigned int deadband;			// no change while the mean is within target +- deadband
+	float max_step;					// largest brightness ratio of one update
+	float interval_fraction;		// exposure cap as a fraction of the frame interval
+	float glint_fraction;			// brightest share of the region left out of the mean
+	unsigned int min_interval_ms;	// between two control writes
+	unsigned int settle_frames;		// frames ignored after a write, the sensor pipelines exposure
+
+	exposure_params() :
+		target(100), deadband(8), max_step(2.0f), interval_fraction(0.9f),
+		glint_fraction(0.01f), min_interval_ms(100), settle_frames(3) {}
+};
+
+struct exposure_stats{
+	unsigned long frames;		// frames measured
+	unsigned long settling;		// frames skipped, a write pending or not yet visible
+	unsigned long requests;		// new settings handed to the control thread
+	unsigned long writes;		// VIDIOC_S_EXT_CTRLS batches
+	unsigned long errors;		// writes the driver rejected
+	unsigned int mean;			// region mean of the last measured frame
+	int32_t exposure;			// last written, V4L2_CID_EXPOSURE_ABSOLUTE units (100 us)
+	int32_t gain;
+};
+
+/*
+	ExposureController - manual exposure and gain that keep the frame rate
+	UVC auto exposure stretches exposure past the frame period in dim IR
+	light and the camera quietly halves its frame rate. The controller
+	switches to manual exposure with V4L2_CID_EXPOSURE_AUTO_PRIORITY off,
+	caps exposure at interval_fraction of the frame interval Picam was
+	granted, and makes up the rest with gain.
+
+	update() builds a luma_histogram() of the pupil region (the whole
+	frame without one), drops the brightest glint_fraction, which are
+	corneal reflections of the IR LED, and steers the mean toward
+	target: exposure first, gain once exposure is at its cap, and gain
+	back down before exposure when too bright. update() never touches
+	the device: new settings go to a control thread that writes them as
+	one batch no more often than min_interval_ms. Until a write has
+	been visible for settle_frames, update() only measures.
+*/
+class ExposureController{
+public:
+	ExposureController(Picam *cam, const exposure_params& params = exposure_params());
+	~ExposureController();
+
+	void update(const luma_frame& frame);
+	void update(const luma_frame& frame, const pupil_roi& roi);
+
+	// longest exposure allowed at the current frame rate, 100 us units //
+	int32_t exposure_limit() const { return limit; }
+	bool has_gain() const { return gain_id != 0; }
+	exposure_stats stats() const;
+	// S_EXT_CTRLS round trip, the time a write would have stalled the capture loop //
+	const LatencyHistogram& write_latency() const { return write_time; }
+	// "<prefix>.": mean, exposure, gain, writes, errors, write_ns //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "exposure");
+private:
+	ExposureController(const ExposureController&);
+	ExposureController& operator=(const ExposureController&);
+
+	void run();
+	unsigned int region_mean(const luma_frame& frame, const pupil_roi& roi) const;
+
+	Picam *cam;
+	exposure_params prm;
+
+	camera_control exposure_ctrl;
+	camera_control gain_ctrl;
+	uint32_t gain_id;
+	int32_t limit;
+
+	mutable std::mutex lock;
+	std::condition_variable wake;
+	bool quit;
+	bool pending;					// request not yet written
+	int32_t want_exposure, want_gain;
+	unsigned int last_frame;		// newest frame update() saw
+	unsigned int settle_until;		// first frame measured after the last write
+	exposure_stats st;
+	LatencyHistogram write_time;
+
+	std::thread thread;
+};
+
+#endif
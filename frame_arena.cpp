@@ -0,0 +1,120 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <stdexcept>
+
+#include <linux/udmabuf.h>
+
+#include "frame_arena.h"
+
+#define HUGEPAGE_SIZE (2UL << 20)
+#define UDMABUF_DEV "/dev/udmabuf"
+
+using namespace std;
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+FrameArena::FrameArena(size_t slot_size, unsigned int n_slots, bool hugepages) :
+	memfd(-1), base(NULL), n_slots(n_slots), huge(false), dmabufs(n_slots, -1)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	if(n_slots == 0 || slot_size == 0)
+		throw runtime_error("FrameArena : empty arena");
+
+	slot_sz = round_up(slot_size, page);
+
+	// hugetlb pages may not be reserved, fall back to normal pages //
+	if(!(hugepages && map(true)) && !map(false))
+		throw runtime_error("FrameArena : cannot allocate arena");
+
+	if(!huge)
+		madvise(base, total, MADV_HUGEPAGE);
+}
+
+bool FrameArena::map(bool hugetlb)
+{
+	unsigned int flags = MFD_ALLOW_SEALING | (hugetlb ? MFD_HUGETLB : 0);
+
+	total = slot_sz * n_slots;
+	if(hugetlb)
+		total = round_up(total, HUGEPAGE_SIZE);
+
+	// udmabuf only accepts sealed memfds //
+	memfd = memfd_create("picam-arena", flags);
+	if(-1 == memfd)
+		return false;
+
+	if(-1 == ftruncate(memfd, total) || -1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK))
+		goto fail;
+
+	base = (unsigned char*) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memfd, 0);
+	if(MAP_FAILED == base)
+		goto fail;
+
+	huge = hugetlb;
+	return true;
+
+fail:
+	close(memfd);
+	memfd = -1;
+	base = NULL;
+	return false;
+}
+
+FrameArena::~FrameArena()
+{
+	unsigned int i;
+
+	for(i = 0; i < n_slots; ++i)
+		if(dmabufs[i] != -1)
+			close(dmabufs[i]);
+
+	munmap(base, total);
+	close(memfd);
+}
+
+void *FrameArena::slot(unsigned int i) const
+{
+	if(i >= n_slots)
+		throw runtime_error("FrameArena : slot out of range");
+
+	return base + (size_t)i * slot_sz;
+}
+
+int FrameArena::dmabuf_fd(unsigned int i)
+{
+	struct udmabuf_create create;
+	int dev;
+
+	if(i >= n_slots)
+		throw runtime_error("FrameArena : slot out of range");
+
+	if(dmabufs[i] != -1)
+		return dmabufs[i];
+
+	dev = open(UDMABUF_DEV, O_RDWR);
+	if(-1 == dev)
+		throw runtime_error(string(UDMABUF_DEV) + " : cannot open! ");
+
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = (size_t)i * slot_sz;
+	create.size = slot_sz;
+
+	dmabufs[i] = ioctl(dev, UDMABUF_CREATE, &create);
+	close(dev);
+
+	if(-1 == dmabufs[i])
+		throw runtime_error("UDMABUF_CREATE");
+
+	return dmabufs[i];
+}
@@ -0,0 +1,42 @@
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <stddef.h>
+#include <vector>
+
+/*
+	FrameArena - one preallocated block of frame memory
+	The block is a memfd (hugepage backed when the kernel allows it) cut
+	into page-aligned slots. Slots can be handed to Picam as USERPTR
+	buffers, or exported through /dev/udmabuf as dma-buf fds for
+	V4L2_MEMORY_DMABUF and for passing frames to other processes.
+*/
+class FrameArena{
+public:
+	FrameArena(size_t slot_size, unsigned int n_slots, bool hugepages = true);
+	~FrameArena();
+
+	void *slot(unsigned int i) const;
+	size_t slot_size() const { return slot_sz; }
+	unsigned int slots() const { return n_slots; }
+	bool hugepages() const { return huge; }
+
+	// dma-buf covering slot i, created on first use and owned by the arena //
+	int dmabuf_fd(unsigned int i);
+private:
+	FrameArena(const FrameArena&);
+	FrameArena& operator=(const FrameArena&);
+
+	bool map(bool hugetlb);
+
+	int memfd;
+	unsigned char *base;
+	size_t slot_sz;
+	size_t total;
+	unsigned int n_slots;
+	bool huge;
+
+	std::vector<int> dmabufs;
+};
+
+#endif
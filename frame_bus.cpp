@@ -0,0 +1,408 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <vector>
+#include <stdexcept>
+
+#include "frame_bus.h"
+#include "local_socket.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+#define MAX_READERS 16
+
+using namespace std;
+
+static size_t round_up(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+static long futex(const atomic<uint32_t> *word, int op, uint32_t val, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, (const uint32_t*) word, op, val, timeout, NULL, 0);
+}
+
+FrameBus::FrameBus(size_t max_frame_size, unsigned int width, unsigned int height, unsigned int pixelformat,
+		unsigned int n_slots, const string& name, FrameSink *next) :
+	name(name), next(next), memfd(-1), listen_fd(-1), stop_fd(-1), base(NULL)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t header_size, stride;
+	void *p;
+	unsigned int i;
+
+	if(n_slots < 2 || max_frame_size == 0)
+		throw runtime_error("FrameBus : needs two slots and a frame size");
+
+	header_size = round_up(sizeof(frame_bus_header) + n_slots * sizeof(frame_bus_slot), page);
+	stride = round_up(max_frame_size, page);
+	length = header_size + stride * n_slots;
+
+	memfd = memfd_create("picam-bus", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(-1 == memfd)
+		throw runtime_error("FrameBus : memfd_create");
+
+	if(-1 == ftruncate(memfd, length)){
+		close(memfd);
+		throw runtime_error("FrameBus : ftruncate");
+	}
+
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memfd, 0);
+	if(MAP_FAILED == p){
+		close(memfd);
+		throw runtime_error("FrameBus : mmap");
+	}
+	base = (unsigned char*) p;
+
+	// our mapping stays writable, nobody else gets one, nobody resizes //
+	if(-1 == fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE))
+		fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+
+	hdr = (frame_bus_header*) base;
+	slots = (frame_bus_slot*)(hdr + 1);
+
+	hdr->version = FRAME_BUS_VERSION;
+	hdr->n_slots = n_slots;
+	hdr->header_size = header_size;
+	hdr->slot_size = max_frame_size;
+	hdr->slot_stride = stride;
+	hdr->width = width;
+	hdr->height = height;
+	hdr->pixelformat = pixelformat;
+	hdr->writer_pid = getpid();
+	hdr->head.store(0, memory_order_relaxed);
+	for(i = 0; i < n_slots; ++i)
+		slots[i].seq.store(0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	hdr->magic = FRAME_BUS_MAGIC;
+
+	try{
+		listen_fd = local_listen(name, MAX_READERS);
+	}catch(const exception&){
+		munmap(base, length);
+		close(memfd);
+		throw;
+	}
+	if(-1 == listen_fd){
+		munmap(base, length);
+		close(memfd);
+		throw runtime_error(name + " : cannot listen, is another bus running?");
+	}
+
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	thread = std::thread(&FrameBus::serve, this);
+}
+
+FrameBus::~FrameBus()
+{
+	wake_eventfd(stop_fd);
+	thread.join();
+
+	close(stop_fd);
+	close(listen_fd);
+	munmap(base, length);
+	close(memfd);
+}
+
+// hand the memfd to every reader that connects, off the capture thread //
+void FrameBus::serve()
+{
+	vector<struct pollfd> fds(2);
+	size_t i;
+
+	fds[0].fd = stop_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = listen_fd;
+	fds[1].events = POLLIN;
+
+	for(;;){
+		for(i = 0; i < fds.size(); ++i)
+			fds[i].revents = 0;
+
+		if(poll(&fds[0], fds.size(), -1) < 0){
+			if(EINTR == errno)
+				continue;
+			break;
+		}
+		if(fds[0].revents)
+			break;
+
+		if(fds[1].revents & POLLIN){
+			char cbuf[CMSG_SPACE(sizeof(int))];
+			struct msghdr msg;
+			struct cmsghdr *cmsg;
+			struct iovec iov;
+			uint32_t magic = FRAME_BUS_MAGIC;
+			struct pollfd pfd;
+			int c;
+
+			c = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if(-1 == c)
+				continue;
+			// over the limit the reader gets nothing to map, only the hang-up //
+			if(fds.size() >= 2 + MAX_READERS){
+				close(c);
+				continue;
+			}
+
+			memset(&msg, 0, sizeof(msg));
+			memset(cbuf, 0, sizeof(cbuf));
+			iov.iov_base = &magic;
+			iov.iov_len = sizeof(magic);
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = cbuf;
+			msg.msg_controllen = sizeof(cbuf);
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+			if(sendmsg(c, &msg, MSG_NOSIGNAL) < 0){
+				close(c);
+				continue;
+			}
+
+			// kept open so both sides notice when the other goes away //
+			pfd.fd = c;
+			pfd.events = 0;
+			fds.push_back(pfd);
+			n_readers.add(1);
+		}
+
+		for(i = 2; i < fds.size(); ){
+			if(fds[i].revents & (POLLHUP | POLLERR)){
+				close(fds[i].fd);
+				fds.erase(fds.begin() + i);
+				n_readers.add(-1);
+			}else{
+				++i;
+			}
+		}
+	}
+
+	for(i = 2; i < fds.size(); ++i)
+		close(fds[i].fd);
+	n_readers.set(0);
+}
+
+void FrameBus::consume(const void *p, size_t size, const frame_info& info)
+{
+	if(size > hdr->slot_size){
+		n_oversize.add();
+	}else{
+		uint32_t k = hdr->head.load(memory_order_relaxed);
+		frame_bus_slot *s = &slots[k % hdr->n_slots];
+		uint32_t seq = s->seq.load(memory_order_relaxed);
+
+		s->seq.store(seq + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		s->index = k;
+		s->size = size;
+		s->pixelformat = hdr->pixelformat;
+		s->frame_number = info.frame_number;
+		s->sequence = info.sequence;
+		s->timestamp_ns = info.timestamp_ns;
+		s->flags = info.flags;
+		s->leds = info.leds;
+		memcpy(base + hdr->header_size + (size_t)(k % hdr->n_slots) * hdr->slot_stride, p, size);
+
+		s->seq.store(seq + 2, memory_order_release);
+		hdr->head.store(k + 1, memory_order_release);
+		n_published.add();
+
+		// one syscall per frame, and only while someone is attached //
+		if(n_readers.value() > 0)
+			futex(&hdr->head, FUTEX_WAKE, INT_MAX, NULL);
+	}
+
+	if(next)
+		next->consume(p, size, info);
+}
+
+void FrameBus::register_metrics(MetricsRegistry *reg, const string& prefix) const
+{
+	reg->add(prefix + ".published", &n_published);
+	reg->add(prefix + ".oversize", &n_oversize);
+	reg->add(prefix + ".readers", &n_readers);
+}
+
+FrameBusReader::FrameBusReader(const string& name) :
+	base(NULL), next_index(0), n_lost(0)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t magic = 0;
+	int fd = -1;
+	void *p;
+
+	sock = local_connect(name);
+	if(-1 == sock)
+		throw runtime_error(name + " : no frame bus");
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &magic;
+	iov.iov_len = sizeof(magic);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) > 0 && magic == FRAME_BUS_MAGIC){
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	if(-1 == fd){
+		close(sock);
+		throw runtime_error(name + " : handshake failed");
+	}
+
+	length = lseek(fd, 0, SEEK_END);
+	p = length >= sizeof(frame_bus_header) ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if(MAP_FAILED == p){
+		close(sock);
+		throw runtime_error(name + " : mmap failed");
+	}
+
+	base = (const unsigned char*) p;
+	hdr = (const frame_bus_header*) base;
+	slots = (const frame_bus_slot*)(hdr + 1);
+
+	if(hdr->magic != FRAME_BUS_MAGIC || hdr->version != FRAME_BUS_VERSION
+			|| hdr->header_size + hdr->slot_stride * hdr->n_slots > length){
+		munmap(p, length);
+		close(sock);
+		throw runtime_error(name + " : not a frame bus");
+	}
+
+	// start with the next frame published //
+	next_index = hdr->head.load(memory_order_acquire);
+}
+
+FrameBusReader::~FrameBusReader()
+{
+	munmap((void*)base, length);
+	close(sock);
+}
+
+bool FrameBusReader::connected() const
+{
+	struct pollfd pfd;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 0;
+}
+
+// false if the writer is in or past this slot for a later frame //
+bool FrameBusReader::read_slot(uint32_t index, bus_frame *f)
+{
+	const frame_bus_slot *s = &slots[index % hdr->n_slots];
+	uint32_t seq = s->seq.load(memory_order_acquire);
+
+	if(seq & 1)
+		return false;
+
+	f->index = s->index;
+	f->size = s->size;
+	f->pixelformat = s->pixelformat;
+	f->info.frame_number = s->frame_number;
+	f->info.sequence = s->sequence;
+	f->info.timestamp_ns = s->timestamp_ns;
+	f->info.flags = s->flags;
+	f->info.leds = s->leds;
+	f->data = base + hdr->header_size + (size_t)(index % hdr->n_slots) * hdr->slot_stride;
+	f->slot = index % hdr->n_slots;
+	f->seq = seq;
+
+	atomic_thread_fence(memory_order_acquire);
+	return f->index == index && s->seq.load(memory_order_relaxed) == seq && f->size <= hdr->slot_size;
+}
+
+bool FrameBusReader::next(bus_frame *f, int timeout_ms)
+{
+	uint64_t deadline = timeout_ms > 0 ? monotonic_ns() + (uint64_t)timeout_ms * 1000000ULL : 0;
+
+	for(;;){
+		uint32_t head = hdr->head.load(memory_order_acquire);
+
+		if(head == next_index){
+			struct timespec ts, *tp = NULL;
+
+			if(timeout_ms == 0)
+				return false;
+			if(timeout_ms > 0){
+				uint64_t now = monotonic_ns();
+
+				if(now >= deadline)
+					return false;
+				ts.tv_sec = (deadline - now) / 1000000000ULL;
+				ts.tv_nsec = (deadline - now) % 1000000000ULL;
+				tp = &ts;
+			}
+			// returns at once if head moved since we loaded it //
+			futex(&hdr->head, FUTEX_WAIT, head, tp);
+			continue;
+		}
+
+		// the oldest slot is the next one the writer reuses, skip it too //
+		if(head - next_index >= hdr->n_slots){
+			n_lost += head - next_index - (hdr->n_slots - 1);
+			next_index = head - (hdr->n_slots - 1);
+		}
+
+		if(read_slot(next_index, f)){
+			next_index++;
+			return true;
+		}
+		// overwritten under us, the head has moved on: recompute //
+		n_lost++;
+		next_index++;
+	}
+}
+
+bool FrameBusReader::latest(bus_frame *f)
+{
+	for(;;){
+		uint32_t head = hdr->head.load(memory_order_acquire);
+
+		if(head == 0)
+			return false;
+		if(read_slot(head - 1, f)){
+			next_index = head;
+			return true;
+		}
+	}
+}
+
+bool FrameBusReader::valid(const bus_frame& f) const
+{
+	atomic_thread_fence(memory_order_acquire);
+	return slots[f.slot].seq.load(memory_order_relaxed) == f.seq;
+}
+
+bool FrameBusReader::copy(const bus_frame& f, void *dst) const
+{
+	memcpy(dst, f.data, f.size);
+	return valid(f);
+}
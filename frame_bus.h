@@ -0,0 +1,155 @@
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include "frame_sink.h"
+#include "metrics.h"
+
+#define FRAME_BUS_NAME		"picam-bus"		// abstract unix socket handing out the memfd
+#define FRAME_BUS_MAGIC		0x53554250		// "PBUS"
+#define FRAME_BUS_VERSION	1
+
+/*
+	Shared memory layout, one memfd:
+
+	frame_bus_header
+	frame_bus_slot[n_slots]		one cache line each
+	payload[n_slots]			slot_stride bytes apart, page aligned
+
+	Frame k (counting from 0) goes to slot k % n_slots. A slot's seq is
+	odd while the writer fills it; a reader that sees the same even seq
+	before and after using the payload knows it was not overwritten.
+*/
+struct frame_bus_header{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t header_size;		// offset of payload 0
+	uint64_t slot_size;			// payload capacity
+	uint64_t slot_stride;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pixelformat;
+	uint32_t writer_pid;
+	std::atomic<uint32_t> head;	// frames published, futex word readers sleep on
+	uint32_t reserved;
+};
+
+struct frame_bus_slot{
+	std::atomic<uint32_t> seq;
+	uint32_t index;				// k of the frame in the slot
+	uint32_t size;
+	uint32_t pixelformat;
+	uint32_t frame_number;
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+	uint32_t leds;
+	uint8_t reserved[24];
+};
+
+/*
+	FrameBus - publish frames to other processes
+	consume() copies the frame into the next slot and bumps head; it never
+	waits for a reader, a slow reader just finds its frame overwritten.
+	Readers connect to the abstract unix socket name, receive the memfd
+	and map it read-only; the memfd is sealed against resizing and new
+	writable mappings (F_SEAL_FUTURE_WRITE, Linux 5.1), so a buggy reader
+	cannot corrupt the ring. Up to 16 readers at a time, a connection
+	past that is closed before it sees the memfd. Frames are passed on
+	to next if given.
+*/
+class FrameBus : public FrameSink{
+public:
+	FrameBus(size_t max_frame_size, unsigned int width, unsigned int height, unsigned int pixelformat,
+			unsigned int n_slots = 8, const std::string& name = FRAME_BUS_NAME, FrameSink *next = NULL);
+	~FrameBus();
+
+	void consume(const void *p, size_t size, const frame_info& info);
+
+	unsigned long published() const { return n_published.value(); }
+	unsigned int readers() const { return n_readers.value(); }
+	// "<prefix>.": published, oversize, readers //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "bus") const;
+private:
+	FrameBus(const FrameBus&);
+	FrameBus& operator=(const FrameBus&);
+
+	void serve();
+
+	std::string name;
+	FrameSink *next;
+	int memfd;
+	int listen_fd;
+	int stop_fd;
+	size_t length;
+	unsigned char *base;
+	frame_bus_header *hdr;
+	frame_bus_slot *slots;
+
+	std::thread thread;
+	MetricCounter n_published;
+	MetricCounter n_oversize;
+	MetricGauge n_readers;
+};
+
+// a frame read from the bus, data points into the shared mapping //
+struct bus_frame{
+	const void *data;
+	size_t size;
+	uint32_t pixelformat;
+	frame_info info;
+	uint32_t index;				// publish count, gaps mean frames this reader missed
+	uint32_t slot;
+	uint32_t seq;
+};
+
+/*
+	FrameBusReader - attach to a FrameBus in another process
+	next() and latest() return views straight into shared memory. The
+	writer may reuse the slot at any time: after using the data, valid()
+	tells whether it is still the same frame, or copy() does both.
+*/
+class FrameBusReader{
+public:
+	FrameBusReader(const std::string& name = FRAME_BUS_NAME);
+	~FrameBusReader();
+
+	// the frame after the last one returned, waiting up to timeout_ms (-1 forever) //
+	bool next(bus_frame *f, int timeout_ms = -1);
+	// the newest frame, false if nothing has been published //
+	bool latest(bus_frame *f);
+	bool valid(const bus_frame& f) const;
+	// copy f into dst (at least f.size bytes), false if it was overwritten //
+	bool copy(const bus_frame& f, void *dst) const;
+
+	// frames overwritten before this reader got to them //
+	unsigned long lost() const { return n_lost; }
+	// false once the publishing process closed the bus //
+	bool connected() const;
+
+	unsigned int width() const { return hdr->width; }
+	unsigned int height() const { return hdr->height; }
+	unsigned int pixel_format() const { return hdr->pixelformat; }
+	size_t max_frame_size() const { return hdr->slot_size; }
+private:
+	FrameBusReader(const FrameBusReader&);
+	FrameBusReader& operator=(const FrameBusReader&);
+
+	bool read_slot(uint32_t index, bus_frame *f);
+
+	int sock;
+	size_t length;
+	const unsigned char *base;
+	const frame_bus_header *hdr;
+	const frame_bus_slot *slots;
+	uint32_t next_index;
+	unsigned long n_lost;
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "frame_container.h"
+
+#define CHUNK_ALIGN 4096
+#define RECORD_ALIGN 8
+
+using namespace std;
+
+static size_t pad(size_t size)
+{
+	return (RECORD_ALIGN - size % RECORD_ALIGN) % RECORD_ALIGN;
+}
+
+ContainerWriter::ContainerWriter(const string& path, unsigned int width, unsigned int height,
+		unsigned int pixelformat, size_t chunk_size) :
+	path(path), chunk(NULL), chunk_size(chunk_size), fill(0), file_pos(0)
+{
+	struct pcam_file_header h;
+	struct timespec now;
+
+	if(chunk_size == 0 || chunk_size % CHUNK_ALIGN)
+		throw runtime_error("ContainerWriter : chunk size must be a multiple of 4096");
+
+	if(posix_memalign((void**)&chunk, CHUNK_ALIGN, chunk_size))
+		throw runtime_error("ContainerWriter : cannot allocate chunk");
+
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(-1 == fd){
+		free(chunk);
+		throw runtime_error(path + " : cannot open! ");
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	memset(&h, 0, sizeof(h));
+	h.magic = PCAM_MAGIC;
+	h.version = PCAM_VERSION;
+	h.header_size = sizeof(h);
+	h.width = width;
+	h.height = height;
+	h.pixelformat = pixelformat;
+	h.created_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	append(&h, sizeof(h));
+}
+
+ContainerWriter::~ContainerWriter()
+{
+	try{
+		close();
+	}catch(const exception&){
+		// nothing to report to from a destructor, the index is lost //
+	}
+	free(chunk);
+}
+
+void ContainerWriter::write_chunk(size_t size)
+{
+	size_t done = 0;
+
+	while(done < size){
+		ssize_t n = write(fd, chunk + done, size - done);
+		if(-1 == n){
+			if(EINTR == errno)
+				continue;
+			throw runtime_error(path + " : write failed");
+		}
+		done += n;
+	}
+
+	// start writeback now instead of letting dirty pages pile up //
+	sync_file_range(fd, file_pos, size, SYNC_FILE_RANGE_WRITE);
+
+	file_pos += size;
+	n_written.add(size);
+	fill = 0;
+}
+
+void ContainerWriter::append(const void *p, size_t size)
+{
+	const unsigned char *src = (const unsigned char*) p;
+
+	while(size > 0){
+		size_t n = min(size, chunk_size - fill);
+
+		memcpy(chunk + fill, src, n);
+		fill += n;
+		src += n;
+		size -= n;
+
+		if(fill == chunk_size)
+			write_chunk(chunk_size);
+	}
+}
+
+void ContainerWriter::consume(const void *p, size_t size, const frame_info& info)
+{
+	static const unsigned char zeros[RECORD_ALIGN] = { 0 };
+	struct pcam_record_header r;
+	struct pcam_index_entry e;
+
+	if(-1 == fd)
+		throw runtime_error(path + " : container already closed");
+
+	r.magic = PCAM_RECORD_MAGIC;
+	r.size = size;
+	r.frame_number = info.frame_number;
+	r.sequence = info.sequence;
+	r.timestamp_ns = info.timestamp_ns;
+	r.flags = info.flags;
+	r.leds = info.leds;
+
+	e.offset = bytes();
+	e.timestamp_ns = info.timestamp_ns;
+	e.frame_number = info.frame_number;
+	e.size = size;
+
+	append(&r, sizeof(r));
+	append(p, size);
+	append(zeros, pad(size));
+
+	index.push_back(e);
+}
+
+void ContainerWriter::close()
+{
+	struct pcam_trailer t;
+
+	if(-1 == fd)
+		return;
+
+	t.index_offset = bytes();
+	t.count = index.size();
+	t.magic = PCAM_INDEX_MAGIC;
+
+	if(!index.empty())
+		append(&index[0], index.size() * sizeof(index[0]));
+	append(&t, sizeof(t));
+	if(fill)
+		write_chunk(fill);
+
+	fdatasync(fd);
+	::close(fd);
+	fd = -1;
+}
+
+void ContainerWriter::register_metrics(MetricsRegistry *reg, const string& prefix) const
+{
+	reg->add(prefix + ".bytes_written", &n_written);
+}
+
+ContainerReader::ContainerReader(const string& path) :
+	path(path), entries(NULL), n_frames(0), has_index(false)
+{
+	struct stat st;
+	void *p;
+
+	fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(-1 == fd)
+		throw runtime_error(path + " : cannot open! ");
+
+	if(-1 == fstat(fd, &st) || (size_t)st.st_size < sizeof(pcam_file_header)){
+		::close(fd);
+		throw runtime_error(path + " : not a container");
+	}
+	length = st.st_size;
+
+	p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == p){
+		::close(fd);
+		throw runtime_error(path + " : mmap failed");
+	}
+	base = (const unsigned char*) p;
+	hdr = (const pcam_file_header*) base;
+
+	if(hdr->magic != PCAM_MAGIC || hdr->version != PCAM_VERSION || hdr->header_size > length){
+		munmap((void*)base, length);
+		::close(fd);
+		throw runtime_error(path + " : not a container");
+	}
+
+	// reading sequentially through the frames is the common case //
+	madvise((void*)base, length, MADV_SEQUENTIAL);
+
+	if(length >= hdr->header_size + sizeof(pcam_trailer)){
+		const pcam_trailer *t = (const pcam_trailer*)(base + length - sizeof(pcam_trailer));
+
+		if(t->magic == PCAM_INDEX_MAGIC && t->index_offset >= hdr->header_size &&
+				t->index_offset + (uint64_t)t->count * sizeof(pcam_index_entry) + sizeof(pcam_trailer) == length){
+			entries = (const pcam_index_entry*)(base + t->index_offset);
+			n_frames = t->count;
+			has_index = true;
+			return;
+		}
+	}
+
+	scan();
+}
+
+ContainerReader::~ContainerReader()
+{
+	munmap((void*)base, length);
+	::close(fd);
+}
+
+// no usable footer, walk the records up to the first damaged one //
+void ContainerReader::scan()
+{
+	uint64_t pos = hdr->header_size;
+
+	while(pos + sizeof(pcam_record_header) <= length){
+		const pcam_record_header *r = (const pcam_record_header*)(base + pos);
+		pcam_index_entry e;
+
+		if(r->magic != PCAM_RECORD_MAGIC || pos + sizeof(*r) + r->size > length)
+			break;
+
+		e.offset = pos;
+		e.timestamp_ns = r->timestamp_ns;
+		e.frame_number = r->frame_number;
+		e.size = r->size;
+		rebuilt.push_back(e);
+
+		pos += sizeof(*r) + r->size + pad(r->size);
+	}
+
+	entries = rebuilt.empty() ? NULL : &rebuilt[0];
+	n_frames = rebuilt.size();
+}
+
+container_frame ContainerReader::frame(unsigned int i) const
+{
+	const pcam_record_header *r;
+	container_frame f;
+
+	if(i >= n_frames)
+		throw runtime_error("ContainerReader : frame out of range");
+
+	if(entries[i].offset + sizeof(*r) + entries[i].size > length)
+		throw runtime_error(path + " : index points past the end");
+
+	// the record itself must agree, a damaged index must not hand out bytes past the check //
+	r = (const pcam_record_header*)(base + entries[i].offset);
+	if(r->magic != PCAM_RECORD_MAGIC || r->size != entries[i].size)
+		throw runtime_error(path + " : index does not match record " + to_string(i));
+	f.data = r + 1;
+	f.size = r->size;
+	f.info.frame_number = r->frame_number;
+	f.info.sequence = r->sequence;
+	f.info.timestamp_ns = r->timestamp_ns;
+	f.info.flags = r->flags;
+	f.info.leds = r->leds;
+	return f;
+}
+
+int ContainerReader::find(unsigned int frame_number) const
+{
+	unsigned int lo = 0, hi = n_frames;
+
+	// frames are written in capture order, frame numbers only grow //
+	while(lo < hi){
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if(entries[mid].frame_number < frame_number)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if(lo < n_frames && entries[lo].frame_number == frame_number)
+		return lo;
+	return -1;
+}
+
+unsigned int export_frames(const ContainerReader& reader, FrameSink *out)
+{
+	unsigned int i;
+
+	for(i = 0; i < reader.count(); ++i){
+		container_frame f = reader.frame(i);
+
+		out->consume(f.data, f.size, f.info);
+	}
+
+	return i;
+}
@@ -0,0 +1,147 @@
+#ifndef FRAME_CONTAINER_H
+#define FRAME_CONTAINER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "frame_sink.h"
+#include "metrics.h"
+
+/*
+	Session container, one file per capture instead of one file per frame.
+
+	pcam_file_header
+	record*			pcam_record_header + frame bytes, padded to 8
+	pcam_index_entry[count]
+	pcam_trailer	last 16 bytes of the file
+
+	All fields are little endian. A file cut short by a crash has no
+	index; ContainerReader rebuilds it by walking the records.
+*/
+#define PCAM_MAGIC			0x4d414350	// "PCAM"
+#define PCAM_RECORD_MAGIC	0x454d5246	// "FRME"
+#define PCAM_INDEX_MAGIC	0x58444950	// "PIDX"
+#define PCAM_VERSION		1
+
+struct pcam_file_header{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;		// sizeof(pcam_file_header), records start here
+	uint32_t width;
+	uint32_t height;
+	uint32_t pixelformat;		// V4L2 fourcc
+	uint64_t created_ns;		// CLOCK_REALTIME at open
+	uint8_t reserved[32];
+};
+
+struct pcam_record_header{
+	uint32_t magic;
+	uint32_t size;				// frame bytes following the header
+	uint32_t frame_number;
+	uint32_t sequence;
+	uint64_t timestamp_ns;
+	uint32_t flags;
+	uint32_t leds;
+};
+
+struct pcam_index_entry{
+	uint64_t offset;			// of the pcam_record_header
+	uint64_t timestamp_ns;
+	uint32_t frame_number;
+	uint32_t size;
+};
+
+struct pcam_trailer{
+	uint64_t index_offset;
+	uint32_t count;
+	uint32_t magic;
+};
+
+/*
+	ContainerWriter - append frames to a session file
+	Records are packed into a page-aligned chunk buffer that goes out
+	with one write() when full, so the card sees large sequential writes
+	at aligned offsets and a single inode. Writeback of each chunk is
+	started right away with sync_file_range(), close() appends the index.
+	Not thread safe: put an AsyncFrameSink in front of it.
+*/
+class ContainerWriter : public FrameSink{
+public:
+	ContainerWriter(const std::string& path, unsigned int width, unsigned int height,
+			unsigned int pixelformat, size_t chunk_size = 1 << 20);
+	~ContainerWriter();
+
+	void consume(const void *p, size_t size, const frame_info& info);
+
+	// flush, write index and trailer; further consume() calls throw //
+	void close();
+
+	unsigned int frames() const { return index.size(); }
+	uint64_t bytes() const { return file_pos + fill; }
+	// "<prefix>.bytes_written", what has actually gone to write() //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "session") const;
+private:
+	ContainerWriter(const ContainerWriter&);
+	ContainerWriter& operator=(const ContainerWriter&);
+
+	void append(const void *p, size_t size);
+	void write_chunk(size_t size);
+
+	std::string path;
+	int fd;
+	unsigned char *chunk;
+	size_t chunk_size;
+	size_t fill;
+	uint64_t file_pos;			// bytes already written to fd
+	MetricCounter n_written;	// file_pos, readable from other threads
+	std::vector<pcam_index_entry> index;
+};
+
+// one frame of a mapped container, data points into the mapping //
+struct container_frame{
+	const void *data;
+	size_t size;
+	frame_info info;
+};
+
+/*
+	ContainerReader - random access to a session file through mmap
+	frame(i) is O(1) through the index footer and copies nothing.
+*/
+class ContainerReader{
+public:
+	ContainerReader(const std::string& path);
+	~ContainerReader();
+
+	unsigned int count() const { return n_frames; }
+	container_frame frame(unsigned int i) const;
+	// index of frame_number, -1 if it is not in the file //
+	int find(unsigned int frame_number) const;
+
+	const pcam_file_header& header() const { return *hdr; }
+	// false when the index was rebuilt from the records //
+	bool indexed() const { return has_index; }
+private:
+	ContainerReader(const ContainerReader&);
+	ContainerReader& operator=(const ContainerReader&);
+
+	void scan();
+
+	std::string path;
+	int fd;
+	const unsigned char *base;
+	size_t length;
+
+	const pcam_file_header *hdr;
+	const pcam_index_entry *entries;
+	std::vector<pcam_index_entry> rebuilt;
+	unsigned int n_frames;
+	bool has_index;
+};
+
+// every frame of reader into out (e.g. a JpegFileSink), returns the count //
+unsigned int export_frames(const ContainerReader& reader, FrameSink *out);
+
+#endif
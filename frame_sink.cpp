@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <stdexcept>
+
+#include "frame_sink.h"
+
+using namespace std;
+
+#define WAKEUP_PERIOD chrono::milliseconds(10)
+
+JpegFileSink::JpegFileSink(const string& prefix) :
+	prefix(prefix)
+{
+}
+
+void JpegFileSink::consume(const void *p, size_t size, const frame_info& info)
+{
+	char filename[32];
+	snprintf(filename, sizeof(filename), "%u.jpg", info.frame_number);
+
+	FILE *fp = fopen((prefix + filename).c_str(), "wb");
+	if(!fp)
+		throw runtime_error(prefix + filename + " : cannot open! ");
+
+	fwrite(p, size, 1, fp);
+
+	fflush(fp);
+	fclose(fp);
+}
+
+AsyncFrameSink::AsyncFrameSink(FrameSink *target, size_t max_frame_size,
+		size_t depth, enum backpressure policy) :
+	target(target), max_frame_size(max_frame_size), n_slots(depth), policy(policy),
+	head(0), tail(0), running(true),
+	max_depth(0), n_queued(0), n_written(0), n_dropped(0), n_discarded(0), n_blocked(0)
+{
+	size_t i;
+
+	if(!target)
+		throw runtime_error("AsyncFrameSink : no target sink");
+	if(n_slots < 2)
+		throw runtime_error("AsyncFrameSink : depth must be at least 2");
+
+	// every slot is allocated here, nothing is malloc'd per frame //
+	arena.resize((n_slots + 1) * max_frame_size);
+	spare = &arena[n_slots * max_frame_size];
+	slots = new slot[n_slots];
+	for(i = 0; i < n_slots; ++i){
+		slots[i].seq.store(i, memory_order_relaxed);
+		slots[i].size = 0;
+		memset(&slots[i].info, 0, sizeof(slots[i].info));
+		slots[i].data = &arena[i * max_frame_size];
+	}
+
+	thread = std::thread(&AsyncFrameSink::writer, this);
+}
+
+AsyncFrameSink::~AsyncFrameSink()
+{
+	running.store(false);
+	data_ready.notify_one();
+	thread.join();
+	delete[] slots;
+}
+
+bool AsyncFrameSink::try_push(const void *p, size_t size, const frame_info& info)
+{
+	size_t pos = head.load(memory_order_relaxed);
+	slot *s = &slots[pos % n_slots];
+
+	if(s->seq.load(memory_order_acquire) != pos)
+		return false;
+
+	memcpy(s->data, p, size);
+	s->size = size;
+	s->info = info;
+	s->seq.store(pos + 1, memory_order_release);
+	head.store(pos + 1, memory_order_release);
+
+	return true;
+}
+
+bool AsyncFrameSink::pop(size_t *out)
+{
+	size_t pos = tail.load(memory_order_relaxed);
+
+	for(;;){
+		slot *s = &slots[pos % n_slots];
+		intptr_t diff = (intptr_t)s->seq.load(memory_order_acquire) - (intptr_t)(pos + 1);
+
+		if(diff == 0){
+			if(tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)){
+				*out = pos;
+				return true;
+			}
+		}else if(diff < 0){
+			return false;
+		}else{
+			pos = tail.load(memory_order_relaxed);
+		}
+	}
+}
+
+void AsyncFrameSink::release(size_t pos)
+{
+	slots[pos % n_slots].seq.store(pos + n_slots, memory_order_release);
+}
+
+void AsyncFrameSink::consume(const void *p, size_t size, const frame_info& info)
+{
+	size_t pos, depth;
+
+	if(size > max_frame_size){
+		n_dropped++;
+		return;
+	}
+
+	if(!try_push(p, size, info)){
+		switch(policy){
+			case BP_BLOCK:
+				n_blocked++;
+				while(!try_push(p, size, info)){
+					unique_lock<mutex> lk(lock);
+					space_ready.wait_for(lk, WAKEUP_PERIOD);
+				}
+				break;
+			case BP_DROP_OLDEST:
+				// the writer holds no slot while it writes, so a full ring is all
+				// queued frames and evicting the oldest always makes room //
+				if(pop(&pos)){
+					release(pos);
+					n_discarded++;
+					n_dropped++;
+				}
+				// the writer may be between pop() and release(), a few stores //
+				while(!try_push(p, size, info))
+					this_thread::yield();
+				break;
+			case BP_DROP_NEWEST:
+			default:
+				n_dropped++;
+				return;
+		}
+	}
+
+	n_queued++;
+	depth = head.load(memory_order_relaxed) - tail.load(memory_order_relaxed);
+	if(depth > max_depth.load(memory_order_relaxed))
+		max_depth.store(depth, memory_order_relaxed);
+
+	data_ready.notify_one();
+}
+
+void AsyncFrameSink::writer()
+{
+	size_t pos;
+
+	for(;;){
+		if(pop(&pos)){
+			slot *s = &slots[pos % n_slots];
+			unsigned char *data = s->data;
+			size_t size = s->size;
+			frame_info info = s->info;
+
+			// trade buffers with the slot and give it back before the slow write //
+			s->data = spare;
+			spare = data;
+			release(pos);
+			space_ready.notify_one();
+
+			try{
+				target->consume(data, size, info);
+				n_written++;
+			}catch(const exception&){
+				// a failing disk must not take the capture process down //
+				n_discarded++;
+				n_dropped++;
+			}
+			continue;
+		}
+
+		if(!running.load())
+			break;
+
+		unique_lock<mutex> lk(lock);
+		data_ready.wait_for(lk, WAKEUP_PERIOD);
+	}
+}
+
+void AsyncFrameSink::flush()
+{
+	// queued frames are either written or discarded on the way //
+	while(n_written.load() + n_discarded.load() < n_queued.load()){
+		unique_lock<mutex> lk(lock);
+		space_ready.wait_for(lk, WAKEUP_PERIOD);
+	}
+}
+
+void AsyncFrameSink::register_metrics(MetricsRegistry *reg, const string& prefix) const
+{
+	reg->add(prefix + ".depth", METRIC_GAUGE, [this]() { return (int64_t)stats().depth; });
+	reg->add(prefix + ".max_depth", METRIC_GAUGE, [this]() { return (int64_t)max_depth.load(); });
+	reg->add(prefix + ".queued", METRIC_COUNTER, [this]() { return (int64_t)n_queued.load(); });
+	reg->add(prefix + ".written", METRIC_COUNTER, [this]() { return (int64_t)n_written.load(); });
+	reg->add(prefix + ".dropped", METRIC_COUNTER, [this]() { return (int64_t)n_dropped.load(); });
+	reg->add(prefix + ".blocked", METRIC_COUNTER, [this]() { return (int64_t)n_blocked.load(); });
+}
+
+sink_stats AsyncFrameSink::stats() const
+{
+	sink_stats st;
+
+	size_t t = tail.load();
+
+	st.depth = head.load() - t;
+	st.max_depth = max_depth.load();
+	st.queued = n_queued.load();
+	st.written = n_written.load();
+	st.dropped = n_dropped.load();
+	st.blocked = n_blocked.load();
+
+	return st;
+}
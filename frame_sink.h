@@ -0,0 +1,125 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <vector>
+#include <string>
+
+#include "metrics.h"
+
+// frame_info.flags bit set by Picam::trigger_loop(), V4L2 leaves bit 31 unused //
+#define FRAME_FLAG_PRE_TRIGGER 0x80000000u
+
+struct frame_info{
+	unsigned int frame_number;	// Picam's running count, starts at 1
+	uint32_t sequence;			// driver sequence number (v4l2_buffer.sequence)
+	uint64_t timestamp_ns;		// driver capture timestamp
+	uint32_t flags;				// V4L2_BUF_FLAG_TIMESTAMP_* / TSTAMP_SRC_* of the buffer, FRAME_FLAG_*
+	uint32_t leds;				// bit i: strobe output i lit for this frame, set by StrobeTap
+};
+
+/*
+	FrameSink - consumer of captured frames
+	Picam hands every dequeued frame to its sink between VIDIOC_DQBUF and
+	VIDIOC_QBUF, so consume() must not keep the pointer after it returns.
+*/
+class FrameSink{
+public:
+	virtual ~FrameSink() {}
+
+	virtual void consume(const void *p, size_t size, const frame_info& info) = 0;
+};
+
+// write each frame to "<prefix><frame_number>.jpg" //
+class JpegFileSink : public FrameSink{
+public:
+	JpegFileSink(const std::string& prefix = "frame");
+
+	void consume(const void *p, size_t size, const frame_info& info);
+private:
+	std::string prefix;
+};
+
+enum backpressure {
+	BP_BLOCK,		// capture thread waits for a free slot
+	BP_DROP_OLDEST,	// discard the oldest queued frame
+	BP_DROP_NEWEST	// discard the incoming frame
+};
+
+struct sink_stats{
+	size_t depth;			// frames currently queued
+	size_t max_depth;		// high-water mark of depth
+	unsigned long queued;	// frames accepted by consume()
+	unsigned long written;	// frames handed to the target sink
+	unsigned long dropped;	// frames discarded by the policy or oversize
+	unsigned long blocked;	// consume() calls that had to wait
+};
+
+/*
+	AsyncFrameSink - moves a slow sink off the capture thread
+	consume() copies the frame into a preallocated slot of a bounded ring
+	and returns; a dedicated writer thread drains the ring into target.
+	Slots follow the bounded-queue sequence scheme so the capture thread can
+	reclaim the oldest slot for BP_DROP_OLDEST without locking the writer.
+	The writer swaps each popped slot's buffer for a spare one and releases
+	the slot before writing, so every slot of a full ring holds a queued
+	frame and BP_DROP_OLDEST never has to turn the newest one away.
+*/
+class AsyncFrameSink : public FrameSink{
+public:
+	AsyncFrameSink(FrameSink *target, size_t max_frame_size,
+			size_t depth = 16, enum backpressure policy = BP_DROP_OLDEST);
+	~AsyncFrameSink();
+
+	void consume(const void *p, size_t size, const frame_info& info);
+
+	// wait until every queued frame has reached target //
+	void flush();
+	sink_stats stats() const;
+	// "<prefix>.": sink_stats, depth and max_depth as gauges //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "sink") const;
+private:
+	struct slot{
+		std::atomic<size_t> seq;
+		size_t size;
+		frame_info info;
+		unsigned char *data;
+	};
+
+	bool try_push(const void *p, size_t size, const frame_info& info);
+	bool pop(size_t *pos);
+	void release(size_t pos);
+	void writer();
+
+	FrameSink *target;
+	size_t max_frame_size;
+	size_t n_slots;
+	enum backpressure policy;
+
+	std::vector<unsigned char> arena;
+	slot *slots;
+	unsigned char *spare;		// the writer's buffer, n_slots + 1 in the arena
+
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+
+	std::mutex lock;
+	std::condition_variable data_ready;
+	std::condition_variable space_ready;
+	std::atomic<bool> running;
+	std::thread thread;
+
+	std::atomic<size_t> max_depth;
+	std::atomic<unsigned long> n_queued;
+	std::atomic<unsigned long> n_written;
+	std::atomic<unsigned long> n_dropped;
+	std::atomic<unsigned long> n_discarded;
+	std::atomic<unsigned long> n_blocked;
+};
+
+#endif
@@ -3,94 +3,203 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdexcept> // runtime_error
-#include <string.h> // strncpy
-#include <fcntl.h> //open option
-#include <pthread.h> //thread
+#include <memory>
 
 #include "picam_v4l2_ctrl.h"
+#include "raspi2_gpio.h"
+#include "strobe_scheduler.h"
+#include "ring_recorder.h"
+#include "frame_container.h"
+#include "metrics.h"
+#include "frame_bus.h"
+#include "capture_service.h"
 
 #define XRES 640
 #define YRES 480
-#define BUF_SIZE 4
-#define IR_DEV "/dev/raspi2GPIO18"
-#define WHITE_DEV "/dev/raspi2GPIO23"
+#define FPS 60
+#define SINK_DEPTH 32
+#define N_FRAMES 180
+#define IR_PIN 18
+#define WHITE_PIN 23
+#define FLASH_FIRST 60	// white flash 1 s into the capture
+#define FLASH_LAST 61	// ... for two frames, ~33 ms at 60 fps
+#define TRIGGER_PIN 24	// grab -t : start on a rising edge here
+#define PRE_TRIGGER 30	// ... keeping the half second before it
+#define TRIGGER_WAIT 60	// seconds
+#define RING_MB 64		// grab -r : frames stay in memory ...
+#define RING_SECONDS 5
+#define SAVE_BEFORE 30	// ... and only this window around the flash is written
+#define SAVE_AFTER 90
+#define SESSION_FILE "session.pcam"	// pcam_export turns it back into frameN.jpg
+#define METRICS_PERIOD_MS 500	// picam_metrics -w reads them while grab runs
+#define BUS_SLOTS 8		// grab -b : bus_tap and other readers attach while grab runs
 
 using namespace std;
 
-int fd_White;
-
-void *t_function(void* data)
+/*
+	grab -s : stay streaming and capture a session per picam_ctl start,
+	IR on throughout. Reports the cold start time to first frame against
+	the warm one of the sessions.
+*/
+static int run_service()
 {
-	char* buf = (char*)data;
-	
-	sleep(1);
-	if(write(fd_White, buf, sizeof(buf))< 0)
-		cout << "white led on fail" << endl;
-	usleep(20000);
-
-	strncpy(buf, "0", 1);
-	buf[1] = '\0';
-	if(write(fd_White, buf, sizeof(buf)) <0)
-		cout << "white led off fail" << endl;
+	// the LED before the scheduler that switches it, so it is destroyed after //
+	unique_ptr<Raspi2Gpio> white;
+	unique_ptr<GpioStrobe> white_strobe;
+	StrobeScheduler strobe(FPS);
+	int flash = -1;
+
+	try{
+		white.reset(new Raspi2Gpio(WHITE_PIN));
+		white->set_output();
+		white_strobe.reset(new GpioStrobe(white.get()));
+		flash = strobe.add_output(white_strobe.get());
+	}catch(const exception& e){
+		cout << "white led : " << e.what() << endl;
+	}
+
+	CaptureService service("/dev/video0", XRES, YRES, &strobe, flash);
+	Raspi2Gpio ir(IR_PIN);
+	ir.set_output();
+
+	MetricsRegistry metrics;
+	service.camera().register_metrics(&metrics);
+	service.register_metrics(&metrics);
+	ir.register_metrics(&metrics);
+	strobe.register_metrics(&metrics);
+	MetricsExporter exporter(&metrics, METRICS_SHM, METRICS_PERIOD_MS);
 
+	ir.write(true);
+	cout << "capture service on " << SERVICE_NAME << ", picam_ctl quit to stop" << endl;
+	service.run();
+	ir.write(false);
+
+	service_stats s = service.stats();
+	cout << "cold start to first frame : " << s.cold_ttff_ns / 1000 << " us, sessions : " << s.sessions
+		<< ", warm start p50 / max : " << service.warm_ttff().percentile(50) / 1000 << " / "
+		<< service.warm_ttff().max() / 1000 << " us" << endl;
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
+	bool ring = false, triggered = false, publish = false;
+	int i;
+
+	if(argc > 1 && strcmp(argv[1], "-s") == 0)
+		return run_service();
+
+	for(i = 1; i < argc; ++i){
+		if(strcmp(argv[i], "-r") == 0)
+			ring = true;
+		else if(strcmp(argv[i], "-t") == 0)
+			triggered = true;
+		else if(strcmp(argv[i], "-b") == 0)
+			publish = true;
+		else{
+			cerr << "usage : " << argv[0] << " [-s | [-r] [-t] [-b]]" << endl;
+			return 1;
+		}
+	}
 
-	int fd_IR;
-	pthread_t p_thread;
-	int thr_id;
-	char buf[BUF_SIZE];
 	Picam picam("/dev/video0", XRES, YRES);
+	ContainerWriter session(SESSION_FILE, picam.width(), picam.height(), picam.pixel_format());
+	AsyncFrameSink async_sink(&session, picam.max_frame_size(), SINK_DEPTH, BP_DROP_OLDEST);
+	// the LED before the scheduler that switches it, so it is destroyed after //
+	unique_ptr<Raspi2Gpio> white;
+	unique_ptr<GpioStrobe> white_strobe;
+	StrobeScheduler strobe(FPS);
+	unique_ptr<RingRecorder> recorder;
+
+	unique_ptr<FrameBus> bus;
+	FrameSink *store;
+
+	if(ring)
+		recorder.reset(new RingRecorder(RING_MB, RING_SECONDS * 1000000000ULL));
+	store = recorder ? (FrameSink*) recorder.get() : &async_sink;
+
+	// readers are optional, a capture goes ahead without them //
+	if(publish){
+		try{
+			bus.reset(new FrameBus(picam.max_frame_size(), picam.width(), picam.height(), picam.pixel_format(),
+					BUS_SLOTS, FRAME_BUS_NAME, store));
+		}catch(const exception& e){
+			cout << "frame bus : " << e.what() << endl;
+		}
+	}
+	StrobeTap tap(&strobe, bus ? (FrameSink*) bus.get() : store);
 
-	fd_IR = open(IR_DEV, O_WRONLY);
-	fd_White = open(WHITE_DEV, O_WRONLY);
-
-	if(fd_IR < 0)
-		runtime_error("Can not open IR GPIO DEV");
-
-	if(fd_White < 0)
-		cout << "white led dev open error" << endl;
+	picam.set_sink(&tap);
 
-	strncpy(buf, "out", 3);
-	buf[3] = '\0';
+	Raspi2Gpio ir(IR_PIN);
+	ir.set_output();
 
-	if(write(fd_IR, buf, sizeof(buf)) < 0){
-		runtime_error("Can not set output IR LED");
-		exit(EXIT_FAILURE);
-	}
-	if(write(fd_White, buf, sizeof(buf)) < 0){
-		cout << "white led output error" << endl;
+	try{
+		white.reset(new Raspi2Gpio(WHITE_PIN));
+		white->set_output();
+		white_strobe.reset(new GpioStrobe(white.get()));
+		strobe.schedule(strobe.add_output(white_strobe.get()), FLASH_FIRST, FLASH_LAST);
+	}catch(const exception& e){
+		cout << "white led : " << e.what() << endl;
 	}
-	
 
-	strncpy(buf, "1", 1);
-	buf[1] = '\0';
-
-	if(write(fd_IR, buf, sizeof(buf)) < 0){
-		runtime_error("Can not write On");
-		exit(EXIT_FAILURE);
+	MetricsRegistry metrics;
+	picam.register_metrics(&metrics);
+	ir.register_metrics(&metrics);
+	if(white)
+		white->register_metrics(&metrics);
+	strobe.register_metrics(&metrics);
+	async_sink.register_metrics(&metrics);
+	session.register_metrics(&metrics);
+	if(bus)
+		bus->register_metrics(&metrics);
+	// declared after everything it reads, so it stops first //
+	MetricsExporter exporter(&metrics, METRICS_SHM, METRICS_PERIOD_MS);
+
+	ir.write(true);
+
+	if(triggered){
+		Raspi2Gpio trigger(TRIGGER_PIN);
+
+		trigger.set_edge(RASPI2_GPIO_EDGE_RISING);
+		trigger.set_debounce(0);
+
+		cout << "waiting for trigger on gpio " << TRIGGER_PIN << endl;
+		if(picam.trigger_loop(&trigger, N_FRAMES, PRE_TRIGGER, TRIGGER_WAIT)){
+			const trigger_stats& ts = picam.last_trigger();
+			cout << "edge to first frame : " << ts.edge_to_frame_ns / 1000 << " us, to dequeue : "
+				<< ts.edge_to_dequeue_ns / 1000 << " us, pre-trigger frames : " << ts.pre_frames << endl;
+		}else{
+			cout << "no trigger" << endl;
+		}
+	}else{
+		picam.mainloop(1, N_FRAMES);
 	}
+	async_sink.flush();
 
-
-	thr_id = pthread_create(&p_thread, NULL, t_function, (void*)buf);
-	if(thr_id < 0){
-		runtime_error("Create Thread failed");
-		exit(0);
+	if(recorder){
+		recorder_stats rs = recorder->stats();
+		unsigned int n = recorder->save_frames(&session, FLASH_FIRST - SAVE_BEFORE, FLASH_LAST + SAVE_AFTER);
+		cout << "frames in memory : " << rs.frames << " (" << rs.bytes / 1024 << " KiB), saved : " << n << endl;
 	}
 
-	picam.mainloop(1, 180);
+	ir.write(false);
+	session.close();
 
-	strncpy(buf, "0", 1);
-	buf[1] = '\0';
+	sink_stats st = async_sink.stats();
+	cout << "frames written : " << st.written << ", dropped : " << st.dropped
+		<< ", max queue depth : " << st.max_depth << endl;
 
-	if(write(fd_IR, buf, sizeof(buf)) < 0){
-		runtime_error("Can not write Off");
-		exit(EXIT_FAILURE);
-	}
+	strobe_stats ss = strobe.stats();
+	cout << "led toggles : " << ss.toggles << ", driver pulses : " << ss.hw_pulses
+		<< " (" << ss.hw_unknown << " untimed), late : " << ss.late;
+	if(strobe.jitter().count())
+		cout << ", jitter p50 / max : " << strobe.jitter().percentile(50) / 1000 << " / "
+			<< strobe.jitter().max() / 1000 << " us over " << strobe.jitter().count() << " edges";
+	cout << endl;
 
-	pthread_detach(p_thread);
 	return 0;
 }
@@ -0,0 +1,139 @@
+#include <string.h>
+
+#include "jpeg_luma.h"
+
+JpegLumaDecoder::JpegLumaDecoder()
+{
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = error_exit;
+	err.pub.output_message = output_message;
+	err.self = this;
+	error_msg[0] = '\0';
+
+	jpeg_create_decompress(&cinfo);
+}
+
+JpegLumaDecoder::~JpegLumaDecoder()
+{
+	jpeg_destroy_decompress(&cinfo);
+}
+
+void JpegLumaDecoder::error_exit(j_common_ptr cinfo)
+{
+	error_mgr *err = (error_mgr*) cinfo->err;
+
+	(*cinfo->err->format_message)(cinfo, err->self->error_msg);
+	longjmp(err->env, 1);
+}
+
+void JpegLumaDecoder::output_message(j_common_ptr cinfo)
+{
+	// warnings (e.g. truncated UVC frames) are not worth a line per frame //
+	(void)cinfo;
+}
+
+bool JpegLumaDecoder::decode(const void *jpeg, size_t size, unsigned int scale_denom,
+		unsigned char *out, size_t out_size, luma_frame *frame)
+{
+	JSAMPROW row;
+
+	if(setjmp(err.env)){
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_mem_src(&cinfo, (unsigned char*)jpeg, size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = scale_denom;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+
+	jpeg_calc_output_dimensions(&cinfo);
+
+	if((size_t)cinfo.output_width * cinfo.output_height > out_size){
+		strcpy(error_msg, "output buffer too small");
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_start_decompress(&cinfo);
+
+	while(cinfo.output_scanline < cinfo.output_height){
+		row = out + (size_t)cinfo.output_scanline * cinfo.output_width;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	frame->width = cinfo.output_width;
+	frame->height = cinfo.output_height;
+	frame->stride = cinfo.output_width;
+	frame->data = out;
+
+	jpeg_finish_decompress(&cinfo);
+	return true;
+}
+
+bool JpegLumaDecoder::decode_region(const void *jpeg, size_t size, pupil_roi *roi,
+		unsigned char *out, size_t out_size, luma_frame *frame)
+{
+	JDIMENSION x, w;
+	JSAMPROW row;
+	unsigned int y, h;
+
+	if(setjmp(err.env)){
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_mem_src(&cinfo, (unsigned char*)jpeg, size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 1;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+
+	jpeg_start_decompress(&cinfo);
+
+	if(roi->x >= cinfo.output_width || roi->y >= cinfo.output_height || !roi->width || !roi->height){
+		strcpy(error_msg, "region outside the frame");
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	x = roi->x;
+	w = roi->width < cinfo.output_width - x ? roi->width : cinfo.output_width - x;
+	y = roi->y;
+	h = roi->height < cinfo.output_height - y ? roi->height : cinfo.output_height - y;
+
+	jpeg_crop_scanline(&cinfo, &x, &w);
+	if((size_t)w * h > out_size){
+		strcpy(error_msg, "output buffer too small");
+		jpeg_abort_decompress(&cinfo);
+		return false;
+	}
+
+	if(y)
+		jpeg_skip_scanlines(&cinfo, y);
+	while(cinfo.output_scanline < y + h){
+		row = out + (size_t)(cinfo.output_scanline - y) * w;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	roi->x = x;
+	roi->y = y;
+	roi->width = w;
+	roi->height = h;
+
+	frame->width = w;
+	frame->height = h;
+	frame->stride = w;
+	frame->data = out;
+
+	// the rows below are not needed, finishing would decode them //
+	jpeg_abort_decompress(&cinfo);
+	return true;
+}
@@ -0,0 +1,55 @@
+#ifndef JPEG_LUMA_H
+#define JPEG_LUMA_H
+
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+#include "luma_frame.h"
+#include "pupil_detector.h"
+
+/*
+	JpegLumaDecoder - decode the Y plane of an MJPEG frame
+	Output is requested as JCS_GRAYSCALE so libjpeg-turbo skips the chroma
+	IDCT, upsampling and color conversion. scale_denom (1, 2, 4 or 8)
+	downscales in the DCT domain. One decoder per thread.
+*/
+class JpegLumaDecoder{
+public:
+	JpegLumaDecoder();
+	~JpegLumaDecoder();
+
+	// false on a corrupt frame or if out is smaller than the scaled image //
+	bool decode(const void *jpeg, size_t size, unsigned int scale_denom,
+			unsigned char *out, size_t out_size, luma_frame *frame);
+
+	/*
+		Full-scale decode of roi only. roi is widened to the iMCU columns
+		jpeg_crop_scanline() can cut at and written back; rows above it
+		go through jpeg_skip_scanlines(), entropy decoding without IDCT,
+		rows below are never decoded. frame covers roi, so its
+		coordinates are relative to roi->x, roi->y.
+	*/
+	bool decode_region(const void *jpeg, size_t size, pupil_roi *roi,
+			unsigned char *out, size_t out_size, luma_frame *frame);
+
+	const char *last_error() const { return error_msg; }
+private:
+	JpegLumaDecoder(const JpegLumaDecoder&);
+	JpegLumaDecoder& operator=(const JpegLumaDecoder&);
+
+	struct error_mgr{
+		struct jpeg_error_mgr pub;
+		jmp_buf env;
+		JpegLumaDecoder *self;
+	};
+	static void error_exit(j_common_ptr cinfo);
+	static void output_message(j_common_ptr cinfo);
+
+	struct jpeg_decompress_struct cinfo;
+	struct error_mgr err;
+	char error_msg[JMSG_LENGTH_MAX];
+};
+
+#endif
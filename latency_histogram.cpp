@@ -0,0 +1,103 @@
+#include "latency_histogram.h"
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram()
+{
+	reset();
+}
+
+void LatencyHistogram::reset()
+{
+	unsigned int i;
+
+	for(i = 0; i < LH_BUCKETS; ++i)
+		buckets[i].store(0, memory_order_relaxed);
+	n.store(0, memory_order_relaxed);
+	sum.store(0, memory_order_relaxed);
+	max_ns.store(0, memory_order_relaxed);
+}
+
+unsigned int LatencyHistogram::bucket_of(uint64_t ns)
+{
+	unsigned int msb;
+
+	if(ns < LH_SUB_BUCKETS)
+		return (unsigned int)ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - LH_SUB_BITS + 1) * LH_SUB_BUCKETS
+		+ (unsigned int)((ns >> (msb - LH_SUB_BITS)) & (LH_SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucket_top(unsigned int bucket)
+{
+	unsigned int octave = bucket / LH_SUB_BUCKETS;
+	uint64_t sub = bucket % LH_SUB_BUCKETS;
+	unsigned int shift;
+
+	if(octave == 0)
+		return sub;
+
+	shift = octave - 1;
+	return ((LH_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns)
+{
+	uint64_t cur = max_ns.load(memory_order_relaxed);
+
+	buckets[bucket_of(ns)].fetch_add(1, memory_order_relaxed);
+	n.fetch_add(1, memory_order_relaxed);
+	sum.fetch_add(ns, memory_order_relaxed);
+
+	while(ns > cur && !max_ns.compare_exchange_weak(cur, ns, memory_order_relaxed))
+		;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other)
+{
+	uint64_t m = other.max(), cur = max_ns.load(memory_order_relaxed);
+	unsigned int i;
+
+	for(i = 0; i < LH_BUCKETS; ++i){
+		uint64_t c = other.buckets[i].load(memory_order_relaxed);
+		if(c)
+			buckets[i].fetch_add(c, memory_order_relaxed);
+	}
+	n.fetch_add(other.count(), memory_order_relaxed);
+	sum.fetch_add(other.sum.load(memory_order_relaxed), memory_order_relaxed);
+
+	while(m > cur && !max_ns.compare_exchange_weak(cur, m, memory_order_relaxed))
+		;
+}
+
+uint64_t LatencyHistogram::mean() const
+{
+	uint64_t c = count();
+
+	return c ? sum.load(memory_order_relaxed) / c : 0;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+	uint64_t total = count(), rank, seen = 0;
+	unsigned int i;
+
+	if(total == 0)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * total + 0.5);
+	if(rank == 0)
+		rank = 1;
+
+	for(i = 0; i < LH_BUCKETS; ++i){
+		seen += buckets[i].load(memory_order_relaxed);
+		if(seen >= rank){
+			uint64_t top = bucket_top(i);
+			return top < max() ? top : max();
+		}
+	}
+
+	return max();
+}
@@ -0,0 +1,50 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+#define LH_SUB_BITS		3
+#define LH_SUB_BUCKETS	(1 << LH_SUB_BITS)
+#define LH_BUCKETS		(64 * LH_SUB_BUCKETS)
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+	LatencyHistogram - lock-free log-linear histogram of nanosecond values
+	Each power of two is split into LH_SUB_BUCKETS linear buckets, so a
+	percentile is accurate to about 1/LH_SUB_BUCKETS of its value.
+	record() is safe from any thread.
+*/
+class LatencyHistogram{
+public:
+	LatencyHistogram();
+
+	void record(uint64_t ns);
+	void reset();
+	// add the samples of other, e.g. to combine per-thread histograms //
+	void merge(const LatencyHistogram& other);
+
+	uint64_t count() const { return n.load(std::memory_order_relaxed); }
+	uint64_t max() const { return max_ns.load(std::memory_order_relaxed); }
+	uint64_t mean() const;
+	// upper bound of the bucket holding the p-th percentile, p in [0, 100] //
+	uint64_t percentile(double p) const;
+private:
+	static unsigned int bucket_of(uint64_t ns);
+	static uint64_t bucket_top(unsigned int bucket);
+
+	std::atomic<uint64_t> buckets[LH_BUCKETS];
+	std::atomic<uint64_t> n;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max_ns;
+};
+
+#endif
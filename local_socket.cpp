@@ -0,0 +1,69 @@
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <stdexcept>
+
+#include "local_socket.h"
+
+using namespace std;
+
+// abstract socket address for name, no file left behind //
+static socklen_t local_address(const string& name, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(name.size() + 1 >= sizeof(addr->sun_path))
+		throw runtime_error(name + " : socket name too long");
+	memcpy(addr->sun_path + 1, name.c_str(), name.size());
+	return offsetof(struct sockaddr_un, sun_path) + 1 + name.size();
+}
+
+int local_listen(const string& name, int backlog)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = local_address(name, &addr);
+	int fd, err;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(-1 == fd)
+		return -1;
+	if(-1 == bind(fd, (struct sockaddr*)&addr, addr_len) || -1 == listen(fd, backlog)){
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int local_connect(const string& name)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len = local_address(name, &addr);
+	int fd, err;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(-1 == fd)
+		return -1;
+	if(-1 == connect(fd, (struct sockaddr*)&addr, addr_len)){
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+void wake_eventfd(int fd)
+{
+	uint64_t one = 1;
+
+	if(write(fd, &one, sizeof(one)) < 0){
+		// cannot fail for a fresh eventfd //
+	}
+}
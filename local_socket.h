@@ -0,0 +1,18 @@
+#ifndef LOCAL_SOCKET_H
+#define LOCAL_SOCKET_H
+
+#include <string>
+
+/*
+	SOCK_SEQPACKET sockets in the abstract AF_UNIX namespace, what the
+	frame bus and the capture service listen on: nothing is left in the
+	filesystem and the name goes away with the process. Both throw if name
+	does not fit in sun_path and return -1 with errno set otherwise.
+*/
+int local_listen(const std::string& name, int backlog);
+int local_connect(const std::string& name);
+
+// wake a thread polling the eventfd //
+void wake_eventfd(int fd);
+
+#endif
@@ -0,0 +1,219 @@
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "luma.h"
+
+bool luma_supported(uint32_t pixelformat)
+{
+	switch(pixelformat){
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_UYVY:
+		case V4L2_PIX_FMT_GREY:
+		case V4L2_PIX_FMT_NV12:
+			return true;
+		default:
+			return false;
+	}
+}
+
+void luma_row_yuyv_scalar(const unsigned char *src, unsigned char *dst, unsigned int width)
+{
+	unsigned int x;
+
+	for(x = 0; x < width; ++x)
+		dst[x] = src[2 * x];
+}
+
+void luma_row_uyvy_scalar(const unsigned char *src, unsigned char *dst, unsigned int width)
+{
+	unsigned int x;
+
+	for(x = 0; x < width; ++x)
+		dst[x] = src[2 * x + 1];
+}
+
+void luma_row_yuyv(const unsigned char *src, unsigned char *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+
+	for(; x + 16 <= width; x += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * x + 16));
+
+		a = _mm_and_si128(a, mask);
+		b = _mm_and_si128(b, mask);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for(; x + 16 <= width; x += 16){
+		uint8x16x2_t yc = vld2q_u8(src + 2 * x);
+
+		vst1q_u8(dst + x, yc.val[0]);
+	}
+#endif
+
+	luma_row_yuyv_scalar(src + 2 * x, dst + x, width - x);
+}
+
+void luma_row_uyvy(const unsigned char *src, unsigned char *dst, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__SSE2__)
+	for(; x + 16 <= width; x += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * x + 16));
+
+		a = _mm_srli_epi16(a, 8);
+		b = _mm_srli_epi16(b, 8);
+		_mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	for(; x + 16 <= width; x += 16){
+		uint8x16x2_t cy = vld2q_u8(src + 2 * x);
+
+		vst1q_u8(dst + x, cy.val[1]);
+	}
+#endif
+
+	luma_row_uyvy_scalar(src + 2 * x, dst + x, width - x);
+}
+
+static void merge_bins(uint32_t bins[4][256], uint32_t hist[256])
+{
+	unsigned int i;
+
+	for(i = 0; i < 256; ++i)
+		hist[i] = bins[0][i] + bins[1][i] + bins[2][i] + bins[3][i];
+}
+
+uint64_t luma_histogram_scalar(const unsigned char *src, size_t stride, unsigned int width, unsigned int height,
+		uint32_t hist[256])
+{
+	uint64_t sum = 0;
+	unsigned int x, y;
+
+	memset(hist, 0, 256 * sizeof(uint32_t));
+	for(y = 0; y < height; ++y){
+		const unsigned char *s = src + y * stride;
+
+		for(x = 0; x < width; ++x){
+			hist[s[x]]++;
+			sum += s[x];
+		}
+	}
+
+	return sum;
+}
+
+uint64_t luma_histogram(const unsigned char *src, size_t stride, unsigned int width, unsigned int height,
+		uint32_t hist[256])
+{
+	uint32_t bins[4][256];
+	uint64_t sum = 0;
+	unsigned int x, y;
+
+	memset(bins, 0, sizeof(bins));
+
+	for(y = 0; y < height; ++y){
+		const unsigned char *s = src + y * stride;
+
+		x = 0;
+#if defined(__SSE2__)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			__m128i acc = zero;
+			unsigned int i;
+
+			for(; x + 16 <= width; x += 16){
+				__m128i v = _mm_loadu_si128((const __m128i*)(s + x));
+
+				// two 64-bit partial sums of 8 bytes each //
+				acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+				// no scatter in SSE2 or NEON, the bins are counted one sample at a time //
+				for(i = 0; i < 16; i += 4){
+					bins[0][s[x + i]]++;
+					bins[1][s[x + i + 1]]++;
+					bins[2][s[x + i + 2]]++;
+					bins[3][s[x + i + 3]]++;
+				}
+			}
+			sum += (uint64_t)_mm_cvtsi128_si32(acc) + (uint64_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+		}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+		{
+			uint32x4_t acc = vdupq_n_u32(0);
+			uint64x2_t total;
+			unsigned int i;
+
+			for(; x + 16 <= width; x += 16){
+				uint8x16_t v = vld1q_u8(s + x);
+
+				acc = vpadalq_u16(acc, vpaddlq_u8(v));
+				for(i = 0; i < 16; i += 4){
+					bins[0][s[x + i]]++;
+					bins[1][s[x + i + 1]]++;
+					bins[2][s[x + i + 2]]++;
+					bins[3][s[x + i + 3]]++;
+				}
+			}
+			total = vpaddlq_u32(acc);
+			sum += vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+		}
+#else
+		for(; x + 4 <= width; x += 4){
+			bins[0][s[x]]++;
+			bins[1][s[x + 1]]++;
+			bins[2][s[x + 2]]++;
+			bins[3][s[x + 3]]++;
+			sum += s[x] + s[x + 1] + s[x + 2] + s[x + 3];
+		}
+#endif
+		for(; x < width; ++x){
+			bins[0][s[x]]++;
+			sum += s[x];
+		}
+	}
+
+	merge_bins(bins, hist);
+	return sum;
+}
+
+void extract_luma(const void *src, size_t stride, unsigned int width, unsigned int height,
+		uint32_t pixelformat, unsigned char *dst)
+{
+	const unsigned char *s = (const unsigned char*)src;
+	unsigned int y;
+
+	switch(pixelformat){
+		case V4L2_PIX_FMT_YUYV:
+			for(y = 0; y < height; ++y)
+				luma_row_yuyv(s + y * stride, dst + (size_t)y * width, width);
+			break;
+		case V4L2_PIX_FMT_UYVY:
+			for(y = 0; y < height; ++y)
+				luma_row_uyvy(s + y * stride, dst + (size_t)y * width, width);
+			break;
+		case V4L2_PIX_FMT_GREY:
+		case V4L2_PIX_FMT_NV12:
+			if(stride == width){
+				memcpy(dst, s, (size_t)width * height);
+				break;
+			}
+			for(y = 0; y < height; ++y)
+				memcpy(dst + (size_t)y * width, s + y * stride, width);
+			break;
+		default:
+			break;
+	}
+}
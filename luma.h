@@ -0,0 +1,40 @@
+#ifndef LUMA_H
+#define LUMA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// true for the raw formats extract_luma() understands //
+bool luma_supported(uint32_t pixelformat);
+
+/*
+	extract_luma - copy the Y samples of a raw frame into a packed plane
+	src rows are stride (bytesperline) bytes apart, dst rows are width
+	bytes apart. YUYV / UYVY are deinterleaved with SSE2 or NEON when the
+	build targets them; GREY and the NV12 Y plane are plain row copies.
+*/
+void extract_luma(const void *src, size_t stride, unsigned int width, unsigned int height,
+		uint32_t pixelformat, unsigned char *dst);
+
+// single-row kernels, exposed for benchmarking the scalar fallback //
+void luma_row_yuyv(const unsigned char *src, unsigned char *dst, unsigned int width);
+void luma_row_uyvy(const unsigned char *src, unsigned char *dst, unsigned int width);
+void luma_row_yuyv_scalar(const unsigned char *src, unsigned char *dst, unsigned int width);
+void luma_row_uyvy_scalar(const unsigned char *src, unsigned char *dst, unsigned int width);
+
+/*
+	luma_histogram - 256-bin histogram of a width x height window of a
+	luma plane, rows stride bytes apart. hist is overwritten; returns the
+	sum of all samples. Only the sum is vectorised, SSE2 / NEON add 16
+	samples per step. The bin counting stays scalar: neither has a
+	scatter or a per-lane indexed increment, and emulating one costs a
+	compare per bin per vector, far more than 16 table increments. The
+	bins go to four interleaved tables instead, so runs of equal pixels
+	(flat IR backgrounds) do not serialise on one counter.
+*/
+uint64_t luma_histogram(const unsigned char *src, size_t stride, unsigned int width, unsigned int height,
+		uint32_t hist[256]);
+uint64_t luma_histogram_scalar(const unsigned char *src, size_t stride, unsigned int width, unsigned int height,
+		uint32_t hist[256]);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef LUMA_FRAME_H
+#define LUMA_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	luma_frame - 8-bit grayscale view of one captured frame
+	data is not owned; rows are stride bytes apart.
+*/
+struct luma_frame{
+	unsigned int frame_number;
+	uint64_t timestamp_ns;		// driver capture timestamp of the source frame
+	unsigned int width;
+	unsigned int height;
+	size_t stride;
+	const unsigned char *data;
+};
+
+// consumer of decoded / extracted luma frames //
+class LumaSink{
+public:
+	virtual ~LumaSink() {}
+
+	virtual void consume(const luma_frame& frame) = 0;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <stdexcept>
+
+#include "metrics.h"
+
+using namespace std;
+
+unsigned int MetricHistogram::shard()
+{
+	static atomic<unsigned int> next(0);
+	static thread_local unsigned int mine = next.fetch_add(1, memory_order_relaxed) % METRIC_SHARDS;
+
+	return mine;
+}
+
+void MetricHistogram::snapshot(LatencyHistogram *out) const
+{
+	unsigned int i;
+
+	out->reset();
+	for(i = 0; i < METRIC_SHARDS; ++i)
+		out->merge(shards[i].h);
+}
+
+void MetricsRegistry::add(const entry& e)
+{
+	lock_guard<mutex> lk(lock);
+
+	if(e.name.size() >= METRIC_NAME_MAX)
+		throw runtime_error("MetricsRegistry : name too long : " + e.name);
+	if(entries.size() >= METRICS_MAX)
+		throw runtime_error("MetricsRegistry : too many metrics");
+	entries.push_back(e);
+}
+
+void MetricsRegistry::add(const string& name, const MetricCounter *c)
+{
+	entry e = { name, METRIC_COUNTER, c, NULL, NULL, NULL, nullptr };
+	add(e);
+}
+
+void MetricsRegistry::add(const string& name, const MetricGauge *g)
+{
+	entry e = { name, METRIC_GAUGE, NULL, g, NULL, NULL, nullptr };
+	add(e);
+}
+
+void MetricsRegistry::add(const string& name, const MetricHistogram *h)
+{
+	entry e = { name, METRIC_HISTOGRAM, NULL, NULL, h, NULL, nullptr };
+	add(e);
+}
+
+void MetricsRegistry::add(const string& name, const LatencyHistogram *h)
+{
+	entry e = { name, METRIC_HISTOGRAM, NULL, NULL, NULL, h, nullptr };
+	add(e);
+}
+
+void MetricsRegistry::add(const string& name, enum metric_kind kind, function<int64_t()> probe)
+{
+	entry e = { name, kind, NULL, NULL, NULL, NULL, probe };
+
+	if(kind == METRIC_HISTOGRAM)
+		throw runtime_error("MetricsRegistry : a probe is a counter or a gauge");
+	add(e);
+}
+
+unsigned int MetricsRegistry::size() const
+{
+	lock_guard<mutex> lk(lock);
+
+	return entries.size();
+}
+
+static void fill_histogram(metric_value *v, const LatencyHistogram& h)
+{
+	v->value = h.count();
+	v->mean_ns = h.mean();
+	v->p50_ns = h.percentile(50);
+	v->p99_ns = h.percentile(99);
+	v->p999_ns = h.percentile(99.9);
+	v->max_ns = h.max();
+}
+
+unsigned int MetricsRegistry::snapshot(metric_value *out, unsigned int max) const
+{
+	lock_guard<mutex> lk(lock);
+	LatencyHistogram merged;
+	unsigned int i;
+
+	for(i = 0; i < entries.size() && i < max; ++i){
+		const entry& e = entries[i];
+		metric_value *v = &out[i];
+
+		memset(v, 0, sizeof(*v));
+		strncpy(v->name, e.name.c_str(), METRIC_NAME_MAX - 1);
+		v->kind = e.kind;
+
+		if(e.probe)
+			v->value = e.probe();
+		else if(e.counter)
+			v->value = e.counter->value();
+		else if(e.gauge)
+			v->value = e.gauge->value();
+		else if(e.hist){
+			e.hist->snapshot(&merged);
+			fill_histogram(v, merged);
+		}else if(e.latency)
+			fill_histogram(v, *e.latency);
+	}
+
+	return i;
+}
+
+MetricsExporter::MetricsExporter(const MetricsRegistry *registry, const string& name, int period_ms) :
+	registry(registry), name(name), period_ns((uint64_t)period_ms * 1000000ULL),
+	scratch(METRICS_MAX), running(true)
+{
+	void *p;
+	int fd;
+
+	if(!registry || period_ms <= 0)
+		throw runtime_error("MetricsExporter : registry and a period are required");
+
+	fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(-1 == fd)
+		throw runtime_error(name + " : shm_open failed");
+
+	if(-1 == ftruncate(fd, sizeof(metrics_page))){
+		close(fd);
+		shm_unlink(name.c_str());
+		throw runtime_error(name + " : ftruncate failed");
+	}
+
+	p = mmap(NULL, sizeof(metrics_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == p){
+		shm_unlink(name.c_str());
+		throw runtime_error(name + " : mmap failed");
+	}
+
+	// fresh from ftruncate, all zero: seq 0, count 0 //
+	page = (metrics_page*) p;
+	page->version = METRICS_VERSION;
+	page->period_ns = period_ns;
+	page->pid = getpid();
+	atomic_thread_fence(memory_order_release);
+	page->magic = METRICS_MAGIC;
+
+	thread = std::thread(&MetricsExporter::run, this);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+	{
+		lock_guard<mutex> lk(lock);
+		running = false;
+	}
+	wake.notify_all();
+	thread.join();
+
+	munmap(page, sizeof(metrics_page));
+	shm_unlink(name.c_str());
+}
+
+void MetricsExporter::publish()
+{
+	lock_guard<mutex> lk(publish_lock);
+	unsigned int n, s;
+
+	// gather first, so the page is odd only for the copy //
+	n = registry->snapshot(&scratch[0], METRICS_MAX);
+
+	s = page->seq.load(memory_order_relaxed);
+	page->seq.store(s + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(page->metrics, &scratch[0], n * sizeof(metric_value));
+	page->count = n;
+	page->snapshot_ns = monotonic_ns();
+
+	page->seq.store(s + 2, memory_order_release);
+}
+
+void MetricsExporter::run()
+{
+	unique_lock<mutex> lk(lock);
+
+	while(running){
+		lk.unlock();
+		publish();
+		lk.lock();
+		wake.wait_for(lk, chrono::nanoseconds(period_ns));
+	}
+}
+
+MetricsReader::MetricsReader(const string& name)
+{
+	struct stat st;
+	uint32_t magic;
+	void *p;
+	int fd;
+
+	fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(-1 == fd)
+		throw runtime_error(name + " : no exporter");
+
+	// between the exporter's shm_open and ftruncate the page is empty, touching it would SIGBUS //
+	if(-1 == fstat(fd, &st) || st.st_size < (off_t)sizeof(metrics_page)){
+		close(fd);
+		throw runtime_error(name + " : no exporter yet");
+	}
+
+	p = mmap(NULL, sizeof(metrics_page), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(MAP_FAILED == p)
+		throw runtime_error(name + " : mmap failed");
+
+	page = (const metrics_page*) p;
+	magic = page->magic;
+	atomic_thread_fence(memory_order_acquire);
+	// magic is written last, the exporter is still setting up //
+	if(magic == 0){
+		munmap(p, sizeof(metrics_page));
+		throw runtime_error(name + " : no exporter yet");
+	}
+	if(magic != METRICS_MAGIC || page->version != METRICS_VERSION){
+		munmap(p, sizeof(metrics_page));
+		throw runtime_error(name + " : not a metrics page");
+	}
+}
+
+MetricsReader::~MetricsReader()
+{
+	munmap((void*)page, sizeof(metrics_page));
+}
+
+bool MetricsReader::read(vector<metric_value> *out, uint64_t *snapshot_ns) const
+{
+	for(;;){
+		unsigned int s1, s2, n;
+		uint64_t t;
+
+		s1 = page->seq.load(memory_order_acquire);
+		if(s1 == 0)
+			return false;
+		if(s1 & 1){
+			sched_yield();
+			continue;
+		}
+
+		n = page->count;
+		if(n > METRICS_MAX)
+			n = METRICS_MAX;
+		out->resize(n);
+		if(n)
+			memcpy(&(*out)[0], page->metrics, n * sizeof(metric_value));
+		t = page->snapshot_ns;
+
+		atomic_thread_fence(memory_order_acquire);
+		s2 = page->seq.load(memory_order_relaxed);
+		if(s1 != s2)
+			continue;
+
+		if(snapshot_ns)
+			*snapshot_ns = t;
+		return true;
+	}
+}
@@ -0,0 +1,188 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#include "latency_histogram.h"
+
+#define METRIC_SHARDS		4
+#define METRIC_NAME_MAX		48
+#define METRICS_MAX			128
+#define METRICS_SHM			"/picam_metrics"	// shm_open() name, /dev/shm/picam_metrics
+#define METRICS_MAGIC		0x5254454d			// "METR"
+#define METRICS_VERSION		1
+
+// monotonically increasing count, add() is one relaxed atomic add //
+class MetricCounter{
+public:
+	MetricCounter() : v(0) {}
+
+	void add(uint64_t n = 1) { v.fetch_add(n, std::memory_order_relaxed); }
+	uint64_t value() const { return v.load(std::memory_order_relaxed); }
+private:
+	std::atomic<uint64_t> v;
+};
+
+// current level (queue depth, leased buffers), add() returns the new value //
+class MetricGauge{
+public:
+	MetricGauge() : v(0) {}
+
+	void set(int64_t x) { v.store(x, std::memory_order_relaxed); }
+	int64_t add(int64_t n) { return v.fetch_add(n, std::memory_order_relaxed) + n; }
+	int64_t value() const { return v.load(std::memory_order_relaxed); }
+private:
+	std::atomic<int64_t> v;
+};
+
+/*
+	MetricHistogram - LatencyHistogram split into per-thread shards
+	A thread picks its shard on first use, so threads recording into the
+	same histogram do not fight over the bucket cache lines. snapshot()
+	merges the shards.
+*/
+class MetricHistogram{
+public:
+	void record(uint64_t ns) { shards[shard()].h.record(ns); }
+	void snapshot(LatencyHistogram *out) const;
+private:
+	static unsigned int shard();
+
+	// padded rather than alignas(64), which plain new ignores before C++17 //
+	struct shard_hist{
+		LatencyHistogram h;
+		char pad[64];
+	};
+	shard_hist shards[METRIC_SHARDS];
+};
+
+enum metric_kind {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+};
+
+// one metric as published, plain data so it can live in shared memory //
+struct metric_value{
+	char name[METRIC_NAME_MAX];
+	uint32_t kind;				// metric_kind
+	uint32_t reserved;
+	int64_t value;				// counter, gauge, or histogram sample count
+	// histograms only //
+	uint64_t mean_ns;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+};
+
+/*
+	Shared-memory page written by MetricsExporter. seq is a seqlock: odd
+	while the exporter rewrites metrics[], readers retry until they saw
+	the same even value before and after copying.
+*/
+struct metrics_page{
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint32_t> seq;
+	uint32_t count;
+	uint64_t snapshot_ns;		// CLOCK_MONOTONIC of the last publish
+	uint64_t period_ns;
+	uint32_t pid;				// exporting process
+	uint32_t reserved;
+	metric_value metrics[METRICS_MAX];
+};
+
+/*
+	MetricsRegistry - names for metrics owned by Picam, Raspi2Gpio, sinks
+	Only registration and snapshot() take the lock, the objects update
+	their metrics without ever seeing the registry. Registered metrics
+	must outlive the registry and any exporter reading it.
+*/
+class MetricsRegistry{
+public:
+	void add(const std::string& name, const MetricCounter *c);
+	void add(const std::string& name, const MetricGauge *g);
+	void add(const std::string& name, const MetricHistogram *h);
+	void add(const std::string& name, const LatencyHistogram *h);
+	// value read at snapshot time, for state kept in existing stats structs //
+	void add(const std::string& name, enum metric_kind kind, std::function<int64_t()> probe);
+
+	// fill up to max values, returns how many //
+	unsigned int snapshot(metric_value *out, unsigned int max) const;
+	unsigned int size() const;
+private:
+	struct entry{
+		std::string name;
+		enum metric_kind kind;
+		const MetricCounter *counter;
+		const MetricGauge *gauge;
+		const MetricHistogram *hist;
+		const LatencyHistogram *latency;
+		std::function<int64_t()> probe;
+	};
+
+	void add(const entry& e);
+
+	mutable std::mutex lock;
+	std::vector<entry> entries;
+};
+
+/*
+	MetricsExporter - publish a registry to a shared-memory page
+	A background thread snapshots the registry every period_ms into
+	/dev/shm/<name>. Readers (MetricsReader, picam_metrics) only map the
+	page, they never touch the capture process or its atomics.
+*/
+class MetricsExporter{
+public:
+	MetricsExporter(const MetricsRegistry *registry, const std::string& name = METRICS_SHM,
+			int period_ms = 1000);
+	~MetricsExporter();
+
+	// publish right now, e.g. once more before exiting //
+	void publish();
+private:
+	MetricsExporter(const MetricsExporter&);
+	MetricsExporter& operator=(const MetricsExporter&);
+
+	void run();
+
+	const MetricsRegistry *registry;
+	std::string name;
+	uint64_t period_ns;
+	metrics_page *page;
+	std::vector<metric_value> scratch;
+	std::mutex publish_lock;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	bool running;
+	std::thread thread;
+};
+
+// read side of MetricsExporter, for another process //
+class MetricsReader{
+public:
+	MetricsReader(const std::string& name = METRICS_SHM);
+	~MetricsReader();
+
+	// consistent copy of the last snapshot, false if the exporter never published //
+	bool read(std::vector<metric_value> *out, uint64_t *snapshot_ns = NULL) const;
+	uint32_t exporter_pid() const { return page->pid; }
+private:
+	MetricsReader(const MetricsReader&);
+	MetricsReader& operator=(const MetricsReader&);
+
+	const metrics_page *page;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <iostream>
+#include <stdexcept>
+#include <memory>
+
+#include <linux/videodev2.h>
+
+#include "frame_container.h"
+
+using namespace std;
+
+// <prefix><frame_number>.raw, the frame bytes as captured //
+class RawFileSink : public FrameSink{
+public:
+	RawFileSink(const string& prefix) : prefix(prefix) {}
+
+	void consume(const void *p, size_t size, const frame_info& info)
+	{
+		string name = prefix + to_string(info.frame_number) + ".raw";
+		FILE *fp = fopen(name.c_str(), "wb");
+
+		if(!fp)
+			throw runtime_error(name + " : cannot open! ");
+		fwrite(p, size, 1, fp);
+		fclose(fp);
+	}
+private:
+	string prefix;
+};
+
+static string fourcc(unsigned int f)
+{
+	char s[5] = { (char)(f & 0xff), (char)((f >> 8) & 0xff),
+		(char)((f >> 16) & 0xff), (char)((f >> 24) & 0xff), '\0' };
+
+	return s;
+}
+
+/*
+	pcam_export session.pcam [prefix] : one file per record
+	MJPEG sessions become <prefix><frame_number>.jpg; any other format is
+	written as captured to <prefix><frame_number>.raw, its fourcc and size
+	printed so the frames can be read back.
+*/
+int main(int argc, char *argv[])
+{
+	if(argc < 2){
+		cout << "usage : " << argv[0] << " session.pcam [prefix]" << endl;
+		return 1;
+	}
+
+	try{
+		ContainerReader reader(argv[1]);
+		const pcam_file_header& h = reader.header();
+		string prefix = argc > 2 ? argv[2] : "frame";
+		unique_ptr<FrameSink> sink;
+		unsigned int n;
+
+		if(!reader.indexed())
+			cout << argv[1] << " : no index footer, recovered by scanning" << endl;
+
+		if(h.pixelformat == V4L2_PIX_FMT_MJPEG)
+			sink.reset(new JpegFileSink(prefix));
+		else
+			sink.reset(new RawFileSink(prefix));
+
+		n = export_frames(reader, sink.get());
+		cout << n << " frames exported";
+		if(h.pixelformat != V4L2_PIX_FMT_MJPEG)
+			cout << " as raw " << fourcc(h.pixelformat) << " " << h.width << "x" << h.height;
+		cout << endl;
+	}catch(const exception& e){
+		cout << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
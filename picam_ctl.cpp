@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <stdexcept>
+
+#include "capture_service.h"
+
+using namespace std;
+
+/*
+	picam_ctl [-c name] <command> [args] : send one command to a running
+	grab -s and print the reply, e.g.
+
+		picam_ctl start 180 60 61	180 frames, white flash on frames 60 and 61
+		picam_ctl status			frame count, cold and warm time to first frame
+		picam_ctl quit
+
+	Exits 1 when the reply is an error.
+*/
+int main(int argc, char *argv[])
+{
+	const char *name = SERVICE_NAME;
+	string line;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "+c:")) != -1){
+		switch(opt){
+		case 'c': name = optarg; break;
+		default:
+			fprintf(stderr, "usage : %s [-c name] start <frames> [file] [flash_first flash_last] | status | quit\n", argv[0]);
+			return 1;
+		}
+	}
+	if(optind >= argc){
+		fprintf(stderr, "usage : %s [-c name] start <frames> [file] [flash_first flash_last] | status | quit\n", argv[0]);
+		return 1;
+	}
+
+	for(i = optind; i < argc; ++i){
+		if(i > optind)
+			line += " ";
+		line += argv[i];
+	}
+
+	try{
+		ServiceClient client(name);
+		string reply = client.request(line);
+
+		printf("%s\n", reply.c_str());
+		return reply.compare(0, 5, "error") == 0 ? 1 : 0;
+	}catch(const exception& e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+}
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <stdexcept>
+
+#include "metrics.h"
+
+using namespace std;
+
+/*
+	picam_metrics [-w interval_ms] [name] : print the metrics a running
+	grab publishes. Only maps the shared page, the capture process does
+	not notice. With -w counters also show their rate since the last print.
+*/
+static void print(const vector<metric_value>& m, const map<string, int64_t>& prev, double dt)
+{
+	size_t i;
+
+	for(i = 0; i < m.size(); ++i){
+		const metric_value& v = m[i];
+
+		if(v.kind == METRIC_HISTOGRAM){
+			printf("%-28s n %-9lld p50 %9.1f  p99 %9.1f  p99.9 %9.1f  max %9.1f us\n", v.name,
+					(long long)v.value, v.p50_ns / 1e3, v.p99_ns / 1e3, v.p999_ns / 1e3, v.max_ns / 1e3);
+		}else if(v.kind == METRIC_COUNTER && dt > 0 && prev.count(v.name)){
+			printf("%-28s %12lld  %10.1f /s\n", v.name, (long long)v.value,
+					(v.value - prev.find(v.name)->second) / dt);
+		}else{
+			printf("%-28s %12lld\n", v.name, (long long)v.value);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int interval_ms = 0, opt;
+
+	while((opt = getopt(argc, argv, "w:")) != -1){
+		switch(opt){
+		case 'w': interval_ms = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage : %s [-w interval_ms] [name]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	try{
+		MetricsReader reader(optind < argc ? argv[optind] : METRICS_SHM);
+		map<string, int64_t> prev;
+		uint64_t last = 0;
+
+		for(;;){
+			vector<metric_value> m;
+			uint64_t t;
+			size_t i;
+
+			if(!reader.read(&m, &t)){
+				fprintf(stderr, "nothing published yet\n");
+			}else{
+				printf("pid %u, snapshot at %.3f s\n", reader.exporter_pid(), t / 1e9);
+				print(m, prev, last && t > last ? (t - last) / 1e9 : 0);
+				printf("\n");
+
+				for(i = 0; i < m.size(); ++i)
+					prev[m[i].name] = m[i].value;
+				last = t;
+			}
+
+			if(interval_ms <= 0)
+				break;
+			usleep(interval_ms * 1000);
+		}
+	}catch(const exception& e){
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	return 0;
+}
@@ -9,15 +9,19 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
-#include <stdio.h> //sprintf, fopen, fflush etc...
+#include <poll.h>
 #include <iostream>
 
 
 #include <stdexcept>
 
 #include <linux/videodev2.h>
+#include <linux/dma-buf.h>
 
 #include "picam_v4l2_ctrl.h"
+#include "luma.h"
+#include "raspi2_gpio.h"
+#include "latency_histogram.h"
 
 #define CLEAR(x) memset(&(x),0, sizeof(x))
 
@@ -34,11 +38,140 @@ static int xioctl(int fh, unsigned long int request, void *arg)
 	return r;
 }
 
-Picam::Picam(const string& device, int width, int height) :
-	device(device), xres(width), yres(height)
+FrameRef::FrameRef() :
+	cam(NULL), idx(0)
 {
+}
+
+FrameRef::FrameRef(Picam *cam, unsigned int idx) :
+	cam(cam), idx(idx)
+{
+	cam->buffers[idx].refs++;
+}
+
+FrameRef::FrameRef(const FrameRef& other) :
+	cam(other.cam), idx(other.idx)
+{
+	if(cam)
+		cam->buffers[idx].refs++;
+}
+
+FrameRef& FrameRef::operator=(const FrameRef& other)
+{
+	if(this != &other){
+		if(other.cam)
+			other.cam->buffers[other.idx].refs++;
+		release();
+		cam = other.cam;
+		idx = other.idx;
+	}
+	return *this;
+}
+
+FrameRef::~FrameRef()
+{
+	try{
+		release();
+	}catch(const exception&){
+		// the device is going away, nothing left to requeue to //
+	}
+}
+
+void FrameRef::release()
+{
+	Picam *c = cam;
+
+	if(!c)
+		return;
+	cam = NULL;
+
+	if(--c->buffers[idx].refs == 0)
+		c->requeue(idx);
+}
+
+const void *FrameRef::data() const
+{
+	return cam ? cam->buffers[idx].data : NULL;
+}
+
+size_t FrameRef::size() const
+{
+	return cam ? cam->buffers[idx].bytesused : 0;
+}
+
+unsigned int FrameRef::frame_number() const
+{
+	return cam ? cam->buffers[idx].info.frame_number : 0;
+}
+
+const frame_info& FrameRef::info() const
+{
+	static const frame_info none = { 0, 0, 0, 0, 0 };
+
+	return cam ? cam->buffers[idx].info : none;
+}
+
+int FrameRef::dmabuf_fd() const
+{
+	return cam ? cam->buffers[idx].dmabuf_fd : -1;
+}
+
+static string fourcc(unsigned int f)
+{
+	char s[5] = { (char)(f & 0xff), (char)((f >> 8) & 0xff),
+		(char)((f >> 16) & 0xff), (char)((f >> 24) & 0xff), '\0' };
+
+	return s;
+}
+
+// bracket CPU access to an imported or exported dma-buf //
+static void sync_dmabuf(int dmabuf_fd, unsigned long long flags)
+{
+	struct dma_buf_sync sync;
+
+	if(dmabuf_fd == -1)
+		return;
+
+	sync.flags = flags | DMA_BUF_SYNC_READ;
+	xioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+Picam::Picam(const string& device, int width, int height, unsigned int pixelformat,
+		unsigned int n_buffers, enum io_method io, FrameArena *arena) :
+	device(device), n_buffers(0), req_buffers(n_buffers), buffer_size(0),
+	io(io), arena(arena), xres(width), yres(height),
+	pixfmt(pixelformat), auto_mode(false), fps(60)
+{
+	if(pixfmt != V4L2_PIX_FMT_MJPEG && !luma_supported(pixfmt))
+		throw runtime_error("Picam : unsupported pixel format");
+
+	setup();
+}
+
+Picam::Picam(const string& device, const mode_request& req, unsigned int n_buffers,
+		enum io_method io, FrameArena *arena) :
+	device(device), n_buffers(0), req_buffers(n_buffers), buffer_size(0),
+	io(io), arena(arena), xres(req.width), yres(req.height),
+	pixfmt(V4L2_PIX_FMT_MJPEG), auto_mode(true), want(req), fps(req.fps)
+{
+	setup();
+}
+
+void Picam::setup()
+{
+	if((io == IO_METHOD_USERPTR || io == IO_METHOD_DMABUF) && !arena)
+		throw runtime_error("Picam : USERPTR / DMABUF needs a FrameArena");
+
 	force_format = true;
+	CLEAR(granted);
+	streaming = false;
 	frame_number = 0;
+	have_sequence = false;
+	last_sequence = 0;
+	memset(&trig, 0, sizeof(trig));
+	pre_slots = pre_head = pre_count = 0;
+	default_sink.reset(new JpegFileSink());
+	sink = default_sink.get();
 	open_device();
 	init_device();
 }
@@ -96,9 +229,11 @@ void Picam::init_device(void)
 
 	cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
+	crop_supported = false;
 	if( 0 == xioctl(fd, VIDIOC_CROPCAP, &cropcap)){
 		crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		crop.c = cropcap.defrect;
+		cropcap_bounds = cropcap.bounds;
 
 		if( -1 == xioctl(fd, VIDIOC_S_CROP, &crop)){
 			switch(errno){
@@ -108,51 +243,91 @@ void Picam::init_device(void)
 				default:
 					break;
 			}
+		}else{
+			crop_supported = true;
 		}
 
 	}else{
+		CLEAR(cropcap_bounds);
 	}
 
 	CLEAR(fmt);
 
 	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	if(force_format){
-		fmt.fmt.pix.width = xres;
-		fmt.fmt.pix.height = yres;
-		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-		fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
-
-		if( -1 == xioctl(fd, VIDIOC_S_FMT, &fmt))
-			throw runtime_error("VIDIOC_S_FMT");
-
-		
-		if(fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG)
-			throw runtime_error("Picam does not support MJPEG format");
-
-		stride = fmt.fmt.pix.bytesperline;
+		if(auto_mode)
+			choose_mode(cap, false);
+
+		// a cached mode the device no longer grants: enumerate again once //
+		if(!negotiate_format(&fmt)){
+			if(!auto_mode)
+				throw runtime_error("Picam does not support " + fourcc(pixfmt) + " format");
+
+			choose_mode(cap, true);
+			if(!negotiate_format(&fmt))
+				throw runtime_error(device + " : granted " + fourcc(fmt.fmt.pix.pixelformat) + " "
+					+ to_string(fmt.fmt.pix.width) + "x" + to_string(fmt.fmt.pix.height)
+					+ " instead of " + fourcc(pixfmt) + " " + to_string(xres) + "x" + to_string(yres));
+		}
 	}else{
 		if( -1 == xioctl(fd, VIDIOC_G_FMT, &fmt)){
 			throw runtime_error("VIDIOC_G_FMT");
 		}
+		pixfmt = fmt.fmt.pix.pixelformat;
 	}
 
-	set_fps(60);
-	init_mmap();
+	// raw frames are walked by bytesperline, which may include padding //
+	xres = fmt.fmt.pix.width;
+	yres = fmt.fmt.pix.height;
+	stride = fmt.fmt.pix.bytesperline;
+	buffer_size = fmt.fmt.pix.sizeimage;
+
+	granted.pixelformat = pixfmt;
+	granted.width = xres;
+	granted.height = yres;
+
+	set_fps(fps);
+
+	if(auto_mode && (uint64_t)granted.interval_den < (uint64_t)want.fps * granted.interval_num)
+		throw runtime_error(device + " : granted " + to_string(frame_rate()) + " fps, "
+			+ to_string(want.fps) + " requested");
+
+	switch(io){
+		case IO_METHOD_USERPTR:
+			init_userp();
+			break;
+		case IO_METHOD_DMABUF:
+			init_dmabuf();
+			break;
+		case IO_METHOD_MMAP:
+		case IO_METHOD_MMAP_EXPBUF:
+		default:
+			init_mmap();
+			break;
+	}
 }
 
-void Picam::init_mmap(void)
+void Picam::request_buffers(unsigned int mem)
 {
 	struct v4l2_requestbuffers req;
 
 	CLEAR(req);
 
-	req.count = 4;
+	memory = mem;
+	req.count = req_buffers;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	req.memory = V4L2_MEMORY_MMAP;
+	req.memory = memory;
 
 	if( -1 == xioctl(fd, VIDIOC_REQBUFS, &req)){
 		if(EINVAL == errno){
-			throw runtime_error(device + " does not support memory mapping");
+			switch(memory){
+				case V4L2_MEMORY_USERPTR:
+					throw runtime_error(device + " does not support user pointer i/o");
+				case V4L2_MEMORY_DMABUF:
+					throw runtime_error(device + " does not support dma-buf import");
+				default:
+					throw runtime_error(device + " does not support memory mapping");
+			}
 		} else {
 			throw runtime_error("VIDIOC_REQBUFS");
 		}
@@ -161,103 +336,366 @@ void Picam::init_mmap(void)
 	if (req.count < 2)
 		throw runtime_error(string("Insufficient buffer memory on ") + device);
 
-	buffers = (buffer*) calloc(req.count, sizeof(*buffers));
-
-	if(!buffers)
-		throw runtime_error("Out of memory");
+	if(memory != V4L2_MEMORY_MMAP){
+		if(req.count > arena->slots())
+			throw runtime_error("Picam : arena has fewer slots than driver buffers");
+		if(buffer_size > arena->slot_size())
+			throw runtime_error("Picam : arena slot smaller than sizeimage");
+	}
 
+	buffers = new buffer[req.count];
 	for(n_buffers = 0; n_buffers < req.count; ++n_buffers){
+		buffers[n_buffers].data = NULL;
+		buffers[n_buffers].size = 0;
+		buffers[n_buffers].dmabuf_fd = -1;
+		buffers[n_buffers].bytesused = 0;
+		memset(&buffers[n_buffers].info, 0, sizeof(buffers[n_buffers].info));
+		buffers[n_buffers].refs = 0;
+		buffers[n_buffers].queued = false;
+	}
+}
+
+void Picam::init_userp(void)
+{
+	unsigned int i;
+
+	request_buffers(V4L2_MEMORY_USERPTR);
+
+	for(i = 0; i < n_buffers; ++i){
+		buffers[i].data = arena->slot(i);
+		buffers[i].size = arena->slot_size();
+	}
+}
+
+void Picam::init_dmabuf(void)
+{
+	unsigned int i;
+
+	request_buffers(V4L2_MEMORY_DMABUF);
+
+	// the arena keeps the fds, Picam only borrows them //
+	for(i = 0; i < n_buffers; ++i){
+		buffers[i].data = arena->slot(i);
+		buffers[i].size = arena->slot_size();
+		buffers[i].dmabuf_fd = arena->dmabuf_fd(i);
+	}
+}
+
+void Picam::init_mmap(void)
+{
+	unsigned int i;
+
+	request_buffers(V4L2_MEMORY_MMAP);
+
+	for(i = 0; i < n_buffers; ++i){
 		struct v4l2_buffer buf;
 
 		CLEAR(buf);
 
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = n_buffers;
+		buf.index = i;
 
 		if( -1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
 			throw runtime_error("VIDIOC_QUERYBUF");
 
-		buffers[n_buffers].size = buf.length;
-		buffers[n_buffers].data = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+		buffers[i].size = buf.length;
+		buffers[i].data = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
 
-		if(MAP_FAILED == buffers[n_buffers].data)
+		if(MAP_FAILED == buffers[i].data)
 			throw runtime_error("mmap");
+
+		if(io == IO_METHOD_MMAP_EXPBUF){
+			struct v4l2_exportbuffer expbuf;
+
+			CLEAR(expbuf);
+			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			expbuf.index = i;
+			expbuf.flags = O_RDONLY | O_CLOEXEC;
+
+			if( -1 == xioctl(fd, VIDIOC_EXPBUF, &expbuf))
+				throw runtime_error(device + " : VIDIOC_EXPBUF");
+
+			buffers[i].dmabuf_fd = expbuf.fd;
+		}
 	}
 }
 
+void Picam::queue_buffer(unsigned int index)
+{
+	struct v4l2_buffer buf;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = memory;
+	buf.index = index;
+
+	switch(memory){
+		case V4L2_MEMORY_USERPTR:
+			buf.m.userptr = (unsigned long)buffers[index].data;
+			buf.length = buffers[index].size;
+			break;
+		case V4L2_MEMORY_DMABUF:
+			buf.m.fd = buffers[index].dmabuf_fd;
+			buf.length = buffers[index].size;
+			break;
+		default:
+			break;
+	}
+
+	if( -1 == xioctl(fd, VIDIOC_QBUF, &buf))
+		throw runtime_error("VIDIOC_QBUF");
+
+	buffers[index].queued = true;
+}
+
 void Picam::start_capturing(void)
 {
 	unsigned int i;
 	enum v4l2_buf_type type;
 
-	for(i = 0; i < n_buffers; ++i){
-		struct v4l2_buffer buf;
+	if(streaming)
+		return;
 
-		CLEAR(buf);
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = i;
+	// leased buffers go back to the driver when their consumer lets go //
+	for(i = 0; i < n_buffers; ++i){
+		if(!buffers[i].queued && buffers[i].refs == 0)
+			queue_buffer(i);
+	}
 
-		if( -1 == xioctl(fd, VIDIOC_QBUF, &buf))
-			throw runtime_error("VIDIOC_QBUF");
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if( -1 == xioctl(fd, VIDIOC_STREAMON, &type))
+		throw runtime_error("VIDIOC_STREAMON");
 
-		type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		if( -1 == xioctl(fd, VIDIOC_STREAMON, &type))
-			throw runtime_error("VIDIOC_STREAMON");
+	streaming = true;
+}
 
-	}
+void Picam::restart_capturing(void)
+{
+	stop_capturing();
+	start_capturing();
 }
 
 const void Picam::mainloop(int timeout, int count)
 {
 	start_capturing();
 	while(count-- > 0){
-		for(;;){
-			fd_set fds;
-			struct timeval tv;
-			int r;
+		FrameRef frame = next_frame(timeout);
 
-			FD_ZERO(&fds);
-			FD_SET(fd, &fds);
+		process_image(frame);
+	}
+}
 
-			tv.tv_sec = timeout;
-			tv.tv_usec = 0;
+// driver timestamp when it is CLOCK_MONOTONIC like the GPIO events, else now //
+static uint64_t frame_time(const frame_info& info)
+{
+	if((info.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		return info.timestamp_ns;
+	return monotonic_ns();
+}
 
-			r = select(fd + 1, &fds, NULL, NULL, &tv);
+bool Picam::trigger_loop(Raspi2Gpio *trigger, int count, unsigned int pre_trigger, int wait_timeout, int timeout)
+{
+	uint64_t deadline = 0;
+	bool fired = false;
+	int kept = 0;
+
+	memset(&trig, 0, sizeof(trig));
+	pre_slots = pre_trigger;
+	pre_head = pre_count = 0;
+	pre_ring.resize(pre_slots * max_frame_size());
+	pre_info.resize(pre_slots);
+	pre_size.resize(pre_slots);
+
+	// every buffer is queued before the edge, the first frame after it is already exposing //
+	start_capturing();
+	trigger->flush_events();
 
-			if(-1 == r){
-				if(EINTR == errno)
-					continue;
-				throw runtime_error("select");
-			}
+	if(wait_timeout >= 0)
+		deadline = monotonic_ns() + (uint64_t)wait_timeout * 1000000000ULL;
 
-			if( 0 == r){
-				throw runtime_error(device + " : select timeout");
+	while(!fired){
+		struct pollfd pfd[2];
+		raspi2_gpio_event ev;
+		int wait = -1, r;
+
+		if(deadline){
+			uint64_t now = monotonic_ns();
+			if(now >= deadline)
+				return false;
+			wait = (int)((deadline - now + 999999) / 1000000);
+		}
+
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = trigger->file_descriptor();
+		pfd[1].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+
+		r = poll(pfd, 2, wait);
+		if(-1 == r){
+			if(EINTR == errno)
+				continue;
+			throw runtime_error("poll");
+		}
+
+		// edge first, frames dequeued in the same round may already be after it //
+		if((pfd[1].revents & POLLIN) && trigger->read_event(&ev, 0)){
+			fired = true;
+			trig.fired = true;
+			trig.edge_ns = ev.timestamp_ns;
+		}
+
+		if(pfd[0].revents & (POLLIN | POLLERR)){
+			// past count, the remaining buffers stay queued in the driver //
+			while(!fired || kept < count){
+				FrameRef frame = read_frame();
+				if(!frame)
+					break;
+				if(trigger_frame(frame, fired))
+					kept++;
 			}
+		}
+	}
+
+	while(kept < count){
+		FrameRef frame = next_frame(timeout);
+
+		if(trigger_frame(frame, true))
+			kept++;
+	}
 
-			if(read_frame())
-				break;
+	// edge with no kept frame yet still owes the sink its ring //
+	flush_pre_trigger();
+	return true;
+}
+
+// true if frame was kept as a post-trigger frame //
+bool Picam::trigger_frame(const FrameRef& frame, bool fired)
+{
+	if(!fired || frame_time(frame.info()) < trig.edge_ns){
+		stash_frame(frame);
+		return false;
+	}
 
+	if(!trig.first_frame_ns){
+		trig.edge_to_dequeue_ns = monotonic_ns() - trig.edge_ns;
+		trig.first_frame_ns = frame_time(frame.info());
+		trig.edge_to_frame_ns = (int64_t)(trig.first_frame_ns - trig.edge_ns);
+		flush_pre_trigger();
+	}
+
+	process_image(frame);
+	return true;
+}
+
+void Picam::stash_frame(const FrameRef& frame)
+{
+	size_t slot = max_frame_size();
+
+	if(pre_slots == 0 || frame.size() > slot){
+		trig.discarded++;
+		return;
+	}
+
+	// the oldest frame is overwritten once the ring is full //
+	if(pre_count == pre_slots)
+		trig.discarded++;
+	else
+		pre_count++;
+
+	memcpy(&pre_ring[pre_head * slot], frame.data(), frame.size());
+	pre_info[pre_head] = frame.info();
+	pre_size[pre_head] = frame.size();
+	pre_head = (pre_head + 1) % pre_slots;
+}
+
+void Picam::flush_pre_trigger()
+{
+	size_t slot = max_frame_size();
+	unsigned int i = (pre_head + pre_slots - pre_count) % (pre_slots ? pre_slots : 1);
+
+	for(; pre_count > 0; --pre_count, i = (i + 1) % pre_slots){
+		frame_info info = pre_info[i];
+
+		info.flags |= FRAME_FLAG_PRE_TRIGGER;
+		sink->consume(&pre_ring[i * slot], pre_size[i], info);
+		trig.pre_frames++;
+	}
+}
+
+void Picam::register_metrics(MetricsRegistry *reg, const string& prefix) const
+{
+	reg->add(prefix + ".frames", &n_frames);
+	reg->add(prefix + ".seq_drops", &n_seq_drops);
+	reg->add(prefix + ".starved", &n_starved);
+	reg->add(prefix + ".eagain", &n_eagain);
+	reg->add(prefix + ".select_timeouts", &n_select_timeouts);
+	reg->add(prefix + ".leased", &n_leased);
+	reg->add(prefix + ".hold_ns", &hold_time);
+	reg->add(prefix + ".dequeue_ns", &dequeue_latency);
+}
+
+unsigned int Picam::run(int timeout, int count)
+{
+	mainloop(timeout, count);
+	return count > 0 ? count : 0;
+}
+
+bool Picam::wait_frame(int timeout)
+{
+	for(;;){
+		fd_set fds;
+		struct timeval tv;
+		int r;
+
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+
+		tv.tv_sec = timeout;
+		tv.tv_usec = 0;
+
+		r = select(fd + 1, &fds, NULL, NULL, &tv);
+
+		if(-1 == r){
+			if(EINTR == errno)
+				continue;
+			throw runtime_error("select");
 		}
+
+		if(r == 0)
+			n_select_timeouts.add();
+		return r != 0;
 	}
 }
 
+FrameRef Picam::next_frame(int timeout)
+{
+	start_capturing();
+	for(;;){
+		if(!wait_frame(timeout))
+			throw runtime_error(device + " : select timeout");
+
+		FrameRef frame = read_frame();
+		if(frame)
+			return frame;
+	}
+}
 
-bool Picam::read_frame()
+FrameRef Picam::read_frame()
 {
 	struct v4l2_buffer buf;
-	unsigned int i;
 
 	CLEAR(buf);
 
 	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
+	buf.memory = memory;
 
 	if ( -1 == xioctl(fd, VIDIOC_DQBUF, &buf)){
 		switch(errno){
 			case EAGAIN:
-				return -1;
+				n_eagain.add();
+				return FrameRef();
 			case EIO:
 			default:
 				throw runtime_error("VIDIOC_DQBUF");
@@ -266,50 +704,267 @@ bool Picam::read_frame()
 
 	assert(buf.index < n_buffers);
 
-	process_image(buffers[buf.index].data, buf.bytesused);
+	buffers[buf.index].queued = false;
+	buffers[buf.index].dequeued_ns = monotonic_ns();
+	buffers[buf.index].bytesused = buf.bytesused;
+	sync_dmabuf(buffers[buf.index].dmabuf_fd, DMA_BUF_SYNC_START);
+	buffers[buf.index].info.frame_number = ++frame_number;
+	buffers[buf.index].info.sequence = buf.sequence;
+	buffers[buf.index].info.timestamp_ns = (uint64_t)buf.timestamp.tv_sec * 1000000000ULL
+		+ (uint64_t)buf.timestamp.tv_usec * 1000ULL;
+	buffers[buf.index].info.flags = buf.flags & (V4L2_BUF_FLAG_TIMESTAMP_MASK | V4L2_BUF_FLAG_TSTAMP_SRC_MASK);
+	buffers[buf.index].info.leds = 0;
+
+	// a restart resets the driver sequence, only count forward gaps //
+	if(have_sequence && buf.sequence > last_sequence + 1)
+		n_seq_drops.add(buf.sequence - last_sequence - 1);
+	have_sequence = true;
+	last_sequence = buf.sequence;
+
+	n_frames.add();
+	if(buffers[buf.index].dequeued_ns > buffers[buf.index].info.timestamp_ns)
+		dequeue_latency.record(buffers[buf.index].dequeued_ns - buffers[buf.index].info.timestamp_ns);
+
+	// the driver has nothing left to fill until a consumer lets go //
+	if(n_leased.add(1) == n_buffers)
+		n_starved.add();
+
+	return FrameRef(this, buf.index);
+}
 
-	if(-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-		throw runtime_error("VIDIOC_QBUF");
+void Picam::requeue(unsigned int index)
+{
+	n_leased.add(-1);
+	hold_time.record(monotonic_ns() - buffers[index].dequeued_ns);
+	if(-1 == fd)
+		return;
 
-	return 1;
+	sync_dmabuf(buffers[index].dmabuf_fd, DMA_BUF_SYNC_END);
+	queue_buffer(index);
+}
 
+void Picam::process_image(const FrameRef& frame)
+{
+	sink->consume(frame.data(), frame.size(), frame.info());
 }
 
+void Picam::set_sink(FrameSink *s)
+{
+	sink = s ? s : default_sink.get();
+}
 
-void Picam::process_image(void *p, int size)
+bool Picam::get_luma(const FrameRef& frame, unsigned char *scratch, luma_frame *out) const
 {
-	char filename[15];
-	++frame_number;
-	sprintf(filename, "frame%d.jpg", frame_number);
-	
-	FILE *fp = fopen(filename, "wb");
-	fwrite(p, size, 1, fp);
+	if(!frame || !luma_supported(pixfmt))
+		return false;
+
+	out->frame_number = frame.frame_number();
+	out->timestamp_ns = frame.timestamp_ns();
+	out->width = xres;
+	out->height = yres;
+
+	if(pixfmt == V4L2_PIX_FMT_GREY || pixfmt == V4L2_PIX_FMT_NV12){
+		out->stride = stride;
+		out->data = (const unsigned char*)frame.data();
+		return true;
+	}
 
-	fflush(fp);
-	fclose(fp);
+	extract_luma(frame.data(), stride, xres, yres, pixfmt, scratch);
+	out->stride = xres;
+	out->data = scratch;
+	return true;
+}
+
+bool Picam::set_crop(const struct v4l2_rect& rect)
+{
+	struct v4l2_crop crop;
+	int right = cropcap_bounds.left + cropcap_bounds.width;
+	int bottom = cropcap_bounds.top + cropcap_bounds.height;
+
+	if(!crop_supported)
+		return false;
+
+	CLEAR(crop);
+	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	crop.c = rect;
+
+	if(crop.c.left < cropcap_bounds.left)
+		crop.c.left = cropcap_bounds.left;
+	if(crop.c.top < cropcap_bounds.top)
+		crop.c.top = cropcap_bounds.top;
+	if(crop.c.left + (int)crop.c.width > right)
+		crop.c.width = right - crop.c.left;
+	if(crop.c.top + (int)crop.c.height > bottom)
+		crop.c.height = bottom - crop.c.top;
+
+	if( -1 == xioctl(fd, VIDIOC_S_CROP, &crop)){
+		// EBUSY : this driver cannot crop while streaming //
+		if(EINVAL == errno || EBUSY == errno)
+			return false;
+		throw runtime_error("VIDIOC_S_CROP");
+	}
+
+	return true;
+}
+
+bool Picam::get_crop(struct v4l2_rect *rect) const
+{
+	struct v4l2_crop crop;
+
+	if(!crop_supported)
+		return false;
+
+	CLEAR(crop);
+	crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	if( -1 == xioctl(fd, VIDIOC_G_CROP, &crop))
+		return false;
+
+	*rect = crop.c;
+	return true;
+}
+
+static void copy_control(const struct v4l2_queryctrl& q, camera_control *out)
+{
+	out->id = q.id;
+	out->type = q.type;
+	out->name.assign((const char*)q.name, strnlen((const char*)q.name, sizeof(q.name)));
+	out->minimum = q.minimum;
+	out->maximum = q.maximum;
+	out->step = q.step;
+	out->default_value = q.default_value;
+	out->flags = q.flags;
+}
+
+vector<camera_control> Picam::controls() const
+{
+	vector<camera_control> out;
+	struct v4l2_queryctrl q;
+
+	CLEAR(q);
+	q.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	while(0 == xioctl(fd, VIDIOC_QUERYCTRL, &q)){
+		if(!(q.flags & V4L2_CTRL_FLAG_DISABLED) && q.type != V4L2_CTRL_TYPE_CTRL_CLASS){
+			camera_control c;
+
+			copy_control(q, &c);
+			out.push_back(c);
+		}
+		q.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+	}
+
+	return out;
+}
+
+bool Picam::query_control(uint32_t id, camera_control *out) const
+{
+	struct v4l2_queryctrl q;
+
+	CLEAR(q);
+	q.id = id;
+	if( -1 == xioctl(fd, VIDIOC_QUERYCTRL, &q) || (q.flags & V4L2_CTRL_FLAG_DISABLED))
+		return false;
+
+	copy_control(q, out);
+	return true;
+}
+
+int32_t Picam::get_control(uint32_t id) const
+{
+	struct v4l2_control c;
+
+	CLEAR(c);
+	c.id = id;
+	if( -1 == xioctl(fd, VIDIOC_G_CTRL, &c))
+		throw runtime_error(device + " : VIDIOC_G_CTRL " + to_string(id));
+
+	return c.value;
+}
+
+void Picam::set_control(uint32_t id, int32_t value)
+{
+	struct v4l2_control c;
+
+	CLEAR(c);
+	c.id = id;
+	c.value = value;
+	if( -1 == xioctl(fd, VIDIOC_S_CTRL, &c))
+		throw runtime_error(device + " : VIDIOC_S_CTRL " + to_string(id));
+}
+
+void Picam::set_controls(const vector<control_value>& values)
+{
+	vector<struct v4l2_ext_control> ext(values.size());
+	struct v4l2_ext_controls ctrls;
+	size_t i;
+
+	if(values.empty())
+		return;
+
+	for(i = 0; i < values.size(); ++i){
+		CLEAR(ext[i]);
+		ext[i].id = values[i].id;
+		ext[i].value = values[i].value;
+	}
+
+	// class 0 (V4L2_CTRL_WHICH_CUR_VAL) lets one call mix camera and user controls //
+	CLEAR(ctrls);
+	ctrls.ctrl_class = 0;
+	ctrls.count = ext.size();
+	ctrls.controls = &ext[0];
+	if(0 == xioctl(fd, VIDIOC_S_EXT_CTRLS, &ctrls))
+		return;
+
+	if(EINVAL != errno && ENOTTY != errno)
+		throw runtime_error(device + " : VIDIOC_S_EXT_CTRLS");
+
+	for(i = 0; i < values.size(); ++i)
+		set_control(values[i].id, values[i].value);
+}
+
+size_t Picam::max_frame_size() const
+{
+	size_t i, max = 0;
+
+	for(i = 0; i < n_buffers; ++i)
+		if(buffers[i].size > max)
+			max = buffers[i].size;
+
+	return max;
 }
 
 void Picam::stop_capturing(void)
 {
 	enum v4l2_buf_type type;
+	unsigned int i;
 
 	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
 	if( -1 == xioctl(fd, VIDIOC_STREAMOFF, &type))
 		throw runtime_error("VIDIOC_STREAMOFF");
 
+	// STREAMOFF takes every buffer out of the driver queue //
+	for(i = 0; i < n_buffers; ++i)
+		buffers[i].queued = false;
+	streaming = false;
+
 }
 
 void Picam::uninit_device(void)
 {
 	unsigned int i;
 
-	for(i = 0; i < n_buffers; ++i)
-	{
-		if( -1 == munmap(buffers[i].data, buffers[i].size))
-			throw runtime_error("munmap");
+	// USERPTR and DMABUF memory belongs to the arena //
+	if(memory == V4L2_MEMORY_MMAP){
+		for(i = 0; i < n_buffers; ++i)
+		{
+			if(buffers[i].dmabuf_fd != -1)
+				close(buffers[i].dmabuf_fd);
+			if( -1 == munmap(buffers[i].data, buffers[i].size))
+				throw runtime_error("munmap");
+		}
 	}
-	free(buffers);
+	delete[] buffers;
 }
 
 void Picam::close_device(void)
@@ -321,7 +976,7 @@ void Picam::close_device(void)
 }
 
 
-void Picam::set_fps(int fps){
+void Picam::set_fps(unsigned int fps){
 	struct v4l2_streamparm streamparm;
 	CLEAR(streamparm);
 	streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -329,5 +984,54 @@ void Picam::set_fps(int fps){
 	streamparm.parm.capture.timeperframe.denominator = fps; 
 	if(xioctl(fd, VIDIOC_S_PARM, &streamparm))
 		throw runtime_error("VIDIOC_S_PARM");
+
+	// S_PARM writes back the interval the driver settled on //
+	if(streamparm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME){
+		granted.interval_num = streamparm.parm.capture.timeperframe.numerator;
+		granted.interval_den = streamparm.parm.capture.timeperframe.denominator;
+	}else{
+		granted.interval_num = 0;
+		granted.interval_den = 0;
+	}
+}
+
+// S_FMT with xres x yres pixfmt, false if the driver adjusted any of them //
+bool Picam::negotiate_format(struct v4l2_format *fmt)
+{
+	CLEAR(*fmt);
+	fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt->fmt.pix.width = xres;
+	fmt->fmt.pix.height = yres;
+	fmt->fmt.pix.pixelformat = pixfmt;
+	if(pixfmt == V4L2_PIX_FMT_MJPEG)
+		fmt->fmt.pix.field = V4L2_FIELD_INTERLACED;
+	else
+		fmt->fmt.pix.field = V4L2_FIELD_NONE;
+
+	if( -1 == xioctl(fd, VIDIOC_S_FMT, fmt))
+		throw runtime_error("VIDIOC_S_FMT");
+
+	if(fmt->fmt.pix.pixelformat != pixfmt)
+		return false;
+	// a fixed-size request keeps taking what the driver rounds it to //
+	return !auto_mode || (fmt->fmt.pix.width == xres && fmt->fmt.pix.height == yres);
+}
+
+void Picam::choose_mode(const struct v4l2_capability& cap, bool refresh)
+{
+	string key = string((const char*)cap.driver) + "-" + (const char*)cap.card + "-"
+		+ (const char*)cap.bus_info + "-" + to_string(cap.version);
+	mode_choice c;
+
+	if(!select_mode(device_modes(fd, key, refresh), want, &c, fd))
+		throw runtime_error(device + " : no mode for " + to_string(want.width) + "x"
+			+ to_string(want.height) + " at " + to_string(want.fps) + " fps");
+
+	pixfmt = c.pixelformat;
+	xres = c.width;
+	yres = c.height;
+	// fastest the mode allows, S_PARM rounds to what the driver has //
+	fps = (c.interval_den + c.interval_num - 1) / c.interval_num;
+	granted.latency_ns = c.latency_ns;
 }
 
@@ -1,34 +1,235 @@
+#ifndef PICAM_V4L2_CTRL_H
+#define PICAM_V4L2_CTRL_H
+
 #include <string>
 #include <memory>
+#include <atomic>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+#include "frame_sink.h"
+#include "capture_source.h"
+#include "frame_arena.h"
+#include "luma_frame.h"
+#include "metrics.h"
+#include "capture_modes.h"
+
+enum io_method {
+	IO_METHOD_MMAP,			// driver buffers mapped into the process
+	IO_METHOD_MMAP_EXPBUF,	// as above, each buffer also exported as a dma-buf
+	IO_METHOD_USERPTR,		// caller arena memory handed to the driver
+	IO_METHOD_DMABUF		// caller arena imported as dma-buf fds
+};
 
 struct buffer{
 		void *data;
 		size_t size;
+		int dmabuf_fd;
+		size_t bytesused;
+		frame_info info;
+		uint64_t dequeued_ns;		// CLOCK_MONOTONIC at VIDIOC_DQBUF
+		std::atomic<int> refs;
+		bool queued;
+};
+
+class Picam;
+class Raspi2Gpio;
+
+// one VIDIOC_QUERYCTRL answer //
+struct camera_control{
+	uint32_t id;
+	uint32_t type;				// V4L2_CTRL_TYPE_*
+	std::string name;
+	int32_t minimum, maximum, step;
+	int32_t default_value;
+	uint32_t flags;				// V4L2_CTRL_FLAG_*
+};
+
+struct control_value{
+	uint32_t id;
+	int32_t value;
+};
+
+// outcome of the last Picam::trigger_loop() //
+struct trigger_stats{
+	bool fired;
+	uint64_t edge_ns;				// CLOCK_MONOTONIC time of the trigger edge
+	uint64_t first_frame_ns;		// timestamp of the first kept frame
+	int64_t edge_to_frame_ns;		// first_frame_ns - edge_ns
+	uint64_t edge_to_dequeue_ns;	// edge to the first kept frame reaching user space
+	unsigned int pre_frames;		// ring frames delivered with FRAME_FLAG_PRE_TRIGGER
+	unsigned int discarded;			// frames before the edge that did not fit the ring
+};
+
+/*
+	FrameRef - lease on one dequeued V4L2 buffer
+	The buffer stays out of the driver queue while any copy of the
+	FrameRef is alive and is given back with VIDIOC_QBUF when the last
+	one is dropped. Every lease must be released before Picam is destroyed.
+*/
+class FrameRef{
+public:
+	FrameRef();
+	FrameRef(const FrameRef& other);
+	FrameRef& operator=(const FrameRef& other);
+	~FrameRef();
+
+	void release();
+
+	const void *data() const;
+	size_t size() const;
+	unsigned int frame_number() const;
+	// driver timestamp / sequence of the frame //
+	const frame_info& info() const;
+	uint64_t timestamp_ns() const { return info().timestamp_ns; }
+	uint32_t sequence() const { return info().sequence; }
+	unsigned int index() const { return idx; }
+	// dma-buf backing the frame, -1 for plain IO_METHOD_MMAP //
+	int dmabuf_fd() const;
+
+	explicit operator bool() const { return cam != NULL; }
+private:
+	friend class Picam;
+	FrameRef(Picam *cam, unsigned int idx);
+
+	Picam *cam;
+	unsigned int idx;
 };
 
 
-class Picam{
+class Picam : public CaptureSource{
 public:
-	Picam(const std::string& device = "/dev/video0", int width = 640, int height = 480);
+	Picam(const std::string& device = "/dev/video0", int width = 640, int height = 480,
+			unsigned int pixelformat = V4L2_PIX_FMT_MJPEG, unsigned int n_buffers = 4,
+			enum io_method io = IO_METHOD_MMAP, FrameArena *arena = NULL);
+	/*
+		Mode picked from what the device enumerates (capture_modes.h), the
+		enumeration cached per device. Throws if no mode fits req or the
+		driver grants something other than the chosen mode.
+	*/
+	Picam(const std::string& device, const mode_request& req, unsigned int n_buffers = 4,
+			enum io_method io = IO_METHOD_MMAP, FrameArena *arena = NULL);
 	~Picam();
 
 	const void mainloop(int timeout = 1, int count = 60);
+	// CaptureSource, mainloop() returning the frame count //
+	unsigned int run(int timeout, int count);
+
+	/*
+		Hardware-triggered capture. Streaming starts right away with every
+		buffer queued, frames are copied into a ring of the last
+		pre_trigger frames while waiting up to wait_timeout seconds (-1
+		forever) for an edge on trigger (edges enabled with set_edge()).
+		Then the ring goes to the sink tagged FRAME_FLAG_PRE_TRIGGER,
+		followed by count frames whose timestamp is not before the edge.
+		Timestamps are compared as the driver reports them, end of frame
+		on most UVC cameras. false if no edge came in time.
+	*/
+	bool trigger_loop(Raspi2Gpio *trigger, int count, unsigned int pre_trigger = 0,
+			int wait_timeout = -1, int timeout = 1);
+	const trigger_stats& last_trigger() const { return trig; }
+
+	void start_capturing();
+	void stop_capturing();
+	// STREAMOFF / STREAMON cycle to recover a stalled stream; leases stay valid //
+	void restart_capturing();
+	bool is_streaming() const { return streaming; }
+
+	// for select / poll / epoll on the capture queue //
+	int file_descriptor() const { return fd; }
+	const std::string& device_name() const { return device; }
+
+	// wait up to timeout seconds for the next frame and lease it //
+	FrameRef next_frame(int timeout = 1);
+	// non-blocking dequeue, empty FrameRef when no frame is ready //
+	FrameRef read_frame();
+
+	// buffers currently held by consumers and times the driver ran dry //
+	unsigned int frames_leased() const { return n_leased.value(); }
+	unsigned int buffer_count() const { return n_buffers; }
+	unsigned long starved() const { return n_starved.value(); }
+	// frames the driver skipped, from gaps in v4l2_buffer.sequence //
+	unsigned long sequence_drops() const { return n_seq_drops.value(); }
+
+	/*
+		Publish the capture counters under "<prefix>.": frames, seq_drops,
+		starved, eagain, select_timeouts, the leased gauge, and hold_ns
+		(DQBUF to QBUF) and dequeue_ns (sensor timestamp to DQBUF)
+		histograms. Picam must outlive reg.
+	*/
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "picam") const;
+
+	// frames go to sink instead of frameN.jpg; Picam does not own it //
+	void set_sink(FrameSink *sink);
+	size_t max_frame_size() const;
+	unsigned int width() const { return xres; }
+	unsigned int height() const { return yres; }
+	unsigned int pixel_format() const { return pixfmt; }
+	// format, size and frame interval the driver granted //
+	const mode_choice& mode() const { return granted; }
+	double frame_rate() const { return granted.interval_num ? (double)granted.interval_den / granted.interval_num : 0; }
+	size_t bytes_per_line() const { return stride; }
+
+	/*
+		Luma plane of a raw frame. GREY and NV12 are returned as a view of
+		the mapped buffer (valid while frame is held); YUYV and UYVY are
+		extracted into scratch, which must hold width() * height() bytes.
+		Returns false for compressed formats.
+	*/
+	bool get_luma(const FrameRef& frame, unsigned char *scratch, luma_frame *out) const;
+
+	/*
+		Sensor crop through VIDIOC_S_CROP. rect is in sensor pixels and is
+		clamped to the crop bounds; the driver may round it, get_crop()
+		returns what it actually applied. false if cropping is unsupported.
+	*/
+	bool set_crop(const struct v4l2_rect& rect);
+	bool get_crop(struct v4l2_rect *rect) const;
+	bool can_crop() const { return crop_supported; }
+	const struct v4l2_rect& crop_bounds() const { return cropcap_bounds; }
+
+	/*
+		Device controls. controls() lists every enabled one,
+		query_control() is false if the device lacks id or has it
+		disabled. set_controls() writes a batch with one
+		VIDIOC_S_EXT_CTRLS, one USB control transfer round on UVC, and
+		falls back to S_CTRL per value on drivers without it. The set
+		calls throw if the driver rejects a value; they are safe from
+		another thread while the capture loop runs.
+	*/
+	std::vector<camera_control> controls() const;
+	bool query_control(uint32_t id, camera_control *out) const;
+	int32_t get_control(uint32_t id) const;
+	void set_control(uint32_t id, int32_t value);
+	void set_controls(const std::vector<control_value>& values);
 private:
+	friend class FrameRef;
+
 	// function //
 	void init_mmap();
+	void init_userp();
+	void init_dmabuf();
+	void request_buffers(unsigned int memory);
+	void queue_buffer(unsigned int index);
 
 	void open_device();
 	void close_device();
 
 	void init_device();
 	void uninit_device();
+	void setup();
+	bool negotiate_format(struct v4l2_format *fmt);
+	void choose_mode(const struct v4l2_capability& cap, bool refresh);
 
-	void start_capturing();
-	void stop_capturing();
 	
-	bool read_frame();
-	void process_image(void *p, int size);
-	void set_fps(int fps);
+	void requeue(unsigned int index);
+	bool wait_frame(int timeout);
+	void process_image(const FrameRef& frame);
+	bool trigger_frame(const FrameRef& frame, bool fired);
+	void stash_frame(const FrameRef& frame);
+	void flush_pre_trigger();
+	void set_fps(unsigned int fps);
 
 	// variable //
 	std::string	device;
@@ -36,12 +237,49 @@ private:
 
 	struct buffer *buffers;
 	unsigned int n_buffers;
+	unsigned int req_buffers;
+	size_t buffer_size;
+
+	enum io_method io;
+	unsigned int memory;
+	FrameArena *arena;
+
+	MetricGauge n_leased;
+	MetricCounter n_starved;
 
 	size_t xres, yres;
 	size_t stride;
+	unsigned int pixfmt;
+
+	bool crop_supported;
+	struct v4l2_rect cropcap_bounds;
 
 	bool force_format;
+	bool auto_mode;
+	mode_request want;
+	unsigned int fps;
+	mode_choice granted;
+	bool streaming;
 	int frame_count;
 	unsigned int frame_number;
+	bool have_sequence;
+	uint32_t last_sequence;
+	MetricCounter n_seq_drops;
+	MetricCounter n_frames;
+	MetricCounter n_eagain;
+	MetricCounter n_select_timeouts;
+	MetricHistogram hold_time;
+	MetricHistogram dequeue_latency;
 
+	FrameSink *sink;
+	std::unique_ptr<FrameSink> default_sink;
+
+	// trigger_loop() state, pre_ring holds pre_slots frames of max_frame_size() //
+	trigger_stats trig;
+	std::vector<unsigned char> pre_ring;
+	std::vector<frame_info> pre_info;
+	std::vector<size_t> pre_size;
+	unsigned int pre_slots, pre_head, pre_count;
 };
+
+#endif
@@ -0,0 +1,85 @@
+#include <linux/videodev2.h>
+
+#include <stdexcept>
+
+#include "pipeline_stages.h"
+#include "luma.h"
+
+using namespace std;
+
+DecodeStage::DecodeStage(unsigned int width, unsigned int height, uint32_t pixelformat, size_t stride,
+		enum decode_mode mode) :
+	width(width), height(height), pixfmt(pixelformat), stride(stride), mode(mode), n_fallback(0)
+{
+	if(pixfmt != V4L2_PIX_FMT_MJPEG && !luma_supported(pixfmt))
+		throw runtime_error("DecodeStage : unsupported pixel format");
+}
+
+void DecodeStage::prepare(unsigned int n_workers)
+{
+	unsigned int tw = (width + COARSE_SCALE - 1) / COARSE_SCALE;
+	unsigned int th = (height + COARSE_SCALE - 1) / COARSE_SCALE;
+
+	workers.clear();
+	while(workers.size() < n_workers){
+		worker_state *w = new worker_state;
+
+		workers.push_back(unique_ptr<worker_state>(w));
+		if(mode == DECODE_COARSE){
+			w->coarse.reset(new PupilDetector(tw, th));
+			w->thumb.resize((size_t)tw * th);
+		}
+	}
+}
+
+bool DecodeStage::process(pipe_item& item, unsigned int worker)
+{
+	worker_state& w = *workers[worker];
+	luma_frame thumb;
+	pupil_roi roi;
+
+	item.region.x = item.region.y = 0;
+	item.region.width = width;
+	item.region.height = height;
+
+	if(pixfmt != V4L2_PIX_FMT_MJPEG){
+		extract_luma(&item.data[0], stride ? stride : item.size / height, width, height, pixfmt, &item.pixels[0]);
+		item.luma.width = width;
+		item.luma.height = height;
+		item.luma.stride = width;
+		item.luma.data = &item.pixels[0];
+	}else if(mode == DECODE_COARSE
+			&& w.jpeg.decode(&item.data[0], item.size, COARSE_SCALE, &w.thumb[0], w.thumb.size(), &thumb)
+			&& w.coarse->coarse_region(thumb, COARSE_SCALE, width, height,
+					COARSE_RADIUS, COARSE_MARGIN, COARSE_CONTRAST, &roi)
+			&& w.jpeg.decode_region(&item.data[0], item.size, &roi, &item.pixels[0], item.pixels.size(), &item.luma)){
+		// roi came back widened to what the decoder could cut //
+		item.region = roi;
+	}else{
+		if(mode == DECODE_COARSE)
+			n_fallback++;
+		if(!w.jpeg.decode(&item.data[0], item.size, 1, &item.pixels[0], item.pixels.size(), &item.luma))
+			return false;
+	}
+
+	item.luma.frame_number = item.info.frame_number;
+	item.luma.timestamp_ns = item.info.timestamp_ns;
+	return true;
+}
+
+void DetectStage::prepare(unsigned int n_workers)
+{
+	detectors.clear();
+	while(detectors.size() < n_workers)
+		detectors.push_back(unique_ptr<PupilDetector>(new PupilDetector(width, height)));
+}
+
+bool DetectStage::process(pipe_item& item, unsigned int worker)
+{
+	item.result = detectors[worker]->detect(item.luma);
+	if(item.result.found){
+		item.result.x += item.region.x;
+		item.result.y += item.region.y;
+	}
+	return true;
+}
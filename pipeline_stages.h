@@ -0,0 +1,73 @@
+#ifndef PIPELINE_STAGES_H
+#define PIPELINE_STAGES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include "stage_graph.h"
+#include "jpeg_luma.h"
+#include "pupil_detector.h"
+
+#define COARSE_SCALE 8			// thumbnail at 1/8, libjpeg-turbo's DC-only scale
+#define COARSE_RADIUS 2			// thumbnail pixels, a 40 px pupil at 640x480
+#define COARSE_MARGIN 24		// frame pixels around the coarse square, where the fine search runs
+#define COARSE_CONTRAST 10.0f
+
+enum decode_mode{
+	DECODE_FULL,		// the whole frame at 1/1
+	DECODE_COARSE		// MJPEG: 1/8 thumbnail, then only the region around its darkest spot
+};
+
+/*
+	DecodeStage - captured frame to item.luma, for a StageGraph
+	MJPEG goes through libjpeg-turbo, raw formats through extract_luma().
+	DECODE_COARSE decodes the 1/8 thumbnail of an MJPEG frame, finds the
+	pupil candidate on it with PupilDetector::coarse_region() and decodes
+	only that region at full scale; item.region says where it sits in the
+	frame. A thumbnail without a dark enough spot falls back to the whole
+	frame. One decoder per worker, nothing allocated per frame.
+*/
+class DecodeStage : public PipelineStage{
+public:
+	DecodeStage(unsigned int width, unsigned int height, uint32_t pixelformat, size_t stride = 0,
+			enum decode_mode mode = DECODE_FULL);
+
+	void prepare(unsigned int n_workers);
+	bool process(pipe_item& item, unsigned int worker);
+
+	// DECODE_COARSE frames decoded whole, no region on the thumbnail //
+	unsigned long fallbacks() const { return n_fallback.load(); }
+private:
+	DecodeStage(const DecodeStage&);
+	DecodeStage& operator=(const DecodeStage&);
+
+	struct worker_state{
+		JpegLumaDecoder jpeg;
+		std::unique_ptr<PupilDetector> coarse;
+		std::vector<unsigned char> thumb;
+	};
+
+	unsigned int width, height;
+	uint32_t pixfmt;
+	size_t stride;
+	enum decode_mode mode;
+	std::vector<std::unique_ptr<worker_state> > workers;
+	std::atomic<unsigned long> n_fallback;
+};
+
+// PupilDetector on item.luma, one per worker; the result is in frame coordinates //
+class DetectStage : public PipelineStage{
+public:
+	DetectStage(unsigned int width, unsigned int height) : width(width), height(height) {}
+
+	void prepare(unsigned int n_workers);
+	bool process(pipe_item& item, unsigned int worker);
+private:
+	unsigned int width, height;
+	std::vector<std::unique_ptr<PupilDetector> > detectors;
+};
+
+#endif
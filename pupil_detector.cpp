@@ -0,0 +1,538 @@
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "pupil_detector.h"
+
+using namespace std;
+
+#define RADIUS_STEP		1.4f	// ratio between radii tried by the coarse search
+#define EDGE_TOLERANCE	0.35f	// edge points further than this from the median radius are dropped
+
+PupilDetector::PupilDetector(unsigned int max_width, unsigned int max_height, const pupil_params& params) :
+	prm(params), max_w(max_width), max_h(max_height),
+	integral((size_t)(max_width + 1) * (max_height + 1)), int_w(0), int_h(0), org_x(0), org_y(0)
+{
+	if(prm.n_rays < 8 || prm.n_rays > PUPIL_MAX_RAYS)
+		throw runtime_error("PupilDetector : n_rays out of range");
+	if(prm.min_radius < 2 || prm.max_radius < prm.min_radius)
+		throw runtime_error("PupilDetector : bad radius range");
+}
+
+pupil PupilDetector::detect(const luma_frame& frame)
+{
+	pupil_roi roi;
+
+	roi.x = 0;
+	roi.y = 0;
+	roi.width = frame.width;
+	roi.height = frame.height;
+
+	return detect(frame, roi);
+}
+
+pupil PupilDetector::detect(const luma_frame& frame, const pupil_roi& area)
+{
+	pupil p;
+	pupil_roi roi = area;
+	box_hit hit;
+	float thr, cx, cy;
+	unsigned int n;
+
+	memset(&p, 0, sizeof(p));
+	p.frame_number = frame.frame_number;
+
+	if(roi.x >= frame.width || roi.y >= frame.height)
+		return p;
+	roi.width = min(roi.width, frame.width - roi.x);
+	roi.height = min(roi.height, frame.height - roi.y);
+	if(roi.width > max_w || roi.height > max_h)
+		throw runtime_error("PupilDetector : frame larger than scratch buffers");
+
+	integrate(frame, roi);
+
+	if(!coarse_search(&hit))
+		return p;
+	if(hit.ring - hit.inner < prm.min_contrast)
+		return p;
+
+	thr = refine_threshold(frame, hit, hit.inner + 0.5f * (hit.ring - hit.inner));
+	if(!refine_center(frame, hit, thr, &cx, &cy))
+		return p;
+
+	n = cast_rays(frame, cx, cy, min(2 * hit.r + 4, (int)(prm.max_radius * 3 / 2)), thr);
+	n = reject_outliers(n);
+	if(n < 5)
+		return p;
+
+	if(!fit_ellipse(n, &p) && !fit_circle(n, &p))
+		return p;
+
+	// a fit centre outside the search window is a failed fit //
+	if(p.x < roi.x || p.y < roi.y || p.x >= roi.x + roi.width || p.y >= roi.y + roi.height)
+		return p;
+
+	p.confidence = (float)n / prm.n_rays
+		* max(0.0f, 1.0f - 5.0f * fit_error(n, p))
+		* min(1.0f, (hit.ring - hit.inner) / (2.0f * prm.min_contrast));
+	p.found = p.confidence >= prm.min_confidence
+		&& p.radius >= prm.min_radius * 0.5f && p.radius <= prm.max_radius * 1.5f;
+
+	return p;
+}
+
+bool PupilDetector::coarse_region(const luma_frame& thumb, unsigned int scale, unsigned int width, unsigned int height,
+		unsigned int radius, unsigned int margin, float min_contrast, pupil_roi *roi)
+{
+	const int r = radius, ring = 2 * radius + 1;
+	const float n_in = (float)(2 * r + 1) * (2 * r + 1);
+	const float n_out = (float)(2 * ring + 1) * (2 * ring + 1) - n_in;
+	pupil_roi all = { 0, 0, thumb.width, thumb.height };
+	float best = 0;
+	int best_x = -1, best_y = -1;
+	int cx, cy;
+
+	if(thumb.width > max_w || thumb.height > max_h)
+		throw runtime_error("PupilDetector : thumbnail larger than scratch buffers");
+
+	// the thumbnail is small enough to integrate whole //
+	integrate(thumb, all);
+
+	for(cy = ring; cy + ring < (int)thumb.height; ++cy){
+		for(cx = ring; cx + ring < (int)thumb.width; ++cx){
+			uint32_t in = box_sum(cx - r, cy - r, cx + r + 1, cy + r + 1);
+			uint32_t out = box_sum(cx - ring, cy - ring, cx + ring + 1, cy + ring + 1) - in;
+			float contrast = out / n_out - in / n_in;
+
+			if(contrast > best){
+				best = contrast;
+				best_x = cx;
+				best_y = cy;
+			}
+		}
+	}
+
+	if(best_x < 0 || best < min_contrast)
+		return false;
+
+	// thumbnail pixel (x, y) covers frame pixels scale x .. scale x + scale - 1 //
+	cx = (best_x - r) * (int)scale - (int)margin;
+	cy = (best_y - r) * (int)scale - (int)margin;
+	roi->x = cx > 0 ? cx : 0;
+	roi->y = cy > 0 ? cy : 0;
+	roi->width = (2 * r + 1) * scale + 2 * margin - (roi->x - cx);
+	roi->height = (2 * r + 1) * scale + 2 * margin - (roi->y - cy);
+	if(roi->x >= width || roi->y >= height)
+		return false;
+	roi->width = min(roi->width, width - roi->x);
+	roi->height = min(roi->height, height - roi->y);
+	return true;
+}
+
+void PupilDetector::integrate(const luma_frame& frame, const pupil_roi& roi)
+{
+	unsigned int x, y;
+	uint32_t row;
+
+	int_w = roi.width;
+	int_h = roi.height;
+	org_x = roi.x;
+	org_y = roi.y;
+
+	memset(&integral[0], 0, (int_w + 1) * sizeof(uint32_t));
+	for(y = 0; y < int_h; ++y){
+		const unsigned char *s = frame.data + (y + org_y) * frame.stride + org_x;
+		uint32_t *prev = &integral[(size_t)y * (int_w + 1)];
+		uint32_t *cur = prev + int_w + 1;
+
+		row = 0;
+		cur[0] = 0;
+		for(x = 0; x < int_w; ++x){
+			row += s[x];
+			cur[x + 1] = prev[x + 1] + row;
+		}
+	}
+}
+
+uint32_t PupilDetector::box_sum(int x0, int y0, int x1, int y1) const
+{
+	const size_t w = int_w + 1;
+
+	return integral[y1 * w + x1] - integral[y0 * w + x1] - integral[y1 * w + x0] + integral[y0 * w + x0];
+}
+
+// inner box against its surround, centred on x, y of the search window //
+void PupilDetector::score_box(int x, int y, int r, box_hit *best) const
+{
+	// inner square roughly inscribed in the pupil, surround twice as wide //
+	int hi = max(1, r * 3 / 4), ho = 2 * r;
+	int ox0 = max(0, x - ho), oy0 = max(0, y - ho);
+	int ox1 = min((int)int_w, x + ho), oy1 = min((int)int_h, y + ho);
+	int in_area = 4 * hi * hi;
+	int ring_area = (ox1 - ox0) * (oy1 - oy0) - in_area;
+	uint32_t in_sum, out_sum;
+	float inner, ring, response;
+
+	if(ring_area <= in_area)
+		return;
+
+	in_sum = box_sum(x - hi, y - hi, x + hi, y + hi);
+	out_sum = box_sum(ox0, oy0, ox1, oy1);
+	inner = (float)in_sum / in_area;
+	ring = (float)(out_sum - in_sum) / ring_area;
+	// weight by darkness so the iris against the skin loses to the pupil //
+	response = (ring - inner) * (255.0f - inner) / 255.0f;
+
+	if(response > best->response){
+		best->x = x;
+		best->y = y;
+		best->r = r;
+		best->inner = inner;
+		best->ring = ring;
+		best->response = response;
+	}
+}
+
+/*
+	Every radius on a grid of half its inner box, then the winner again at
+	every pixel around it. The inner box spans at least two grid steps, so
+	the pupil is always caught by some box on the grid, and the local pass
+	puts the centre back to where the finer grid would have.
+*/
+bool PupilDetector::coarse_search(box_hit *best) const
+{
+	float rf;
+	int grid = 0;
+
+	best->response = 0.0f;
+
+	for(rf = (float)prm.min_radius; rf <= (float)prm.max_radius; rf *= RADIUS_STEP){
+		int r = (int)rf;
+		int hi = max(1, r * 3 / 4);
+		int step = max(2, hi / 2 + 1);
+		int x, y;
+		float before = best->response;
+
+		if(2 * hi >= (int)int_w || 2 * hi >= (int)int_h)
+			break;
+
+		for(y = hi; y + hi <= (int)int_h; y += step)
+			for(x = hi; x + hi <= (int)int_w; x += step)
+				score_box(x, y, r, best);
+
+		if(best->response > before)
+			grid = step;
+	}
+
+	if(best->response <= 0.0f)
+		return false;
+
+	{
+		int r = best->r, hi = max(1, r * 3 / 4);
+		int cx = best->x, cy = best->y;
+		int x0 = max(hi, cx - grid + 1), y0 = max(hi, cy - grid + 1);
+		int x1 = min((int)int_w - hi, cx + grid - 1), y1 = min((int)int_h - hi, cy + grid - 1);
+		int x, y;
+
+		for(y = y0; y <= y1; ++y)
+			for(x = x0; x <= x1; ++x)
+				score_box(x, y, r, best);
+	}
+
+	best->x += org_x;
+	best->y += org_y;
+	return true;
+}
+
+float PupilDetector::refine_threshold(const luma_frame& frame, const box_hit& hit, float thr) const
+{
+	int h = hit.r * 3 / 2;
+	int x0 = max((int)org_x, hit.x - h), y0 = max((int)org_y, hit.y - h);
+	int x1 = min((int)(org_x + int_w), hit.x + h), y1 = min((int)(org_y + int_h), hit.y + h);
+	int t = (int)thr, x, y, k, best = -1;
+	uint32_t hist[256];
+	double n0 = 0, s0 = 0, n = 0, sum = 0, best_var = 0;
+
+	/*
+		If the coarse box was the iris against the skin, the pixels under
+		thr are pupil plus iris. Otsu on them splits the two; a split with
+		less than min_contrast between the classes means thr already sits
+		right above the pupil.
+	*/
+	memset(hist, 0, sizeof(hist));
+	for(y = y0; y < y1; ++y){
+		const unsigned char *s = frame.data + y * frame.stride;
+		for(x = x0; x < x1; ++x)
+			if(s[x] < t)
+				hist[s[x]]++;
+	}
+
+	for(k = 0; k < t; ++k){
+		n += hist[k];
+		sum += (double)k * hist[k];
+	}
+
+	for(k = 0; k < t - 1; ++k){
+		double m0, m1, var;
+
+		n0 += hist[k];
+		s0 += (double)k * hist[k];
+		if(n0 == 0 || n0 == n)
+			continue;
+
+		m0 = s0 / n0;
+		m1 = (sum - s0) / (n - n0);
+		var = n0 * (n - n0) * (m1 - m0) * (m1 - m0);
+		if(var > best_var && m1 - m0 >= prm.min_contrast){
+			best_var = var;
+			best = k;
+		}
+	}
+
+	return best < 0 ? thr : best + 0.5f;
+}
+
+bool PupilDetector::refine_center(const luma_frame& frame, const box_hit& hit, float thr,
+		float *cx, float *cy) const
+{
+	int h = hit.r * 3 / 2;
+	int x0 = max((int)org_x, hit.x - h), y0 = max((int)org_y, hit.y - h);
+	int x1 = min((int)(org_x + int_w), hit.x + h), y1 = min((int)(org_y + int_h), hit.y + h);
+	unsigned long sx = 0, sy = 0, n = 0;
+	int x, y;
+
+	for(y = y0; y < y1; ++y){
+		const unsigned char *s = frame.data + y * frame.stride;
+		for(x = x0; x < x1; ++x){
+			if(s[x] < thr){
+				sx += x;
+				sy += y;
+				n++;
+			}
+		}
+	}
+
+	if(n == 0)
+		return false;
+
+	*cx = (float)sx / n;
+	*cy = (float)sy / n;
+	return true;
+}
+
+unsigned int PupilDetector::cast_rays(const luma_frame& frame, float cx, float cy, int max_r, float thr)
+{
+	const int run = max(2, (int)prm.min_radius / 4);
+	const float x_lo = org_x, y_lo = org_y;
+	const float x_hi = org_x + int_w - 1, y_hi = org_y + int_h - 1;
+	unsigned int k, n = 0;
+
+	for(k = 0; k < prm.n_rays; ++k){
+		float a = 2.0f * (float)M_PI * k / prm.n_rays;
+		float dx = cosf(a), dy = sinf(a);
+		int t, bright = 0;
+
+		for(t = 1; t <= max_r; ++t){
+			float x = cx + dx * t, y = cy + dy * t;
+
+			if(x < x_lo || y < y_lo || x > x_hi || y > y_hi)
+				break;
+
+			// a glint is shorter than run, the iris is not //
+			if(frame.data[(int)(y + 0.5f) * frame.stride + (int)(x + 0.5f)] >= thr){
+				if(++bright == run){
+					float e = t - run + 0.5f;
+					px[n] = cx + dx * e;
+					py[n] = cy + dy * e;
+					pd[n] = e;
+					n++;
+					break;
+				}
+			}else{
+				bright = 0;
+			}
+		}
+	}
+
+	return n;
+}
+
+unsigned int PupilDetector::reject_outliers(unsigned int n)
+{
+	float tmp[PUPIL_MAX_RAYS], med, tol;
+	unsigned int i, k = 0;
+
+	if(n == 0)
+		return 0;
+
+	memcpy(tmp, pd, n * sizeof(float));
+	nth_element(tmp, tmp + n / 2, tmp + n);
+	med = tmp[n / 2];
+	tol = max(2.0f, EDGE_TOLERANCE * med);
+
+	for(i = 0; i < n; ++i){
+		if(fabsf(pd[i] - med) <= tol){
+			px[k] = px[i];
+			py[k] = py[i];
+			pd[k] = pd[i];
+			k++;
+		}
+	}
+
+	return k;
+}
+
+// solve m x = v in place, n <= 5, partial pivoting //
+static bool solve(double m[5][5], double v[5], int n)
+{
+	int i, j, k, p;
+
+	for(i = 0; i < n; ++i){
+		p = i;
+		for(j = i + 1; j < n; ++j)
+			if(fabs(m[j][i]) > fabs(m[p][i]))
+				p = j;
+		if(fabs(m[p][i]) < 1e-12)
+			return false;
+		if(p != i){
+			for(k = 0; k < n; ++k)
+				swap(m[i][k], m[p][k]);
+			swap(v[i], v[p]);
+		}
+		for(j = i + 1; j < n; ++j){
+			double f = m[j][i] / m[i][i];
+			for(k = i; k < n; ++k)
+				m[j][k] -= f * m[i][k];
+			v[j] -= f * v[i];
+		}
+	}
+
+	for(i = n - 1; i >= 0; --i){
+		for(k = i + 1; k < n; ++k)
+			v[i] -= m[i][k] * v[k];
+		v[i] /= m[i][i];
+	}
+
+	return true;
+}
+
+bool PupilDetector::fit_ellipse(unsigned int n, pupil *p) const
+{
+	double m[5][5], v[5], mx = 0, my = 0, s = 0;
+	double A, B, C, D, E, x0, y0, f0, det, tr, disc, l1, l2;
+	unsigned int i;
+	int j, k;
+
+	// normalise for conditioning : centroid at 0, mean distance 1 //
+	for(i = 0; i < n; ++i){
+		mx += px[i];
+		my += py[i];
+	}
+	mx /= n;
+	my /= n;
+	for(i = 0; i < n; ++i)
+		s += sqrt((px[i] - mx) * (px[i] - mx) + (py[i] - my) * (py[i] - my));
+	s /= n;
+	if(s <= 0)
+		return false;
+
+	memset(m, 0, sizeof(m));
+	memset(v, 0, sizeof(v));
+
+	// A x^2 + B xy + C y^2 + D x + E y = 1 //
+	for(i = 0; i < n; ++i){
+		double x = (px[i] - mx) / s, y = (py[i] - my) / s;
+		double r[5] = { x * x, x * y, y * y, x, y };
+
+		for(j = 0; j < 5; ++j){
+			for(k = 0; k < 5; ++k)
+				m[j][k] += r[j] * r[k];
+			v[j] += r[j];
+		}
+	}
+
+	if(!solve(m, v, 5))
+		return false;
+
+	A = v[0]; B = v[1]; C = v[2]; D = v[3]; E = v[4];
+
+	det = 4 * A * C - B * B;
+	if(det <= 0)
+		return false;
+
+	x0 = (B * E - 2 * C * D) / det;
+	y0 = (B * D - 2 * A * E) / det;
+	f0 = (D * x0 + E * y0) / 2 - 1;
+
+	tr = A + C;
+	disc = sqrt((A - C) * (A - C) + B * B);
+	l1 = (tr - disc) / 2;
+	l2 = (tr + disc) / 2;
+	if(l1 <= 0 || l2 <= 0 || f0 >= 0)
+		return false;
+
+	p->x = (float)(x0 * s + mx);
+	p->y = (float)(y0 * s + my);
+	p->axis_a = (float)(sqrt(-f0 / l1) * s);
+	p->axis_b = (float)(sqrt(-f0 / l2) * s);
+	// major axis is the eigenvector of the smaller eigenvalue //
+	p->angle = (float)(0.5 * atan2(B, A - C) + M_PI / 2);
+	if(p->angle > M_PI / 2)
+		p->angle -= (float)M_PI;
+	p->radius = (p->axis_a + p->axis_b) / 2;
+
+	// very eccentric fits come from edge points on the eyelid //
+	return p->axis_b > 0.4f * p->axis_a;
+}
+
+bool PupilDetector::fit_circle(unsigned int n, pupil *p) const
+{
+	double m[5][5], v[5], r2;
+	unsigned int i;
+	int j, k;
+
+	memset(m, 0, sizeof(m));
+	memset(v, 0, sizeof(v));
+
+	// x^2 + y^2 + D x + E y + F = 0 //
+	for(i = 0; i < n; ++i){
+		double r[3] = { px[i], py[i], 1.0 };
+		double b = -(px[i] * px[i] + py[i] * py[i]);
+
+		for(j = 0; j < 3; ++j){
+			for(k = 0; k < 3; ++k)
+				m[j][k] += r[j] * r[k];
+			v[j] += r[j] * b;
+		}
+	}
+
+	if(!solve(m, v, 3))
+		return false;
+
+	p->x = (float)(-v[0] / 2);
+	p->y = (float)(-v[1] / 2);
+	r2 = (double)p->x * p->x + (double)p->y * p->y - v[2];
+	if(r2 <= 0)
+		return false;
+
+	p->radius = p->axis_a = p->axis_b = (float)sqrt(r2);
+	p->angle = 0;
+	return true;
+}
+
+float PupilDetector::fit_error(unsigned int n, const pupil& p) const
+{
+	float c = cosf(p.angle), s = sinf(p.angle), err = 0;
+	unsigned int i;
+
+	for(i = 0; i < n; ++i){
+		float dx = px[i] - p.x, dy = py[i] - p.y;
+		float u = (dx * c + dy * s) / p.axis_a, w = (-dx * s + dy * c) / p.axis_b;
+
+		err += fabsf(sqrtf(u * u + w * w) - 1.0f);
+	}
+
+	return err / n;
+}
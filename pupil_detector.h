@@ -0,0 +1,101 @@
+#ifndef PUPIL_DETECTOR_H
+#define PUPIL_DETECTOR_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "luma_frame.h"
+
+#define PUPIL_MAX_RAYS 64
+
+struct pupil_roi{
+	unsigned int x, y;
+	unsigned int width, height;
+};
+
+struct pupil{
+	bool found;
+	unsigned int frame_number;
+	float x, y;			// ellipse center in frame pixels
+	float radius;		// mean of the semi-axes
+	float axis_a;		// semi-major axis
+	float axis_b;		// semi-minor axis
+	float angle;		// major axis orientation, radians
+	float confidence;	// 0 .. 1
+};
+
+struct pupil_params{
+	unsigned int min_radius;
+	unsigned int max_radius;
+	unsigned int n_rays;		// edge rays cast from the dark-region centroid
+	float min_contrast;			// iris minus pupil mean below this is no pupil
+	float min_confidence;
+
+	pupil_params() :
+		min_radius(8), max_radius(60), n_rays(48), min_contrast(15.0f), min_confidence(0.3f) {}
+};
+
+/*
+	PupilDetector - dark-pupil localisation on a luma plane
+	1. integral image over the search window
+	2. coarse search for the square with the darkest centre against its
+	   surround, over a few radii
+	3. threshold between pupil and surround (Otsu-refined when the box
+	   caught the iris), dark-pixel centroid
+	4. edge points along rays from the centroid, median-radius outlier cut
+	5. algebraic ellipse fit, falling back to a circle fit
+	All scratch memory is sized in the constructor for max_width x
+	max_height, detect() itself never allocates.
+*/
+class PupilDetector{
+public:
+	PupilDetector(unsigned int max_width, unsigned int max_height,
+			const pupil_params& params = pupil_params());
+
+	pupil detect(const luma_frame& frame);
+	// search only inside roi, which is clipped to the frame //
+	pupil detect(const luma_frame& frame, const pupil_roi& roi);
+
+	/*
+		Coarse search on a thumbnail decoded at 1/scale (JpegLumaDecoder
+		at 1/8): the darkest (2 radius + 1) square of thumbnail pixels
+		against the ring around it, as a region of the full frame widened
+		by margin pixels and clipped to width x height. false if no square
+		is min_contrast darker than its ring.
+	*/
+	bool coarse_region(const luma_frame& thumb, unsigned int scale, unsigned int width, unsigned int height,
+			unsigned int radius, unsigned int margin, float min_contrast, pupil_roi *roi);
+
+	const pupil_params& params() const { return prm; }
+private:
+	struct box_hit{
+		int x, y;		// box centre
+		int r;
+		float inner, ring;
+		float response;
+	};
+
+	void integrate(const luma_frame& frame, const pupil_roi& roi);
+	uint32_t box_sum(int x0, int y0, int x1, int y1) const;
+	void score_box(int x, int y, int r, box_hit *best) const;
+	bool coarse_search(box_hit *best) const;
+	float refine_threshold(const luma_frame& frame, const box_hit& hit, float thr) const;
+	bool refine_center(const luma_frame& frame, const box_hit& hit, float thr, float *cx, float *cy) const;
+	unsigned int cast_rays(const luma_frame& frame, float cx, float cy, int max_r, float thr);
+	unsigned int reject_outliers(unsigned int n);
+	bool fit_ellipse(unsigned int n, pupil *p) const;
+	bool fit_circle(unsigned int n, pupil *p) const;
+	float fit_error(unsigned int n, const pupil& p) const;
+
+	pupil_params prm;
+	unsigned int max_w, max_h;
+
+	// integral image of the current search window, (w + 1) x (h + 1) //
+	std::vector<uint32_t> integral;
+	unsigned int int_w, int_h;
+	unsigned int org_x, org_y;
+
+	float px[PUPIL_MAX_RAYS], py[PUPIL_MAX_RAYS], pd[PUPIL_MAX_RAYS];
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "pupil_tracker.h"
+#include "picam_v4l2_ctrl.h"
+
+using namespace std;
+
+void PupilTracker::kalman::init(float pos)
+{
+	x = pos;
+	v = 0;
+	p00 = 10.0f;
+	p01 = 0;
+	p11 = 100.0f;
+}
+
+void PupilTracker::kalman::predict(float q)
+{
+	// x += v over one frame, white acceleration noise q //
+	x += v;
+	p00 += 2 * p01 + p11 + q / 4;
+	p01 += p11 + q / 2;
+	p11 += q;
+}
+
+void PupilTracker::kalman::update(float z, float r)
+{
+	float s = p00 + r;
+	float k0 = p00 / s, k1 = p01 / s;
+	float y = z - x;
+
+	x += k0 * y;
+	v += k1 * y;
+	p11 -= k1 * p01;
+	p01 *= 1 - k0;
+	p00 *= 1 - k0;
+}
+
+PupilTracker::PupilTracker(PupilDetector *detector, const track_params& params) :
+	detector(detector), prm(params), cam(NULL), settle(0)
+{
+	memset(&crop, 0, sizeof(crop));
+	memset(&full, 0, sizeof(full));
+	reset();
+}
+
+void PupilTracker::reset()
+{
+	locked = false;
+	misses = 0;
+	radius = 0;
+	memset(&window, 0, sizeof(window));
+	memset(&st, 0, sizeof(st));
+
+	if(cam && cam->set_crop(full))
+		crop = full;
+}
+
+void PupilTracker::use_sensor_crop(Picam *c)
+{
+	cam = NULL;
+	if(!c || !c->can_crop())
+		return;
+
+	full = c->crop_bounds();
+	if(!c->get_crop(&crop))
+		crop = full;
+	cam = c;
+}
+
+void PupilTracker::predict_window(unsigned int width, unsigned int height)
+{
+	float half = prm.roi_scale * radius + prm.roi_margin + 2 * sqrtf(max(kx.p00, ky.p00));
+	float x0 = max(0.0f, kx.x - half), y0 = max(0.0f, ky.x - half);
+	float x1 = min((float)width, kx.x + half), y1 = min((float)height, ky.x + half);
+
+	if(x1 <= x0 || y1 <= y0){
+		window.x = window.y = 0;
+		window.width = width;
+		window.height = height;
+		return;
+	}
+
+	window.x = (unsigned int)x0;
+	window.y = (unsigned int)y0;
+	window.width = (unsigned int)(x1 - x0);
+	window.height = (unsigned int)(y1 - y0);
+}
+
+pupil PupilTracker::track(const luma_frame& frame)
+{
+	unsigned int width = cam ? full.width : frame.width;
+	unsigned int height = cam ? full.height : frame.height;
+	// frame pixels per sensor pixel and crop offset, identity without a crop //
+	float sx = cam ? (float)frame.width / crop.width : 1.0f;
+	float sy = cam ? (float)frame.height / crop.height : 1.0f;
+	float ox = cam ? crop.left - full.left : 0.0f;
+	float oy = cam ? crop.top - full.top : 0.0f;
+	pupil p;
+
+	st.frames++;
+
+	if(locked){
+		kx.predict(prm.process_noise);
+		ky.predict(prm.process_noise);
+		predict_window(width, height);
+	}
+
+	if(settle > 0){
+		settle--;
+		memset(&p, 0, sizeof(p));
+		p.frame_number = frame.frame_number;
+		return p;
+	}
+
+	if(locked){
+		pupil_roi froi;
+		float fx0 = max(0.0f, (window.x - ox) * sx), fy0 = max(0.0f, (window.y - oy) * sy);
+
+		froi.x = (unsigned int)fx0;
+		froi.y = (unsigned int)fy0;
+		froi.width = (unsigned int)(window.width * sx) + 1;
+		froi.height = (unsigned int)(window.height * sy) + 1;
+
+		p = detector->detect(frame, froi);
+		st.roi_searches++;
+		if(!p.found){
+			p = detector->detect(frame);
+			st.full_searches++;
+		}
+	}else{
+		p = detector->detect(frame);
+		st.full_searches++;
+	}
+
+	if(p.found){
+		p.x = p.x / sx + ox;
+		p.y = p.y / sy + oy;
+		p.axis_a /= sx;
+		p.axis_b /= sx;
+		p.radius /= sx;
+
+		if(locked){
+			kx.update(p.x, prm.measurement_noise);
+			ky.update(p.y, prm.measurement_noise);
+		}else{
+			kx.init(p.x);
+			ky.init(p.y);
+			locked = true;
+		}
+		misses = 0;
+		radius = p.radius;
+		predict_window(width, height);
+	}else if(locked && ++misses > prm.max_misses){
+		locked = false;
+		st.losses++;
+		if(cam && cam->set_crop(full)){
+			crop = full;
+			settle = prm.crop_settle;
+			st.crop_changes++;
+		}
+	}
+
+	if(locked && cam)
+		update_crop();
+
+	return p;
+}
+
+void PupilTracker::update_crop()
+{
+	struct v4l2_rect want, got;
+	unsigned int a = prm.crop_align;
+	int x1, y1;
+
+	if((int)window.x >= crop.left - full.left && (int)window.y >= crop.top - full.top
+			&& (int)(window.x + window.width) <= crop.left - full.left + (int)crop.width
+			&& (int)(window.y + window.height) <= crop.top - full.top + (int)crop.height)
+		return;
+
+	// grow the window to the crop grid, with one grid step of slack //
+	want.left = full.left + (int)((window.x / a) * a) - (int)a;
+	want.top = full.top + (int)((window.y / a) * a) - (int)a;
+	x1 = full.left + (int)(((window.x + window.width + a - 1) / a) * a) + (int)a;
+	y1 = full.top + (int)(((window.y + window.height + a - 1) / a) * a) + (int)a;
+	want.left = max(want.left, full.left);
+	want.top = max(want.top, full.top);
+	want.width = min(x1, full.left + (int)full.width) - want.left;
+	want.height = min(y1, full.top + (int)full.height) - want.top;
+
+	if(cam->set_crop(want)){
+		// what the driver applied after rounding, or the request if it cannot say //
+		if(!cam->get_crop(&crop))
+			crop = want;
+		settle = prm.crop_settle;
+		st.crop_changes++;
+		return;
+	}
+
+	/*
+		Refused, the sensor keeps the last crop. Put it back on the full
+		frame and stop cropping only once that is confirmed; until then the
+		mapping stays on what the sensor last applied and a later frame
+		outside it tries again.
+	*/
+	st.crop_errors++;
+	if(!cam->set_crop(full))
+		return;
+	if(!cam->get_crop(&got))
+		got = full;
+	crop = got;
+	settle = prm.crop_settle;
+	st.crop_changes++;
+	if(got.left == full.left && got.top == full.top && got.width == full.width && got.height == full.height)
+		cam = NULL;
+}
@@ -0,0 +1,89 @@
+#ifndef PUPIL_TRACKER_H
+#define PUPIL_TRACKER_H
+
+#include <linux/videodev2.h>
+
+#include "pupil_detector.h"
+
+class Picam;
+
+struct track_params{
+	float roi_scale;			// ROI half-size in pupil radii
+	unsigned int roi_margin;	// extra pixels around the predicted pupil
+	unsigned int max_misses;	// ROI misses before the track is dropped
+	float process_noise;		// Kalman acceleration noise, px^2 / frame^4
+	float measurement_noise;	// Kalman measurement noise, px^2
+	unsigned int crop_align;	// sensor crop granularity, pixels
+	unsigned int crop_settle;	// frames ignored after the sensor crop changes
+
+	track_params() :
+		roi_scale(2.5f), roi_margin(16), max_misses(3),
+		process_noise(4.0f), measurement_noise(1.0f), crop_align(16), crop_settle(2) {}
+};
+
+struct track_stats{
+	unsigned long frames;
+	unsigned long roi_searches;		// frames searched inside the ROI only
+	unsigned long full_searches;	// frames that needed the whole frame
+	unsigned long losses;			// tracks dropped after max_misses
+	unsigned long crop_changes;		// sensor crop reprogrammed
+	unsigned long crop_errors;		// crop requests the driver refused
+};
+
+/*
+	PupilTracker - ROI tracking on top of PupilDetector
+	A constant-velocity Kalman filter per axis predicts the next pupil
+	position and only a window around it is searched. A miss inside the
+	window retries the whole frame on the same frame; after max_misses
+	consecutive misses the track is dropped and every frame is searched
+	in full until the pupil is found again.
+
+	With use_sensor_crop() the window is also programmed into the sensor
+	through Picam::set_crop(), so frames arrive already cut to the ROI.
+	The crop only moves when the window leaves it, and the frames right
+	after a change are skipped because they may still carry the old crop.
+*/
+class PupilTracker{
+public:
+	PupilTracker(PupilDetector *detector, const track_params& params = track_params());
+
+	// detect in frame; positions are in full sensor coordinates //
+	pupil track(const luma_frame& frame);
+
+	void reset();
+	void use_sensor_crop(Picam *cam);
+
+	bool tracking() const { return locked; }
+	const pupil_roi& roi() const { return window; }
+	track_stats stats() const { return st; }
+private:
+	struct kalman{
+		float x, v;
+		float p00, p01, p11;
+
+		void init(float pos);
+		void predict(float q);
+		void update(float z, float r);
+	};
+
+	void predict_window(unsigned int width, unsigned int height);
+	void update_crop();
+
+	PupilDetector *detector;
+	track_params prm;
+
+	kalman kx, ky;
+	float radius;
+	bool locked;
+	unsigned int misses;
+	pupil_roi window;
+
+	Picam *cam;
+	struct v4l2_rect crop;		// sensor crop the current frames were taken with
+	struct v4l2_rect full;		// crop bounds, i.e. the uncropped frame
+	unsigned int settle;
+
+	track_stats st;
+};
+
+#endif
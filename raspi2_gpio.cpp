@@ -0,0 +1,179 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include <stdexcept>
+
+#include "raspi2_gpio.h"
+
+using namespace std;
+
+Raspi2Gpio::Raspi2Gpio(unsigned int pin) :
+	pin(pin), have_seq(false), next_seq(0)
+{
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/raspi2GPIO%u", pin);
+	device = path;
+
+	fd = open(path, O_RDWR);
+	if(-1 == fd)
+		throw runtime_error(device + " : cannot open! ");
+}
+
+Raspi2Gpio::~Raspi2Gpio()
+{
+	close(fd);
+}
+
+void Raspi2Gpio::command(unsigned long request, void *arg, const char *what)
+{
+	// no EINTR retry, repeating an interrupted PULSE would flash twice //
+	if(-1 == ioctl(fd, request, arg)){
+		n_errors.add();
+		throw runtime_error(device + " : " + what + " failed, " + strerror(errno));
+	}
+}
+
+void Raspi2Gpio::set_output()
+{
+	__u32 dir = RASPI2_GPIO_DIR_OUT;
+
+	command(RASPI2_GPIO_SET_DIR, &dir, "set output");
+}
+
+void Raspi2Gpio::set_input()
+{
+	__u32 dir = RASPI2_GPIO_DIR_IN;
+
+	command(RASPI2_GPIO_SET_DIR, &dir, "set input");
+}
+
+void Raspi2Gpio::write(bool value)
+{
+	__u32 v = value;
+	uint64_t t = monotonic_ns();
+
+	command(RASPI2_GPIO_SET_VALUE, &v, "write");
+	write_time.record(monotonic_ns() - t);
+	n_writes.add();
+}
+
+bool Raspi2Gpio::read()
+{
+	__u32 v = 0;
+
+	command(RASPI2_GPIO_GET_VALUE, &v, "read");
+	return v != 0;
+}
+
+void Raspi2Gpio::pulse(bool value, unsigned int width_us, unsigned int delay_us)
+{
+	struct raspi2_gpio_pulse p;
+
+	memset(&p, 0, sizeof(p));
+	p.level = value;
+	p.width_us = width_us;
+	p.delay_us = delay_us;
+	command(RASPI2_GPIO_PULSE, &p, "pulse");
+	n_pulses.add();
+}
+
+void Raspi2Gpio::start_pulse(bool value, unsigned int width_us, unsigned int delay_us)
+{
+	struct raspi2_gpio_pulse p;
+
+	memset(&p, 0, sizeof(p));
+	p.level = value;
+	p.width_us = width_us;
+	p.delay_us = delay_us;
+	command(RASPI2_GPIO_PULSE_START, &p, "start pulse");
+	n_pulses.add();
+}
+
+raspi2_gpio_pulse_status Raspi2Gpio::pulse_status()
+{
+	struct raspi2_gpio_pulse_status st;
+
+	memset(&st, 0, sizeof(st));
+	command(RASPI2_GPIO_PULSE_STATUS, &st, "pulse status");
+	return st;
+}
+
+void Raspi2Gpio::set_edge(unsigned int edges)
+{
+	__u32 e = edges;
+
+	command(RASPI2_GPIO_SET_EDGE, &e, "set edge");
+}
+
+void Raspi2Gpio::set_debounce(unsigned int us)
+{
+	__u32 v = us;
+
+	command(RASPI2_GPIO_SET_DEBOUNCE, &v, "set debounce");
+}
+
+void Raspi2Gpio::flush_events()
+{
+	command(RASPI2_GPIO_FLUSH_EVENTS, NULL, "flush events");
+	have_seq = false;
+}
+
+bool Raspi2Gpio::read_event(raspi2_gpio_event *ev, int timeout_ms)
+{
+	struct pollfd pfd;
+	ssize_t n;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	do r = poll(&pfd, 1, timeout_ms);
+	while(-1 == r && EINTR == errno);
+
+	if(-1 == r)
+		throw runtime_error(device + " : poll failed");
+	if(0 == r)
+		return false;
+
+	// poll said an event is queued, this read does not block //
+	n = ::read(fd, ev, sizeof(*ev));
+	if(n != (ssize_t)sizeof(*ev))
+		throw runtime_error(device + " : event read failed");
+
+	if(have_seq && ev->seq != next_seq)
+		n_lost.add(ev->seq - next_seq);
+	have_seq = true;
+	next_seq = ev->seq + 1;
+	n_events.add();
+
+	return true;
+}
+
+void Raspi2Gpio::write_mask(uint32_t mask, uint32_t values)
+{
+	struct raspi2_gpio_mask m;
+
+	m.mask = mask;
+	m.values = values;
+	command(RASPI2_GPIO_SET_MASK, &m, "write mask");
+	n_writes.add();
+}
+
+void Raspi2Gpio::register_metrics(MetricsRegistry *reg, const string& prefix) const
+{
+	string p = prefix.empty() ? "gpio" + to_string(pin) : prefix;
+
+	reg->add(p + ".writes", &n_writes);
+	reg->add(p + ".pulses", &n_pulses);
+	reg->add(p + ".events", &n_events);
+	reg->add(p + ".lost_events", &n_lost);
+	reg->add(p + ".errors", &n_errors);
+	reg->add(p + ".write_ns", &write_time);
+}
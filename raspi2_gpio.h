@@ -0,0 +1,72 @@
+#ifndef RASPI2_GPIO_H
+#define RASPI2_GPIO_H
+
+#include <stdint.h>
+#include <string>
+
+#include "raspi2_gpio_ioctl.h"
+#include "metrics.h"
+
+/*
+	Raspi2Gpio - one /dev/raspi2GPIO<pin> node of the raspi2_gpio driver
+	Uses the binary ioctl commands of raspi2_gpio_ioctl.h, one syscall and
+	no string parsing per call.
+*/
+class Raspi2Gpio{
+public:
+	Raspi2Gpio(unsigned int pin);
+	~Raspi2Gpio();
+
+	void set_output();
+	void set_input();
+	void write(bool value);
+	bool read();
+	// drive value for width_us, then the opposite level, blocks meanwhile //
+	void pulse(bool value, unsigned int width_us, unsigned int delay_us = 0);
+	// same, timed by the driver while the caller goes on, throws if one is pending //
+	void start_pulse(bool value, unsigned int width_us, unsigned int delay_us = 0);
+	// last completed pulse, file_descriptor() polls POLLPRI until this is read //
+	raspi2_gpio_pulse_status pulse_status();
+
+	// RASPI2_GPIO_EDGE_* to report, makes the pin an input, 0 turns events off //
+	void set_edge(unsigned int edges);
+	void set_debounce(unsigned int us);
+	void flush_events();
+	/*
+		next edge, waiting at most timeout_ms (-1 forever, 0 not at all);
+		false on timeout. file_descriptor() polls POLLIN while one is queued.
+	*/
+	bool read_event(raspi2_gpio_event *ev, int timeout_ms = -1);
+	// set every output pin selected in mask (bit n is GPIO n) at once //
+	void write_mask(uint32_t mask, uint32_t values);
+
+	/*
+		"<prefix>.": writes, pulses, events, lost_events (gaps in the
+		event sequence), errors and write_ns, the SET_VALUE ioctl time.
+		Defaults to gpio<pin>.
+	*/
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "") const;
+
+	unsigned int pin_number() const { return pin; }
+	int file_descriptor() const { return fd; }
+private:
+	Raspi2Gpio(const Raspi2Gpio&);
+	Raspi2Gpio& operator=(const Raspi2Gpio&);
+
+	void command(unsigned long request, void *arg, const char *what);
+
+	unsigned int pin;
+	std::string device;
+	int fd;
+
+	bool have_seq;
+	uint32_t next_seq;
+	MetricCounter n_writes;
+	MetricCounter n_pulses;
+	MetricCounter n_events;
+	MetricCounter n_lost;
+	MetricCounter n_errors;
+	MetricHistogram write_time;
+};
+
+#endif
@@ -7,15 +7,25 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <linux/gpio.h>
 #include <linux/errno.h>
 #include <uapi/asm-generic/errno-base.h>
 #include <linux/string.h>
-#include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/interrupt.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/moduleparam.h>
+#include <linux/gpio/consumer.h>
+
+#include "raspi2_gpio_ioctl.h"
 
 // User-defined macros //
 #define NUM_GPIO_PINS		26
@@ -23,10 +33,15 @@
 #define DEVICE_NAME 		"raspi2_gpio"
 #define BUF_SIZE			512
 #define INTERRUPT_DEVICE_NAME "gpio interrupt"
+#define EVENT_FIFO_SIZE		64		// power of two
+
+#define gpio_dbg(fmt, ...) \
+	do{ if(debug) printk(KERN_DEBUG DEVICE_NAME " : " fmt, ##__VA_ARGS__); }while(0)
 
 // User-defined data types //
 enum state {low, high};
 enum direction {in, out};
+enum pulse_phase {pulse_idle, pulse_delay, pulse_width};
 
 /*
 	struct raspi2_gpio_dev - Per gpio pin data structure
@@ -36,7 +51,20 @@ enum direction {in, out};
 	@ dir : direction of GPIO pin
 	@ irq_prem : used to enable/disable interrupt on GPIO pin
 	@ irq_flag : used to indicate rising/falling dege trigger
-	@ lock : used to protect atomic code section
+	@ irq_on : the interrupt is currently requested
+	@ n_open : open file count, the interrupt is freed with the last one
+	@ lock : serialises direction and irq changes, may sleep since
+	  gpio chips behind i2c/spi (and gpio-sim) cannot be driven atomically
+	@ gpio : legacy GPIO number of the pin
+	@ cansleep : the chip sleeps, pulse edges go through pulse_work
+	@ pulse_timer : fires at each edge of a timed pulse
+	@ pulse_lock : protects the pulse fields against the timer
+	@ pulse_wait : woken when a pulse completes
+	@ events : edge events, filled by the irq handler, drained by read
+	@ event_wait : woken when an event is queued
+	@ async : SIGIO subscribers
+	@ debounce_ns : edges closer than this to the last accepted one are dropped
+	@ irq_ns : timestamp taken in the hard irq for the threaded half
 */
 
 struct raspi2_gpio_dev{
@@ -46,8 +74,31 @@ struct raspi2_gpio_dev{
 	enum direction dir;
 	bool irq_perm;
 	unsigned long irq_flag;
-	unsigned int irq_counter;
-	spinlock_t lock;
+	bool irq_on;
+	unsigned int n_open;
+	struct mutex lock;
+	unsigned int gpio;
+	bool cansleep;
+
+	struct hrtimer pulse_timer;
+	struct work_struct pulse_work;
+	spinlock_t pulse_lock;
+	wait_queue_head_t pulse_wait;
+	enum pulse_phase pulse_phase;
+	u32 pulse_level;
+	u32 pulse_width_us;
+	u32 pulse_count;
+	u64 pulse_start_ns;
+	u64 pulse_end_ns;
+	bool pulse_unread;
+
+	DECLARE_KFIFO(events, struct raspi2_gpio_event, EVENT_FIFO_SIZE);
+	wait_queue_head_t event_wait;
+	struct fasync_struct *async;
+	u64 debounce_ns;
+	u64 last_edge_ns;
+	u64 irq_ns;
+	u32 event_seq;
 };
 
 // Foward declaration of functions //
@@ -59,6 +110,9 @@ static int raspi2_gpio_open(struct inode *inode, struct file *filp);
 static ssize_t raspi2_gpio_read( struct file *filp, char *buf, size_t count, loff_t *f_pos);
 static ssize_t raspi2_gpio_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos);
 static int raspi2_gpio_release(struct inode *inode, struct file *filp);
+static long raspi2_gpio_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static unsigned int raspi2_gpio_poll(struct file *filp, poll_table *wait);
+static int raspi2_gpio_fasync(int fd, struct file *filp, int on);
 
 // File Operation Structure //
 static struct file_operations raspi2_gpio_fops = {
@@ -67,86 +121,208 @@ static struct file_operations raspi2_gpio_fops = {
 	.release = raspi2_gpio_release,
 	.read = raspi2_gpio_read,
 	.write = raspi2_gpio_write,
+	.unlocked_ioctl = raspi2_gpio_ioctl,
+	.compat_ioctl = raspi2_gpio_ioctl,
+	.poll = raspi2_gpio_poll,
+	.fasync = raspi2_gpio_fasync,
 };
 
 // Global varibles for GPIO driver //
 struct raspi2_gpio_dev *raspi2_gpio_devp[NUM_GPIO_PINS];
 static dev_t first;
 static struct class *raspi2_gpio_class;
-static unsigned int last_interrupt_time = 0;
-static uint64_t epochMilli;
+static DEFINE_MUTEX(mask_lock);
+
+// Module parameters //
+static bool debug;
+module_param(debug, bool, 0644);
+MODULE_PARM_DESC(debug, "log every request and state change");
+
+// legacy number of GPIO 0, 512 on gpio-sim and on recent Raspberry Pi kernels //
+static unsigned int gpio_base;
+module_param(gpio_base, uint, 0444);
+MODULE_PARM_DESC(gpio_base, "legacy GPIO number of pin 0");
+
+// the old driver ignored edges within 200 ms of each other on all pins //
+static unsigned int debounce_us = 200000;
+module_param(debounce_us, uint, 0644);
+MODULE_PARM_DESC(debounce_us, "initial debounce of every pin, RASPI2_GPIO_SET_DEBOUNCE changes one");
 
 // Utils Function //
-unsigned int millis(void){
-	struct timeval timeval;
-	uint64_t timeNow;
+static unsigned int pin_gpio(unsigned int minor){
+	return gpio_base + minor;
+}
 
-	do_gettimeofday(&timeval);
-	timeNow = (uint64_t)timeval.tv_sec * (uint64_t)1000 + (uint64_t)(timeval.tv_usec/1000);
+/*
+	queue_edge - record one edge, runs in the irq handler or its thread
+	Debounce is per pin. A full fifo drops the event but still consumes a
+	sequence number, so the reader sees the gap.
+*/
+static void queue_edge(struct raspi2_gpio_dev *dev, u64 ts, u32 edge){
+	struct raspi2_gpio_event ev;
 
-	return (uint32_t)(timeNow - epochMilli);
+	if(dev->debounce_ns && dev->event_seq && ts - dev->last_edge_ns < dev->debounce_ns){
+		gpio_dbg("Ignored edge on GPIO %d\n", dev->gpio);
+		return;
+	}
+	dev->last_edge_ns = ts;
+
+	ev.timestamp_ns = ts;
+	ev.edge = edge;
+	ev.seq = dev->event_seq++;
+	if(!kfifo_put(&dev->events, ev))
+		gpio_dbg("GPIO %d event fifo full\n", dev->gpio);
+
+	wake_up_interruptible(&dev->event_wait);
+	kill_fasync(&dev->async, SIGIO, POLL_IN);
+}
+
+// edge from the trigger, the level is only needed with both edges enabled //
+static u32 edge_of(struct raspi2_gpio_dev *dev, int level){
+	if((dev->irq_flag & IRQF_TRIGGER_MASK) == IRQF_TRIGGER_RISING)
+		return RASPI2_GPIO_EDGE_RISING;
+	if((dev->irq_flag & IRQF_TRIGGER_MASK) == IRQF_TRIGGER_FALLING)
+		return RASPI2_GPIO_EDGE_FALLING;
+	return level ? RASPI2_GPIO_EDGE_RISING : RASPI2_GPIO_EDGE_FALLING;
 }
 
 static irqreturn_t irq_handler(int irq, void *arg){
-	unsigned long flags;
-	unsigned int interrupt_time = millis();
+	struct raspi2_gpio_dev *dev = arg;
+	u64 ts = ktime_get_ns();
 
-	if(interrupt_time - last_interrupt_time < 200){
-		printk(KERN_NOTICE "Ignored Interrupt [%d]\n", irq);
-		return IRQ_HANDLED;
+	// the level of a sleeping chip can only be read from the thread //
+	if(dev->cansleep){
+		dev->irq_ns = ts;
+		return IRQ_WAKE_THREAD;
 	}
-	last_interrupt_time = interrupt_time;
-	local_irq_save(flags);
-	printk(KERN_NOTICE "Interrupt [%d] was triggered\n", irq);
-	local_irq_restore(flags);
 
+	queue_edge(dev, ts, edge_of(dev, gpio_get_value(dev->gpio)));
 	return IRQ_HANDLED;
 }
+
+static irqreturn_t irq_thread(int irq, void *arg){
+	struct raspi2_gpio_dev *dev = arg;
+
+	queue_edge(dev, dev->irq_ns, edge_of(dev, gpio_get_value_cansleep(dev->gpio)));
+	return IRQ_HANDLED;
+}
+
+// request or free the pin interrupt to match irq_perm, called with lock held //
+static int update_irq(struct raspi2_gpio_dev *dev){
+	int err, irq = gpio_to_irq(dev->gpio);
+	bool want = dev->irq_perm && dev->dir == in && dev->n_open > 0;
+
+	if(dev->irq_on){
+		free_irq(irq, dev);
+		dev->irq_on = false;
+		gpio_dbg("interrupt on gpio[%d] released\n", dev->gpio);
+	}
+	if(!want)
+		return 0;
+
+	if(dev->cansleep)
+		err = request_threaded_irq(irq, irq_handler, irq_thread, IRQF_ONESHOT | dev->irq_flag,
+				INTERRUPT_DEVICE_NAME, dev);
+	else
+		err = request_irq(irq, irq_handler, IRQF_SHARED | dev->irq_flag, INTERRUPT_DEVICE_NAME, dev);
+	if(err != 0){
+		printk(KERN_ERR "unable to claim irq : %d, error %d\n", irq, err);
+		return err;
+	}
+
+	dev->irq_on = true;
+	gpio_dbg("interrupt requested\n");
+	return 0;
+}
+
+// set the edges reported by read and poll, 0 turns them off //
+static int set_edges(struct raspi2_gpio_dev *dev, u32 edges){
+	int err;
+
+	if(edges & ~(u32)RASPI2_GPIO_EDGE_BOTH)
+		return -EINVAL;
+
+	mutex_lock(&dev->lock);
+	if(edges){
+		gpio_direction_input(dev->gpio);
+		dev->dir = in;
+		dev->irq_perm = true;
+		dev->irq_flag = ((edges & RASPI2_GPIO_EDGE_RISING) ? IRQF_TRIGGER_RISING : 0) |
+				((edges & RASPI2_GPIO_EDGE_FALLING) ? IRQF_TRIGGER_FALLING : 0);
+	}else{
+		dev->irq_perm = false;
+	}
+	err = update_irq(dev);
+	mutex_unlock(&dev->lock);
+
+	// readers blocked on a pin that no longer reports edges return 0 //
+	wake_up_interruptible(&dev->event_wait);
+	return err;
+}
+
 // File Operations Function //
 static int raspi2_gpio_open(struct inode *inode, struct file *filp)
 {
 	struct raspi2_gpio_dev *raspi2_gpio_devp;
 	unsigned int gpio;
-	int err, irq;
-	unsigned long flags;
+	int err = 0;
 
-	gpio = iminor(inode);
-	printk(KERN_INFO "GPIO[%d] opened\n", gpio);
+	gpio = pin_gpio(iminor(inode));
+	gpio_dbg("GPIO[%d] opened\n", gpio);
 	raspi2_gpio_devp = container_of(inode->i_cdev, struct raspi2_gpio_dev, cdev);
 
-	if((raspi2_gpio_devp->irq_perm == true) && (raspi2_gpio_devp->dir == in)){
-		if((raspi2_gpio_devp->irq_counter++ == 0)){
-			irq = gpio_to_irq(gpio);
-			if(raspi2_gpio_devp->irq_flag == IRQF_TRIGGER_RISING){
-				spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
-				err = request_irq( irq, irq_handler, IRQF_SHARED | IRQF_TRIGGER_RISING, INTERRUPT_DEVICE_NAME, raspi2_gpio_devp);
-				printk(KERN_INFO "interrupt requested\n");
-				spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
-			}else{
-				spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
-				err = request_irq(irq, irq_handler, IRQF_SHARED | IRQF_TRIGGER_FALLING, INTERRUPT_DEVICE_NAME, raspi2_gpio_devp);
-				printk(KERN_INFO "interrupt requested\n");
-				spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
-			}
+	mutex_lock(&raspi2_gpio_devp->lock);
+	if(raspi2_gpio_devp->n_open++ == 0 && raspi2_gpio_devp->irq_perm)
+		err = update_irq(raspi2_gpio_devp);
+	if(err)
+		raspi2_gpio_devp->n_open--;
+	mutex_unlock(&raspi2_gpio_devp->lock);
+
+	if(err)
+		return err;
 
-			if(err != 0){
-				printk(KERN_ERR "unable to claim irq : %d, error %d\n", irq, err);
-				return err;
-			}
-		}
-	}
 	filp->private_data = raspi2_gpio_devp;
 	return 0;
 }
+/*
+	raspi2_gpio_read - with edges enabled, whole struct raspi2_gpio_event
+	records, blocking unless O_NONBLOCK. Otherwise one '0'/'1' level
+	character per byte as before.
+*/
 static ssize_t raspi2_gpio_read(struct file *filp, char *buf, size_t count, loff_t *f_pos)
 {
-	unsigned int gpio;
+	struct raspi2_gpio_dev *raspi2_gpio_devp = filp->private_data;
+	unsigned int gpio, copied;
 	ssize_t retval;
 	char byte;
+	int err;
+
+	gpio = pin_gpio(iminor(file_inode(filp)));
+
+	while(READ_ONCE(raspi2_gpio_devp->irq_perm)){
+		if(count < sizeof(struct raspi2_gpio_event))
+			return -EINVAL;
+
+		if(mutex_lock_interruptible(&raspi2_gpio_devp->lock))
+			return -ERESTARTSYS;
+		err = kfifo_to_user(&raspi2_gpio_devp->events, buf, count, &copied);
+		mutex_unlock(&raspi2_gpio_devp->lock);
+
+		if(err)
+			return err;
+		if(copied)
+			return copied;
+		if(filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if(wait_event_interruptible(raspi2_gpio_devp->event_wait,
+				!kfifo_is_empty(&raspi2_gpio_devp->events) || !READ_ONCE(raspi2_gpio_devp->irq_perm)))
+			return -ERESTARTSYS;
+		if(!READ_ONCE(raspi2_gpio_devp->irq_perm))
+			return 0;
+	}
 
-	gpio = iminor(filp->f_path.dentry->d_inode);
 	for (retval = 0; retval < count; ++retval){
-		byte = '0' + gpio_get_value(gpio);
+		byte = '0' + gpio_get_value_cansleep(gpio);
 		if(put_user(byte, buf+retval))
 			break;
 	}
@@ -155,72 +331,65 @@ static ssize_t raspi2_gpio_read(struct file *filp, char *buf, size_t count, loff
 static ssize_t raspi2_gpio_write(struct file *filp, const char *buf, size_t count, loff_t *f_pos)
 {
 	unsigned int gpio, len = 0, value = 0; 
+	int err;
 	char kbuf[BUF_SIZE];
 	struct raspi2_gpio_dev *raspi2_gpio_devp = filp->private_data;
-	unsigned long flags;
 
-	gpio = iminor(filp->f_path.dentry->d_inode);
+	gpio = pin_gpio(iminor(file_inode(filp)));
 	len = count < BUF_SIZE ? count -1 : BUF_SIZE-1;
 	if(copy_from_user(kbuf, buf, len) != 0)
 		return -EFAULT;
 	kbuf[len] = '\0';
 
-	printk(KERN_INFO "Request from user : %s\n", kbuf);
+	gpio_dbg("Request from user : %s\n", kbuf);
 
 	if(strcmp(kbuf, "out") == 0){
-		printk(KERN_ALERT "gpio[%d] direction set to output\n", gpio);
+		gpio_dbg("gpio[%d] direction set to output\n", gpio);
 		if(raspi2_gpio_devp->dir != out){
-			spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
+			mutex_lock(&raspi2_gpio_devp->lock);
 			gpio_direction_output(gpio, low);
 			raspi2_gpio_devp->dir = out;
 			raspi2_gpio_devp->state = low;
-			spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
+			mutex_unlock(&raspi2_gpio_devp->lock);
 		}
 	}else if(strcmp(kbuf, "in") == 0){
 		if(raspi2_gpio_devp->dir != in){
-			printk(KERN_INFO "Set gpio[%d] direction : input \n", gpio);
-			spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
+			gpio_dbg("Set gpio[%d] direction : input \n", gpio);
+			mutex_lock(&raspi2_gpio_devp->lock);
 			gpio_direction_input(gpio);
 			raspi2_gpio_devp->dir = in;
-			spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
+			mutex_unlock(&raspi2_gpio_devp->lock);
 		}
 	}else if((strcmp(kbuf, "1") == 0) || (strcmp(kbuf,"0") == 0)){
 		sscanf(kbuf, "%d", &value);
 		if(raspi2_gpio_devp->dir == in){
-			printk("Cannot set GPIO %d, direction : input\n", gpio);
+			gpio_dbg("Cannot set GPIO %d, direction : input\n", gpio);
 			return -EPERM;
 		}else if(raspi2_gpio_devp->dir == out){
 			if(value > 0){
-				spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
-				gpio_set_value(gpio, high);
+				mutex_lock(&raspi2_gpio_devp->lock);
+				gpio_set_value_cansleep(gpio, high);
 				raspi2_gpio_devp->state = high;
-				printk("GPIO %d, state : high\n", gpio);
-				spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
+				gpio_dbg("GPIO %d, state : high\n", gpio);
+				mutex_unlock(&raspi2_gpio_devp->lock);
 			}else{
-				spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
-				gpio_set_value(gpio, low);
+				mutex_lock(&raspi2_gpio_devp->lock);
+				gpio_set_value_cansleep(gpio, low);
 				raspi2_gpio_devp->state = low;
-				printk("GPIO %d, state : low\n", gpio);
-				spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
+				gpio_dbg("GPIO %d, state : low\n", gpio);
+				mutex_unlock(&raspi2_gpio_devp->lock);
 			}
 		}
 		
 	}else if((strcmp(kbuf, "rising") == 0) || (strcmp(kbuf, "falling") == 0)){
-		spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
-		gpio_direction_input(gpio);
-		raspi2_gpio_devp -> dir = in;
-		raspi2_gpio_devp -> irq_perm = true;
-		if(strcmp(kbuf, "rising") == 0)
-			raspi2_gpio_devp->irq_flag = IRQF_TRIGGER_RISING;
-		else
-			raspi2_gpio_devp->irq_flag = IRQF_TRIGGER_FALLING;
-		spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
+		err = set_edges(raspi2_gpio_devp, strcmp(kbuf, "rising") == 0 ?
+				RASPI2_GPIO_EDGE_RISING : RASPI2_GPIO_EDGE_FALLING);
+		if(err)
+			return err;
 	}else if(strcmp(kbuf, "disable-irq") == 0){
-		spin_lock_irqsave(&raspi2_gpio_devp->lock, flags);
-		raspi2_gpio_devp->irq_perm = false;
-		spin_unlock_irqrestore(&raspi2_gpio_devp->lock, flags);
+		set_edges(raspi2_gpio_devp, 0);
 	}else{
-		printk(KERN_ERR "Invalid Value\n");
+		gpio_dbg("Invalid Value\n");
 		return -EINVAL;
 	}
 	*f_pos += count;
@@ -232,61 +401,340 @@ static int raspi2_gpio_release(struct inode *inode, struct file *filp)
 	struct raspi2_gpio_dev *raspi2_gpio_devp;
 	raspi2_gpio_devp = container_of(inode->i_cdev, struct raspi2_gpio_dev, cdev);
 
-	gpio = iminor(inode);
+	gpio = pin_gpio(iminor(inode));
 
-	printk(KERN_INFO "Closing GPIO %d\n", gpio);
+	gpio_dbg("Closing GPIO %d\n", gpio);
 
-	spin_lock(&raspi2_gpio_devp->lock);
-	if(raspi2_gpio_devp->irq_perm == true){
-		if(raspi2_gpio_devp->irq_counter > 0){
-			raspi2_gpio_devp->irq_counter--;
-			if(raspi2_gpio_devp->irq_counter == 0){
-				printk(KERN_INFO "interrupt on gpio[%d] released\n", gpio);
-				free_irq(gpio_to_irq(gpio), raspi2_gpio_devp);
-			}
-		}
+	raspi2_gpio_fasync(-1, filp, 0);
+
+	mutex_lock(&raspi2_gpio_devp->lock);
+	if(--raspi2_gpio_devp->n_open == 0 && raspi2_gpio_devp->irq_on)
+		update_irq(raspi2_gpio_devp);
+	mutex_unlock(&raspi2_gpio_devp->lock);
+	
+	return 0;
+}
+
+static int raspi2_gpio_fasync(int fd, struct file *filp, int on)
+{
+	struct raspi2_gpio_dev *raspi2_gpio_devp = filp->private_data;
+
+	return fasync_helper(fd, filp, on, &raspi2_gpio_devp->async);
+}
+
+/*
+	Timed pulses - an hrtimer fires at both edges. The second edge is armed
+	from the measured time of the first, so width is exact up to timer
+	latency whatever the caller is doing. Chips that sleep (gpio-sim, i2c
+	expanders) cannot be driven from the timer, their edges run on a high
+	priority work item instead.
+*/
+static void pulse_set(struct raspi2_gpio_dev *dev, int value)
+{
+	if(dev->cansleep)
+		gpio_set_value_cansleep(dev->gpio, value);
+	else
+		gpio_set_value(dev->gpio, value);
+	dev->state = value ? high : low;
+}
+
+// one edge, returns the expiry of the next one or 0 when the pulse is done //
+static u64 pulse_edge(struct raspi2_gpio_dev *dev)
+{
+	unsigned long flags;
+	u64 now;
+
+	if(dev->pulse_phase == pulse_delay){
+		pulse_set(dev, dev->pulse_level);
+		now = ktime_get_ns();
+		dev->pulse_start_ns = now;
+		dev->pulse_phase = pulse_width;
+		return now + (u64)dev->pulse_width_us * NSEC_PER_USEC;
 	}
-	spin_unlock(&raspi2_gpio_devp->lock);
-
-	if(raspi2_gpio_devp->irq_perm == false && raspi2_gpio_devp->irq_counter > 0){
-			spin_lock(&raspi2_gpio_devp->lock);
-			free_irq(gpio_to_irq(gpio), raspi2_gpio_devp);
-			raspi2_gpio_devp->irq_counter = 0;
-			spin_unlock(&raspi2_gpio_devp->lock);
-			printk(KERN_INFO "interrupt on gpio[%d] disabled\n", gpio);
+
+	pulse_set(dev, !dev->pulse_level);
+	now = ktime_get_ns();
+
+	spin_lock_irqsave(&dev->pulse_lock, flags);
+	dev->pulse_end_ns = now;
+	dev->pulse_count++;
+	dev->pulse_unread = true;
+	dev->pulse_phase = pulse_idle;
+	spin_unlock_irqrestore(&dev->pulse_lock, flags);
+
+	wake_up_interruptible(&dev->pulse_wait);
+	return 0;
+}
+
+static enum hrtimer_restart pulse_timer_fn(struct hrtimer *timer)
+{
+	struct raspi2_gpio_dev *dev = container_of(timer, struct raspi2_gpio_dev, pulse_timer);
+	u64 next;
+
+	if(dev->cansleep){
+		queue_work(system_highpri_wq, &dev->pulse_work);
+		return HRTIMER_NORESTART;
 	}
-	
+
+	next = pulse_edge(dev);
+	if(!next)
+		return HRTIMER_NORESTART;
+
+	hrtimer_set_expires(timer, ns_to_ktime(next));
+	return HRTIMER_RESTART;
+}
+
+static void pulse_work_fn(struct work_struct *work)
+{
+	struct raspi2_gpio_dev *dev = container_of(work, struct raspi2_gpio_dev, pulse_work);
+	u64 next;
+
+	next = pulse_edge(dev);
+	if(next)
+		hrtimer_start(&dev->pulse_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+}
+
+static int raspi2_gpio_pulse_start(struct raspi2_gpio_dev *dev, const struct raspi2_gpio_pulse *pulse)
+{
+	unsigned long flags;
+	u64 next;
+
+	if(pulse->width_us == 0 || pulse->width_us > RASPI2_GPIO_MAX_PULSE_US ||
+			pulse->delay_us > RASPI2_GPIO_MAX_DELAY_US)
+		return -EINVAL;
+	if(dev->dir != out)
+		return -EPERM;
+
+	spin_lock_irqsave(&dev->pulse_lock, flags);
+	if(dev->pulse_phase != pulse_idle){
+		spin_unlock_irqrestore(&dev->pulse_lock, flags);
+		return -EBUSY;
+	}
+	dev->pulse_phase = pulse_delay;
+	dev->pulse_level = !!pulse->level;
+	dev->pulse_width_us = pulse->width_us;
+	spin_unlock_irqrestore(&dev->pulse_lock, flags);
+
+	// no delay, take the first edge right here instead of a timer round trip //
+	if(pulse->delay_us == 0)
+		next = pulse_edge(dev);
+	else
+		next = ktime_get_ns() + (u64)pulse->delay_us * NSEC_PER_USEC;
+
+	hrtimer_start(&dev->pulse_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+	gpio_dbg("GPIO %d, %u us pulse in %u us\n", dev->gpio, pulse->width_us, pulse->delay_us);
 	return 0;
 }
 
+static void raspi2_gpio_pulse_status(struct raspi2_gpio_dev *dev, struct raspi2_gpio_pulse_status *st)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->pulse_lock, flags);
+	st->busy = dev->pulse_phase != pulse_idle;
+	st->count = dev->pulse_count;
+	st->start_ns = dev->pulse_start_ns;
+	st->end_ns = dev->pulse_end_ns;
+	dev->pulse_unread = false;
+	spin_unlock_irqrestore(&dev->pulse_lock, flags);
+}
+
+static unsigned int raspi2_gpio_poll(struct file *filp, poll_table *wait)
+{
+	struct raspi2_gpio_dev *dev = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &dev->pulse_wait, wait);
+	poll_wait(filp, &dev->event_wait, wait);
+
+	if(READ_ONCE(dev->pulse_unread))
+		mask |= POLLPRI;
+	if(!kfifo_is_empty(&dev->events))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+/*
+	raspi2_gpio_set_mask - drive every pin selected in mask in one gpiolib call,
+	which the chip applies at once when it implements set_multiple (gpio-sim,
+	and the BCM2835 GPSET/GPCLR registers). mask_lock keeps two callers from
+	interleaving their halves.
+*/
+static int raspi2_gpio_set_mask(u32 mask, u32 values)
+{
+	struct gpio_desc *descs[NUM_GPIO_PINS];
+	unsigned long bitmap = 0;
+	unsigned int i, n = 0;
+	int err = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+	int levels[NUM_GPIO_PINS];
+#endif
+
+	if(mask & ~(u32)(((1UL << MAX_GPIO_NUMBER) - 1) & ~3UL))
+		return -EINVAL;
+
+	for(i = 2; i < MAX_GPIO_NUMBER; i++){
+		if(!(mask & (1U << i)))
+			continue;
+		if(raspi2_gpio_devp[i - 2]->dir != out)
+			return -EPERM;
+		descs[n] = gpio_to_desc(pin_gpio(i));
+		if(values & (1U << i))
+			bitmap |= 1UL << n;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+		levels[n] = !!(values & (1U << i));
+#endif
+		n++;
+	}
+	if(n == 0)
+		return 0;
+
+	mutex_lock(&mask_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+	err = gpiod_set_raw_array_value_cansleep(n, descs, NULL, &bitmap);
+#else
+	gpiod_set_raw_array_value_cansleep(n, descs, levels);
+#endif
+	mutex_unlock(&mask_lock);
+
+	for(i = 2; !err && i < MAX_GPIO_NUMBER; i++)
+		if(mask & (1U << i))
+			raspi2_gpio_devp[i - 2]->state = (values & (1U << i)) ? high : low;
+
+	gpio_dbg("mask 0x%08x set to 0x%08x\n", mask, values & mask);
+	return err;
+}
+
+/*
+	raspi2_gpio_ioctl - binary fast path of raspi2_gpio_write
+	Set value and pulse take no lock, a single pin write is atomic on the
+	chip and state is only informational.
+*/
+static long raspi2_gpio_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct raspi2_gpio_dev *raspi2_gpio_devp = filp->private_data;
+	void __user *argp = (void __user *)arg;
+	struct raspi2_gpio_mask mask;
+	struct raspi2_gpio_pulse pulse;
+	struct raspi2_gpio_pulse_status status;
+	unsigned int gpio;
+	u32 value;
+	int err;
+
+	if(_IOC_TYPE(cmd) != RASPI2_GPIO_MAGIC)
+		return -ENOTTY;
+
+	gpio = pin_gpio(iminor(file_inode(filp)));
+
+	switch(cmd){
+	case RASPI2_GPIO_SET_VALUE:
+		if(get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		if(raspi2_gpio_devp->dir != out)
+			return -EPERM;
+		gpio_set_value_cansleep(gpio, value ? high : low);
+		raspi2_gpio_devp->state = value ? high : low;
+		gpio_dbg("GPIO %d, state : %s\n", gpio, value ? "high" : "low");
+		return 0;
+
+	case RASPI2_GPIO_GET_VALUE:
+		value = gpio_get_value_cansleep(gpio);
+		return put_user(value, (u32 __user *)argp);
+
+	case RASPI2_GPIO_SET_DIR:
+		if(get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		if(value != RASPI2_GPIO_DIR_IN && value != RASPI2_GPIO_DIR_OUT)
+			return -EINVAL;
+		mutex_lock(&raspi2_gpio_devp->lock);
+		if(value == RASPI2_GPIO_DIR_OUT && raspi2_gpio_devp->dir != out){
+			gpio_direction_output(gpio, low);
+			raspi2_gpio_devp->dir = out;
+			raspi2_gpio_devp->state = low;
+		}else if(value == RASPI2_GPIO_DIR_IN && raspi2_gpio_devp->dir != in){
+			gpio_direction_input(gpio);
+			raspi2_gpio_devp->dir = in;
+		}
+		mutex_unlock(&raspi2_gpio_devp->lock);
+		gpio_dbg("gpio[%d] direction : %s\n", gpio, value ? "output" : "input");
+		return 0;
+
+	case RASPI2_GPIO_SET_MASK:
+		if(copy_from_user(&mask, argp, sizeof(mask)))
+			return -EFAULT;
+		return raspi2_gpio_set_mask(mask.mask, mask.values);
+
+	case RASPI2_GPIO_PULSE:
+	case RASPI2_GPIO_PULSE_START:
+		if(copy_from_user(&pulse, argp, sizeof(pulse)))
+			return -EFAULT;
+		if((err = raspi2_gpio_pulse_start(raspi2_gpio_devp, &pulse)) != 0)
+			return err;
+		if(cmd == RASPI2_GPIO_PULSE_START)
+			return 0;
+		// the pulse finishes on its own if the caller is interrupted //
+		return wait_event_interruptible(raspi2_gpio_devp->pulse_wait,
+				READ_ONCE(raspi2_gpio_devp->pulse_phase) == pulse_idle);
+
+	case RASPI2_GPIO_PULSE_STATUS:
+		raspi2_gpio_pulse_status(raspi2_gpio_devp, &status);
+		return copy_to_user(argp, &status, sizeof(status)) ? -EFAULT : 0;
+
+	case RASPI2_GPIO_SET_EDGE:
+		if(get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		return set_edges(raspi2_gpio_devp, value);
+
+	case RASPI2_GPIO_SET_DEBOUNCE:
+		if(get_user(value, (u32 __user *)argp))
+			return -EFAULT;
+		WRITE_ONCE(raspi2_gpio_devp->debounce_ns, (u64)value * NSEC_PER_USEC);
+		return 0;
+
+	case RASPI2_GPIO_FLUSH_EVENTS:
+		mutex_lock(&raspi2_gpio_devp->lock);
+		kfifo_reset_out(&raspi2_gpio_devp->events);
+		mutex_unlock(&raspi2_gpio_devp->lock);
+		return 0;
+
+	}
+
+	return -ENOTTY;
+}
+
 // Init & Exit //
 static int raspi2_gpio_init(void)
 {
 	int i, ret, index = 0;
-	struct timeval tv;
 
 	if(alloc_chrdev_region(&first, 0, NUM_GPIO_PINS, DEVICE_NAME) <0){
 		printk(KERN_DEBUG "Cannot register device\n");
 		return -1;
 	}
 
-	if((raspi2_gpio_class = class_create(THIS_MODULE, DEVICE_NAME)) == NULL){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	raspi2_gpio_class = class_create(DEVICE_NAME);
+#else
+	raspi2_gpio_class = class_create(THIS_MODULE, DEVICE_NAME);
+#endif
+	if(IS_ERR_OR_NULL(raspi2_gpio_class)){
 		printk(KERN_DEBUG "Cannot create class %s\n", DEVICE_NAME);
 		return -EINVAL;
 	}
 	
 	for(i = 0; i < MAX_GPIO_NUMBER; i++){
 		if( i != 0 && i != 1){
-			raspi2_gpio_devp[index] = kmalloc(sizeof(struct raspi2_gpio_dev), GFP_KERNEL);
+			raspi2_gpio_devp[index] = kzalloc(sizeof(struct raspi2_gpio_dev), GFP_KERNEL);
 
 			if(!raspi2_gpio_devp[index]){
 				printk("Bad kmalloc\n");
 				return -ENOMEM;
 			}
 			
-			if(gpio_request_one(i, GPIOF_OUT_INIT_LOW, NULL) < 0)
+			if(gpio_request_one(pin_gpio(i), GPIOF_OUT_INIT_LOW, NULL) < 0)
 			{
-				printk(KERN_ALERT "Error requesting GPIO %d\n", i);
+				printk(KERN_ALERT "Error requesting GPIO %d\n", pin_gpio(i));
 				return -ENODEV;
 			}
 
@@ -294,10 +742,30 @@ static int raspi2_gpio_init(void)
 			raspi2_gpio_devp[index]->state = low;
 			raspi2_gpio_devp[index]->irq_perm = false;
 			raspi2_gpio_devp[index]->irq_flag = IRQF_TRIGGER_RISING;
-			raspi2_gpio_devp[index]->irq_counter = 0;
+			raspi2_gpio_devp[index]->irq_on = false;
+			raspi2_gpio_devp[index]->n_open = 0;
 			raspi2_gpio_devp[index]->cdev.owner = THIS_MODULE;
 
-			spin_lock_init(&raspi2_gpio_devp[index]->lock);
+			mutex_init(&raspi2_gpio_devp[index]->lock);
+			raspi2_gpio_devp[index]->gpio = pin_gpio(i);
+			raspi2_gpio_devp[index]->cansleep = gpio_cansleep(pin_gpio(i));
+
+			spin_lock_init(&raspi2_gpio_devp[index]->pulse_lock);
+			init_waitqueue_head(&raspi2_gpio_devp[index]->pulse_wait);
+			INIT_WORK(&raspi2_gpio_devp[index]->pulse_work, pulse_work_fn);
+			raspi2_gpio_devp[index]->pulse_phase = pulse_idle;
+			raspi2_gpio_devp[index]->pulse_count = 0;
+			raspi2_gpio_devp[index]->pulse_unread = false;
+
+			INIT_KFIFO(raspi2_gpio_devp[index]->events);
+			init_waitqueue_head(&raspi2_gpio_devp[index]->event_wait);
+			raspi2_gpio_devp[index]->debounce_ns = (u64)debounce_us * NSEC_PER_USEC;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+			hrtimer_setup(&raspi2_gpio_devp[index]->pulse_timer, pulse_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+			hrtimer_init(&raspi2_gpio_devp[index]->pulse_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+			raspi2_gpio_devp[index]->pulse_timer.function = pulse_timer_fn;
+#endif
 
 			cdev_init(&raspi2_gpio_devp[index]->cdev, &raspi2_gpio_fops);
 
@@ -325,26 +793,30 @@ static int raspi2_gpio_init(void)
 		}
 	}
 
-	do_gettimeofday(&tv);
-	epochMilli = (uint64_t) tv.tv_sec * (uint64_t)1000 + (uint64_t)(tv.tv_usec/1000);
-	printk("RaspberryPi GPIO driver initialized\n");
+	printk(KERN_INFO "RaspberryPi GPIO driver initialized\n");
 	return 0;
 }
 
 static void raspi2_gpio_exit(void)
 {
 	int i = 0;
+	bool busy;
 	unregister_chrdev_region(first, NUM_GPIO_PINS);
 
 	for(i = 0; i < NUM_GPIO_PINS; i++){
+		// the timer may queue the work and the work restart the timer //
+		do{
+			busy = cancel_work_sync(&raspi2_gpio_devp[i]->pulse_work);
+			busy |= hrtimer_cancel(&raspi2_gpio_devp[i]->pulse_timer);
+		}while(busy);
 		kfree(raspi2_gpio_devp[i]);
 	}
 
 	for(i = 0; i < MAX_GPIO_NUMBER; i++){
 		if(i != 0 && i != 1){
-			gpio_direction_output(i, 0);
+			gpio_direction_output(pin_gpio(i), 0);
 			device_destroy(raspi2_gpio_class, MKDEV(MAJOR(first), MINOR(first)+i));
-			gpio_free(i);
+			gpio_free(pin_gpio(i));
 		}
 	}
 
@@ -0,0 +1,91 @@
+#ifndef RASPI2_GPIO_IOCTL_H
+#define RASPI2_GPIO_IOCTL_H
+
+/*
+	Binary interface of the raspi2_gpio driver, shared by the kernel module
+	and user space. Every command works on the pin of the opened node,
+	except RASPI2_GPIO_SET_MASK which takes pins by bit number.
+*/
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define RASPI2_GPIO_MAGIC		'G'
+
+#define RASPI2_GPIO_DIR_IN		0
+#define RASPI2_GPIO_DIR_OUT		1
+
+#define RASPI2_GPIO_EDGE_RISING		1
+#define RASPI2_GPIO_EDGE_FALLING	2
+#define RASPI2_GPIO_EDGE_BOTH		3
+
+#define RASPI2_GPIO_MAX_PULSE_US	1000000
+#define RASPI2_GPIO_MAX_DELAY_US	10000000
+
+/*
+	struct raspi2_gpio_mask - several output pins in one call
+	@ mask : bit n selects GPIO n
+	@ values : new level of every selected pin
+*/
+struct raspi2_gpio_mask{
+	__u32 mask;
+	__u32 values;
+};
+
+/*
+	struct raspi2_gpio_pulse - after delay_us drive level for width_us, then
+	the opposite. Both edges are timed by an hrtimer in the driver.
+	@ level : 0 or 1
+	@ width_us : pulse width, at most RASPI2_GPIO_MAX_PULSE_US
+	@ delay_us : time to the first edge, at most RASPI2_GPIO_MAX_DELAY_US
+*/
+struct raspi2_gpio_pulse{
+	__u32 level;
+	__u32 width_us;
+	__u32 delay_us;
+	__u32 reserved;
+};
+
+/*
+	struct raspi2_gpio_pulse_status - last completed pulse of the pin
+	poll() reports POLLPRI once a pulse completes, until this is read.
+	@ busy : a pulse is armed or running
+	@ count : pulses completed since the module was loaded
+	@ start_ns, end_ns : CLOCK_MONOTONIC time of its two edges
+*/
+struct raspi2_gpio_pulse_status{
+	__u32 busy;
+	__u32 count;
+	__u64 start_ns;
+	__u64 end_ns;
+};
+
+/*
+	struct raspi2_gpio_event - one input edge, what read() returns once
+	RASPI2_GPIO_SET_EDGE enabled edges on the pin
+	@ timestamp_ns : CLOCK_MONOTONIC time taken in the interrupt handler
+	@ edge : RASPI2_GPIO_EDGE_RISING or RASPI2_GPIO_EDGE_FALLING
+	@ seq : per-pin count of accepted edges, a gap means the fifo overflowed
+*/
+struct raspi2_gpio_event{
+	__u64 timestamp_ns;
+	__u32 edge;
+	__u32 seq;
+};
+
+#define RASPI2_GPIO_SET_VALUE	_IOW(RASPI2_GPIO_MAGIC, 1, __u32)
+#define RASPI2_GPIO_GET_VALUE	_IOR(RASPI2_GPIO_MAGIC, 2, __u32)
+#define RASPI2_GPIO_SET_DIR		_IOW(RASPI2_GPIO_MAGIC, 3, __u32)
+#define RASPI2_GPIO_SET_MASK	_IOW(RASPI2_GPIO_MAGIC, 4, struct raspi2_gpio_mask)
+#define RASPI2_GPIO_PULSE		_IOW(RASPI2_GPIO_MAGIC, 5, struct raspi2_gpio_pulse)
+// 6 is unused: logging is the root-only "debug" module parameter, not per open pin //
+// PULSE blocks until the pulse is over, PULSE_START returns once it is armed //
+#define RASPI2_GPIO_PULSE_START		_IOW(RASPI2_GPIO_MAGIC, 7, struct raspi2_gpio_pulse)
+#define RASPI2_GPIO_PULSE_STATUS	_IOR(RASPI2_GPIO_MAGIC, 8, struct raspi2_gpio_pulse_status)
+// RASPI2_GPIO_EDGE_* mask, makes the pin an input; 0 turns events off //
+#define RASPI2_GPIO_SET_EDGE		_IOW(RASPI2_GPIO_MAGIC, 9, __u32)
+// microseconds, 0 keeps every edge //
+#define RASPI2_GPIO_SET_DEBOUNCE	_IOW(RASPI2_GPIO_MAGIC, 10, __u32)
+#define RASPI2_GPIO_FLUSH_EVENTS	_IO(RASPI2_GPIO_MAGIC, 11)
+
+#endif
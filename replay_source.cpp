@@ -0,0 +1,227 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+
+#include "replay_source.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+// width and height from the first SOFn marker, false if there is none //
+static bool jpeg_size(const unsigned char *p, size_t size, unsigned int *w, unsigned int *h)
+{
+	size_t i = 2;
+
+	if(size < 4 || p[0] != 0xff || p[1] != 0xd8)
+		return false;
+
+	while(i + 4 <= size){
+		unsigned int marker, len;
+
+		if(p[i] != 0xff)
+			return false;
+		marker = p[i + 1];
+		len = (p[i + 2] << 8) | p[i + 3];
+
+		// SOF0 .. SOF15 except DHT (c4), JPG (c8) and DAC (cc) //
+		if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc){
+			if(i + 9 > size)
+				return false;
+			*h = (p[i + 5] << 8) | p[i + 6];
+			*w = (p[i + 7] << 8) | p[i + 8];
+			return true;
+		}
+		if(marker == 0xda)
+			return false;
+		i += 2 + len;
+	}
+
+	return false;
+}
+
+ReplaySource::ReplaySource(const string& path, enum replay_timing timing, unsigned int fps, const string& prefix) :
+	timing(timing), xres(0), yres(0), pixfmt(V4L2_PIX_FMT_MJPEG), max_size(0),
+	sink(NULL), loop(false), pos(0), frame_number(0), started(false)
+{
+	struct stat st;
+	size_t i;
+
+	if(fps == 0)
+		throw runtime_error("ReplaySource : frame rate must not be 0");
+	period = 1000000000ULL / fps;
+
+	if(-1 == stat(path.c_str(), &st))
+		throw runtime_error(path + " : cannot open! ");
+
+	if(S_ISDIR(st.st_mode))
+		load_directory(path, prefix);
+	else
+		load_container(path);
+
+	if(recording.empty())
+		throw runtime_error(path + " : no frames to replay");
+
+	for(i = 0; i < recording.size(); ++i)
+		max_size = max(max_size, recording[i].size);
+}
+
+void ReplaySource::load_container(const string& path)
+{
+	unsigned int i;
+
+	reader.reset(new ContainerReader(path));
+	xres = reader->header().width;
+	yres = reader->header().height;
+	pixfmt = reader->header().pixelformat;
+
+	recording.resize(reader->count());
+	for(i = 0; i < reader->count(); ++i){
+		container_frame f = reader->frame(i);
+
+		recording[i].data = (const unsigned char*) f.data;
+		recording[i].size = f.size;
+		recording[i].info = f.info;
+	}
+}
+
+void ReplaySource::load_directory(const string& path, const string& prefix)
+{
+	vector<pair<unsigned int, string> > files;
+	vector<size_t> offsets;
+	struct dirent *e;
+	DIR *dir;
+	size_t i;
+
+	dir = opendir(path.c_str());
+	if(!dir)
+		throw runtime_error(path + " : cannot open! ");
+
+	// <prefix>N.jpg, replayed in N order //
+	while((e = readdir(dir)) != NULL){
+		const char *name = e->d_name;
+		char *end;
+		unsigned long n;
+
+		if(strncmp(name, prefix.c_str(), prefix.size()) != 0)
+			continue;
+		n = strtoul(name + prefix.size(), &end, 10);
+		if(end == name + prefix.size() || strcmp(end, ".jpg") != 0)
+			continue;
+		files.push_back(make_pair((unsigned int)n, path + "/" + name));
+	}
+	closedir(dir);
+
+	sort(files.begin(), files.end());
+
+	for(i = 0; i < files.size(); ++i){
+		ifstream in(files[i].second.c_str(), ios::binary);
+		size_t at = blob.size();
+
+		if(!in)
+			throw runtime_error(files[i].second + " : cannot open! ");
+		blob.insert(blob.end(), istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+		offsets.push_back(at);
+	}
+
+	recording.resize(files.size());
+	for(i = 0; i < files.size(); ++i){
+		size_t end = i + 1 < files.size() ? offsets[i + 1] : blob.size();
+
+		recording[i].data = &blob[offsets[i]];
+		recording[i].size = end - offsets[i];
+		memset(&recording[i].info, 0, sizeof(recording[i].info));
+		recording[i].info.frame_number = files[i].first;
+		recording[i].info.sequence = files[i].first;
+		recording[i].info.timestamp_ns = (uint64_t)files[i].first * period;
+	}
+
+	if(!recording.empty() && !jpeg_size(recording[0].data, recording[0].size, &xres, &yres))
+		throw runtime_error(files[0].second + " : not a JPEG");
+}
+
+void ReplaySource::rewind()
+{
+	pos = 0;
+	started = false;
+}
+
+// replay clock time of r, the start of a pass is now //
+uint64_t ReplaySource::due(const recorded& r)
+{
+	if(!started){
+		started = true;
+		epoch = monotonic_ns();
+		rec_origin = r.info.timestamp_ns;
+		pass_frames = 0;
+	}
+
+	switch(timing){
+	case REPLAY_FIXED:
+		return epoch + (uint64_t)pass_frames * period;
+	case REPLAY_ORIGINAL:
+	case REPLAY_FAST:
+	default:
+		// a timestamp going backwards (driver restart) replays immediately //
+		return epoch + (r.info.timestamp_ns > rec_origin ? r.info.timestamp_ns - rec_origin : 0);
+	}
+}
+
+unsigned int ReplaySource::run(int timeout, int count)
+{
+	unsigned int n = 0;
+
+	if(!sink)
+		throw runtime_error("ReplaySource : no sink");
+
+	while(count-- > 0){
+		frame_info info;
+		uint64_t t;
+
+		if(pos >= recording.size()){
+			if(!loop)
+				break;
+			// the next pass continues one period after the last frame //
+			pos = 0;
+			epoch = monotonic_ns() + period;
+			rec_origin = recording[0].info.timestamp_ns;
+			pass_frames = 0;
+		}
+
+		const recorded& r = recording[pos++];
+		t = due(r);
+
+		if(timing != REPLAY_FAST){
+			struct timespec ts;
+
+			ts.tv_sec = t / 1000000000ULL;
+			ts.tv_nsec = t % 1000000000ULL;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+		}else{
+			// ahead of the recorded clock, stamp with the delivery time //
+			t = monotonic_ns();
+		}
+
+		info = r.info;
+		info.frame_number = ++frame_number;
+		info.timestamp_ns = t;
+		info.flags = (info.flags & ~V4L2_BUF_FLAG_TIMESTAMP_MASK) | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+		pass_frames++;
+
+		sink->consume(r.data, r.size, info);
+		n++;
+	}
+
+	(void)timeout;
+	return n;
+}
@@ -0,0 +1,84 @@
+#ifndef REPLAY_SOURCE_H
+#define REPLAY_SOURCE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "capture_source.h"
+#include "frame_container.h"
+
+enum replay_timing {
+	REPLAY_ORIGINAL,	// recorded frame spacing
+	REPLAY_FAST,		// no waiting at all, for throughput runs
+	REPLAY_FIXED		// fps frames per second
+};
+
+/*
+	ReplaySource - a recorded session played back as a camera
+	path is a session container (ContainerWriter) or a directory of
+	<prefix>N.jpg files from JpegFileSink; directory frames carry no
+	timestamps and are spaced 1 / fps apart. Frames are renumbered from 1
+	and stamped with CLOCK_MONOTONIC times on the replay clock, flagged
+	V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC like a live UVC buffer. Container
+	frames are delivered straight from the mapping, directory frames are
+	read into memory up front so the disk stays out of the measurement.
+*/
+class ReplaySource : public CaptureSource{
+public:
+	ReplaySource(const std::string& path, enum replay_timing timing = REPLAY_ORIGINAL,
+			unsigned int fps = 60, const std::string& prefix = "frame");
+
+	// timeout is ignored, a recording never stalls; stops at the end unless looping //
+	unsigned int run(int timeout, int count);
+	void set_sink(FrameSink *s) { sink = s; }
+
+	unsigned int width() const { return xres; }
+	unsigned int height() const { return yres; }
+	unsigned int pixel_format() const { return pixfmt; }
+	size_t max_frame_size() const { return max_size; }
+
+	// start over after the last frame instead of stopping //
+	void set_loop(bool on) { loop = on; }
+	void rewind();
+	unsigned int frames() const { return recording.size(); }
+	bool finished() const { return !loop && pos >= recording.size(); }
+private:
+	ReplaySource(const ReplaySource&);
+	ReplaySource& operator=(const ReplaySource&);
+
+	struct recorded{
+		const unsigned char *data;
+		size_t size;
+		frame_info info;
+	};
+
+	void load_container(const std::string& path);
+	void load_directory(const std::string& path, const std::string& prefix);
+	uint64_t due(const recorded& r);
+
+	enum replay_timing timing;
+	uint64_t period;
+
+	std::unique_ptr<ContainerReader> reader;
+	std::vector<unsigned char> blob;
+	std::vector<recorded> recording;
+
+	unsigned int xres, yres;
+	unsigned int pixfmt;
+	size_t max_size;
+
+	FrameSink *sink;
+	bool loop;
+	unsigned int pos;
+	unsigned int frame_number;
+
+	// replay clock, set when a pass starts //
+	bool started;
+	uint64_t epoch;			// monotonic time of the first frame of this pass
+	uint64_t rec_origin;	// recorded timestamp of that frame
+	unsigned int pass_frames;
+};
+
+#endif
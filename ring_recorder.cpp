@@ -0,0 +1,137 @@
+#include <string.h>
+
+#include <stdexcept>
+#include <linux/videodev2.h>
+
+#include "ring_recorder.h"
+#include "latency_histogram.h"
+
+using namespace std;
+
+RingRecorder::RingRecorder(size_t budget_mb, uint64_t window_ns, unsigned int max_frames) :
+	arena(budget_mb << 20, 1), window(window_ns), index(max_frames),
+	first(0), count(0), write_pos(0), used(0)
+{
+	if(budget_mb == 0 || max_frames == 0)
+		throw runtime_error("RingRecorder : empty ring");
+
+	ring = (unsigned char*) arena.slot(0);
+	cap = budget_mb << 20;
+	memset(&st, 0, sizeof(st));
+}
+
+bool RingRecorder::overlaps(const record& r, size_t offset, size_t size) const
+{
+	return r.offset < offset + size && offset < r.offset + r.size;
+}
+
+void RingRecorder::evict_oldest()
+{
+	used -= index[first].size;
+	first = (first + 1) % index.size();
+	count--;
+	st.evicted++;
+}
+
+void RingRecorder::consume(const void *p, size_t size, const frame_info& info)
+{
+	lock_guard<mutex> lk(lock);
+	uint64_t t;
+	record *r;
+
+	if(size > cap){
+		st.oversize++;
+		return;
+	}
+
+	// driver clock when it is monotonic, arrival time otherwise //
+	if((info.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		t = info.timestamp_ns;
+	else
+		t = monotonic_ns();
+
+	/*
+		Records are contiguous, one that does not fit the tail starts over
+		at 0. Frames left in the skipped tail are the oldest ones, they go
+		first so the oldest record is always the next one ahead.
+	*/
+	if(write_pos + size > cap){
+		while(count > 0 && index[first].offset >= write_pos)
+			evict_oldest();
+		write_pos = 0;
+	}
+
+	// the space ahead of the newest frame holds the oldest ones //
+	while(count > 0 && overlaps(index[first], write_pos, size))
+		evict_oldest();
+	if(count == index.size())
+		evict_oldest();
+	while(count > 0 && t > window && index[first].t < t - window)
+		evict_oldest();
+
+	r = &index[(first + count) % index.size()];
+	r->info = info;
+	r->t = t;
+	r->offset = write_pos;
+	r->size = size;
+	memcpy(ring + write_pos, p, size);
+
+	write_pos += size;
+	used += size;
+	count++;
+	st.recorded++;
+}
+
+unsigned int RingRecorder::save(FrameSink *out, uint64_t from_ns, uint64_t to_ns)
+{
+	lock_guard<mutex> lk(lock);
+	unsigned int i, n = 0;
+
+	for(i = 0; i < count; ++i){
+		const record& r = index[(first + i) % index.size()];
+
+		if(r.t < from_ns || r.t > to_ns)
+			continue;
+		out->consume(ring + r.offset, r.size, r.info);
+		n++;
+	}
+
+	st.saved += n;
+	return n;
+}
+
+unsigned int RingRecorder::save_frames(FrameSink *out, unsigned int first_frame, unsigned int last_frame)
+{
+	lock_guard<mutex> lk(lock);
+	unsigned int i, n = 0;
+
+	for(i = 0; i < count; ++i){
+		const record& r = index[(first + i) % index.size()];
+
+		if(r.info.frame_number < first_frame || r.info.frame_number > last_frame)
+			continue;
+		out->consume(ring + r.offset, r.size, r.info);
+		n++;
+	}
+
+	st.saved += n;
+	return n;
+}
+
+void RingRecorder::clear()
+{
+	lock_guard<mutex> lk(lock);
+
+	first = count = 0;
+	write_pos = used = 0;
+}
+
+recorder_stats RingRecorder::stats()
+{
+	lock_guard<mutex> lk(lock);
+
+	st.frames = count;
+	st.bytes = used;
+	st.span_ns = count ? index[(first + count - 1) % index.size()].t - index[first].t : 0;
+	return st;
+}
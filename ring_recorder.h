@@ -0,0 +1,74 @@
+#ifndef RING_RECORDER_H
+#define RING_RECORDER_H
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+#include "frame_sink.h"
+#include "frame_arena.h"
+
+struct recorder_stats{
+	unsigned int frames;		// frames currently held
+	size_t bytes;				// bytes of those frames
+	uint64_t span_ns;			// newest minus oldest held timestamp
+	unsigned long recorded;		// frames accepted by consume()
+	unsigned long evicted;		// frames pushed out by budget, age or index size
+	unsigned long oversize;		// frames larger than the whole ring
+	unsigned long saved;		// frames handed to a sink by save()
+};
+
+/*
+	RingRecorder - the last window_ns of compressed frames, in memory
+	consume() appends the MJPEG bytes as they come into a byte ring of
+	budget_mb, preallocated once in a FrameArena, so a frame costs its
+	compressed size and no allocation. Frames older than window_ns before
+	the newest one, or in the way of a new one, are dropped oldest first.
+	Nothing touches the disk until save() copies a time or frame-number
+	window into a sink, e.g. the seconds around a stimulus.
+
+	save() holds the recorder lock while it writes, so capture waits for
+	it; pass a fast sink or call it once the interesting part is over.
+*/
+class RingRecorder : public FrameSink{
+public:
+	RingRecorder(size_t budget_mb, uint64_t window_ns, unsigned int max_frames = 4096);
+
+	void consume(const void *p, size_t size, const frame_info& info);
+
+	// frames with from_ns <= time <= to_ns, oldest first; returns the count //
+	unsigned int save(FrameSink *out, uint64_t from_ns, uint64_t to_ns);
+	unsigned int save_frames(FrameSink *out, unsigned int first, unsigned int last);
+	void clear();
+
+	recorder_stats stats();
+	size_t capacity() const { return cap; }
+private:
+	RingRecorder(const RingRecorder&);
+	RingRecorder& operator=(const RingRecorder&);
+
+	struct record{
+		frame_info info;
+		uint64_t t;			// monotonic time the window is measured in
+		size_t offset;
+		size_t size;
+	};
+
+	void evict_oldest();
+	bool overlaps(const record& r, size_t offset, size_t size) const;
+
+	FrameArena arena;
+	unsigned char *ring;
+	size_t cap;
+	uint64_t window;
+
+	std::vector<record> index;
+	unsigned int first, count;		// oldest record and number held
+	size_t write_pos;
+	size_t used;
+
+	std::mutex lock;
+	recorder_stats st;
+};
+
+#endif
@@ -0,0 +1,443 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+
+#include "stage_graph.h"
+
+#define SPIN_TRIES 64		// empty polls of the task queues before a worker sleeps
+#define SLEEP_MS 10			// upper bound on a sleep, a lost wake-up only costs this
+
+using namespace std;
+
+// item and outcome in an ordered stage's done ring //
+#define DONE_PENDING -1
+#define DONE_ENCODE(item, ok) ((int)(item) * 2 + ((ok) ? 0 : 1))
+
+bool pin_thread(int cpu)
+{
+	cpu_set_t set;
+
+	if(cpu < 0)
+		return true;
+	if(cpu >= CPU_SETSIZE)
+		return false;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+graph_config graph_config::cores(unsigned int n, unsigned int n_items, bool block)
+{
+	graph_config c;
+	unsigned int i;
+
+	c.n_items = n_items;
+	c.capture_cpu = 0;
+	c.worker_cpus.clear();
+	for(i = 0; i < (n ? n : 1); ++i)
+		c.worker_cpus.push_back(i);
+	c.block = block;
+	return c;
+}
+
+StageGraph::StageGraph(size_t max_frame_size, unsigned int width, unsigned int height,
+		const graph_config& config) :
+	cfg(config), n_stages(0), next_worker(0), running(false), sleeping(0), waiting(0),
+	max_size(max_frame_size), next_seq(0),
+	n_captured(0), n_dropped(0), n_completed(0), n_retired(0), n_stolen(0), n_waits(0),
+	pin_failed(false)
+{
+	unsigned int i;
+
+	if(cfg.n_items < 2)
+		throw runtime_error("StageGraph : at least 2 items");
+	if(cfg.worker_cpus.empty())
+		cfg.worker_cpus.push_back(-1);
+
+	// every buffer is allocated here, nothing is malloc'd per frame //
+	items.resize(cfg.n_items);
+	free_items.reset(cfg.n_items);
+	for(i = 0; i < cfg.n_items; ++i){
+		items[i].index = i;
+		items[i].data.resize(max_frame_size);
+		items[i].pixels.resize((size_t)width * height);
+		free_items.push(i);
+	}
+
+	for(i = 0; i < cfg.worker_cpus.size(); ++i)
+		tasks.push_back(unique_ptr<BoundedQueue<unsigned int> >(new BoundedQueue<unsigned int>(cfg.n_items)));
+}
+
+StageGraph::~StageGraph()
+{
+	size_t i;
+
+	if(!workers.empty())
+		flush();
+
+	running.store(false);
+	{
+		lock_guard<mutex> lk(sleep_lock);
+		task_ready.notify_all();
+	}
+	for(i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+unsigned int StageGraph::add_stage(const string& name, PipelineStage *impl, unsigned int max_parallel, bool ordered)
+{
+	stage *st;
+
+	if(running.load())
+		throw runtime_error("StageGraph : stages must be added before start()");
+	if(n_stages >= GRAPH_MAX_STAGES)
+		throw runtime_error("StageGraph : too many stages");
+
+	st = new stage;
+	st->name = name;
+	st->impl = impl;
+	st->max_parallel = max_parallel ? max_parallel : 1;
+	st->ordered = ordered;
+	st->input.reset(cfg.n_items);
+	st->active.store(0);
+	st->running.store(0);
+	st->next_ticket.store(0);
+	st->next_release = 0;
+	st->done.assign(cfg.n_items, DONE_PENDING);
+	st->n_processed.store(0);
+	st->n_dropped.store(0);
+	st->n_errors.store(0);
+	st->peak.store(0);
+
+	stage_list[n_stages].reset(st);
+	return n_stages++;
+}
+
+void StageGraph::start()
+{
+	unsigned int i;
+
+	if(running.exchange(true))
+		return;
+
+	for(i = 0; i < n_stages; ++i)
+		stage_list[i]->impl->prepare(tasks.size());
+	for(i = 0; i < tasks.size(); ++i)
+		workers.push_back(std::thread(&StageGraph::worker, this, i));
+}
+
+unsigned int StageGraph::run(CaptureSource *source, int timeout, int count)
+{
+	exception_ptr error;
+	unsigned int n = 0;
+
+	start();
+
+	std::thread capture([&]() {
+		try{
+			if(!pin_thread(cfg.capture_cpu))
+				pin_failed.store(true);
+			source->set_sink(this);
+			n = source->run(timeout, count);
+		}catch(...){
+			error = current_exception();
+		}
+	});
+	capture.join();
+
+	flush();
+	if(error)
+		rethrow_exception(error);
+	return n;
+}
+
+void StageGraph::flush()
+{
+	unique_lock<mutex> lk(sleep_lock);
+
+	waiting.fetch_add(1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while(n_retired.load() != n_captured.load())
+		item_free.wait_for(lk, chrono::milliseconds(SLEEP_MS));
+	waiting.fetch_sub(1);
+}
+
+void StageGraph::consume(const void *p, size_t size, const frame_info& info)
+{
+	unsigned int i;
+
+	if(size > max_size){
+		n_dropped++;
+		return;
+	}
+
+	while(!free_items.pop(&i)){
+		if(!cfg.block){
+			n_dropped++;
+			return;
+		}
+
+		unique_lock<mutex> lk(sleep_lock);
+
+		n_waits++;
+		waiting.fetch_add(1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(free_items.empty())
+			item_free.wait_for(lk, chrono::milliseconds(SLEEP_MS));
+		waiting.fetch_sub(1);
+	}
+
+	pipe_item& item = items[i];
+
+	memcpy(&item.data[0], p, size);
+	item.size = size;
+	item.info = info;
+	item.seq = next_seq++;
+	item.t_capture = monotonic_ns();
+	item.luma.data = NULL;
+	memset(&item.region, 0, sizeof(item.region));
+	item.result = pupil();
+	n_captured++;
+
+	if(n_stages == 0){
+		n_completed++;
+		retire(i);
+		return;
+	}
+	enter(0, i, -1);
+}
+
+void StageGraph::enter(unsigned int s, unsigned int i, int hint)
+{
+	stage& st = *stage_list[s];
+
+	items[i].stage = s;
+	if(st.ordered)
+		items[i].ticket = st.next_ticket.fetch_add(1);
+
+	// sized for the whole pool, cannot be full //
+	st.input.push(i);
+	atomic_thread_fence(memory_order_seq_cst);
+	dispatch(s, hint);
+}
+
+// turn queued items of stage s into tasks while it has room //
+void StageGraph::dispatch(unsigned int s, int hint)
+{
+	stage& st = *stage_list[s];
+	unsigned int i, w;
+
+	for(;;){
+		unsigned int a = st.active.load();
+
+		if(a >= st.max_parallel)
+			return;
+		if(!st.active.compare_exchange_weak(a, a + 1))
+			continue;
+
+		if(!st.input.pop(&i)){
+			st.active.fetch_sub(1);
+			atomic_thread_fence(memory_order_seq_cst);
+			// an enter() that found the stage full while we held the slot relies on us //
+			if(st.input.empty())
+				return;
+			continue;
+		}
+
+		w = hint >= 0 ? hint : next_worker.fetch_add(1) % tasks.size();
+		tasks[w]->push(i);
+		wake();
+	}
+}
+
+void StageGraph::wake()
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if(sleeping.load()){
+		lock_guard<mutex> lk(sleep_lock);
+		task_ready.notify_one();
+	}
+}
+
+void StageGraph::forward(unsigned int s, unsigned int i, bool ok, int hint)
+{
+	if(!ok){
+		retire(i);
+	}else if(s + 1 >= n_stages){
+		total.record(monotonic_ns() - items[i].t_capture);
+		n_completed++;
+		retire(i);
+	}else{
+		enter(s + 1, i, hint);
+	}
+}
+
+void StageGraph::retire(unsigned int i)
+{
+	free_items.push(i);
+	n_retired++;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if(waiting.load()){
+		lock_guard<mutex> lk(sleep_lock);
+		item_free.notify_all();
+	}
+}
+
+bool StageGraph::next_task(unsigned int id, unsigned int *i)
+{
+	size_t k, n = tasks.size();
+
+	if(tasks[id]->pop(i))
+		return true;
+
+	for(k = 1; k < n; ++k){
+		if(tasks[(id + k) % n]->pop(i)){
+			n_stolen++;
+			return true;
+		}
+	}
+	return false;
+}
+
+void StageGraph::run_task(unsigned int id, unsigned int i)
+{
+	pipe_item& item = items[i];
+	unsigned int s = item.stage;
+	stage& st = *stage_list[s];
+	unsigned int r = st.running.fetch_add(1) + 1;
+	unsigned int peak = st.peak.load();
+	uint64_t t;
+	bool ok;
+
+	while(r > peak && !st.peak.compare_exchange_weak(peak, r))
+		;
+
+	t = monotonic_ns();
+	try{
+		ok = st.impl->process(item, id);
+	}catch(const exception&){
+		// a failing stage must not take the worker down, nor stall an ordered stage //
+		ok = false;
+		st.n_errors++;
+	}
+	st.latency.record(monotonic_ns() - t);
+
+	st.running.fetch_sub(1);
+	st.n_processed++;
+	if(!ok)
+		st.n_dropped++;
+
+	if(st.ordered){
+		lock_guard<mutex> lk(st.release_lock);
+		size_t n = st.done.size();
+
+		st.done[item.ticket % n] = DONE_ENCODE(i, ok);
+		// release everything that is now in order, this item or a run of earlier finished ones //
+		while(st.done[st.next_release % n] != DONE_PENDING){
+			int v = st.done[st.next_release % n];
+
+			st.done[st.next_release % n] = DONE_PENDING;
+			st.next_release++;
+			forward(s, v / 2, !(v & 1), id);
+		}
+	}else{
+		forward(s, i, ok, id);
+	}
+
+	st.active.fetch_sub(1);
+	atomic_thread_fence(memory_order_seq_cst);
+	dispatch(s, id);
+}
+
+void StageGraph::worker(unsigned int id)
+{
+	unsigned int i, idle = 0;
+
+	if(!pin_thread(cfg.worker_cpus[id]))
+		pin_failed.store(true);
+
+	for(;;){
+		if(next_task(id, &i)){
+			run_task(id, i);
+			idle = 0;
+			continue;
+		}
+		if(!running.load())
+			break;
+		if(++idle < SPIN_TRIES){
+			this_thread::yield();
+			continue;
+		}
+
+		unique_lock<mutex> lk(sleep_lock);
+		size_t k;
+		bool any = false;
+
+		sleeping.fetch_add(1);
+		atomic_thread_fence(memory_order_seq_cst);
+		for(k = 0; k < tasks.size() && !any; ++k)
+			any = !tasks[k]->empty();
+		if(!any && running.load())
+			task_ready.wait_for(lk, chrono::milliseconds(SLEEP_MS));
+		sleeping.fetch_sub(1);
+		idle = 0;
+	}
+}
+
+graph_stats StageGraph::stats() const
+{
+	graph_stats g;
+
+	g.captured = n_captured.load();
+	g.dropped = n_dropped.load();
+	g.completed = n_completed.load();
+	g.stolen = n_stolen.load();
+	g.waits = n_waits.load();
+	g.workers = tasks.size();
+	g.pinned = !pin_failed.load();
+	return g;
+}
+
+void StageGraph::register_metrics(MetricsRegistry *reg, const string& prefix) const
+{
+	unsigned int i;
+
+	reg->add(prefix + ".captured", METRIC_COUNTER, [this]() { return (int64_t)n_captured.load(); });
+	reg->add(prefix + ".dropped", METRIC_COUNTER, [this]() { return (int64_t)n_dropped.load(); });
+	reg->add(prefix + ".completed", METRIC_COUNTER, [this]() { return (int64_t)n_completed.load(); });
+	reg->add(prefix + ".stolen", METRIC_COUNTER, [this]() { return (int64_t)n_stolen.load(); });
+	reg->add(prefix + ".in_flight", METRIC_GAUGE, [this]() { return (int64_t)(n_captured.load() - n_retired.load()); });
+	reg->add(prefix + ".total_ns", &total);
+
+	for(i = 0; i < n_stages; ++i){
+		const stage *st = stage_list[i].get();
+		string p = prefix + "." + st->name;
+
+		reg->add(p + ".processed", METRIC_COUNTER, [st]() { return (int64_t)st->n_processed.load(); });
+		reg->add(p + ".dropped", METRIC_COUNTER, [st]() { return (int64_t)st->n_dropped.load(); });
+		reg->add(p + ".errors", METRIC_COUNTER, [st]() { return (int64_t)st->n_errors.load(); });
+		reg->add(p + ".running", METRIC_GAUGE, [st]() { return (int64_t)st->running.load(); });
+		reg->add(p + ".latency_ns", &st->latency);
+	}
+}
+
+stage_stats StageGraph::stats(unsigned int s) const
+{
+	const stage& st = *stage_list[s];
+	stage_stats r;
+
+	r.name = st.name;
+	r.max_parallel = st.max_parallel;
+	r.ordered = st.ordered;
+	r.processed = st.n_processed.load();
+	r.dropped = st.n_dropped.load();
+	r.errors = st.n_errors.load();
+	r.peak_parallel = st.peak.load();
+	return r;
+}
@@ -0,0 +1,202 @@
+#ifndef STAGE_GRAPH_H
+#define STAGE_GRAPH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+#include "frame_sink.h"
+#include "capture_source.h"
+#include "luma_frame.h"
+#include "pupil_detector.h"
+#include "latency_histogram.h"
+#include "bounded_queue.h"
+#include "metrics.h"
+
+#define GRAPH_MAX_STAGES 8
+
+/*
+	pipe_item - one frame travelling through a StageGraph
+	The pool of items is allocated up front; consume() copies the
+	captured frame into a free one, stages fill in luma and result, and
+	the item goes back to the pool after the last stage or a drop.
+*/
+struct pipe_item{
+	unsigned int index;				// in the pool
+	uint64_t seq;					// capture order, from 0
+	frame_info info;
+	size_t size;
+	std::vector<unsigned char> data;	// the captured frame, max_frame_size bytes
+	std::vector<unsigned char> pixels;	// width x height, e.g. decoded luma
+	luma_frame luma;				// set by a decode or extract stage
+	pupil_roi region;				// the part of the frame luma covers, set with it
+	pupil result;					// set by a detection stage
+	uint64_t t_capture;				// CLOCK_MONOTONIC at consume()
+
+	// scheduling, owned by the graph //
+	unsigned int stage;
+	uint32_t ticket;
+};
+
+// a step of the pipeline; process() runs on the pool's workers //
+class PipelineStage{
+public:
+	virtual ~PipelineStage() {}
+
+	// once before the graph starts, per-worker state is indexed by worker //
+	virtual void prepare(unsigned int n_workers) { (void)n_workers; }
+	// false drops the item, later stages never see it; so does throwing //
+	virtual bool process(pipe_item& item, unsigned int worker) = 0;
+};
+
+/*
+	Where the threads run. cores(n) puts one worker on each of cpus
+	0 .. n-1 and the capture thread on cpu 0: it spends its time blocked
+	in select() and only needs to wake up promptly.
+*/
+struct graph_config{
+	unsigned int n_items;			// frames in flight, the pool size
+	int capture_cpu;				// -1 leaves the capture thread unpinned
+	std::vector<int> worker_cpus;	// one worker per entry, -1 unpinned
+	bool block;						// capture waits for a free item instead of dropping the frame
+
+	graph_config() : n_items(16), capture_cpu(-1), worker_cpus(2, -1), block(false) {}
+	static graph_config cores(unsigned int n, unsigned int n_items = 16, bool block = false);
+};
+
+struct stage_stats{
+	std::string name;
+	unsigned int max_parallel;
+	bool ordered;
+	unsigned long processed;		// process() calls
+	unsigned long dropped;			// process() returned false or threw
+	unsigned long errors;			// of those, threw
+	unsigned int peak_parallel;		// most process() calls seen at once
+};
+
+struct graph_stats{
+	unsigned long captured;			// frames accepted by consume()
+	unsigned long dropped;			// no free item, capture went on without it
+	unsigned long completed;		// items through every stage
+	unsigned long stolen;			// tasks a worker took from another's queue
+	unsigned long waits;			// capture waited for a free item (block)
+	unsigned int workers;
+	bool pinned;					// every requested cpu pinning succeeded
+};
+
+/*
+	StageGraph - stages around a capture source, run on a small pool
+	Stages form a chain in the order they are added. Each has a bounded
+	lock-free input queue and runs at most max_parallel items at a time;
+	an ordered stage passes its items on in the order they entered it,
+	however the workers finish them, so a parallel decode can feed an
+	in-order tracker. Since all queues hold item indices and are as large
+	as the pool, no push can fail: the pool is the only backpressure.
+
+	Ready items become tasks on the per-worker queues, the pushing worker's
+	own first so a frame tends to stay on one core from stage to stage;
+	an idle worker steals from the others before it sleeps. run() drives
+	the source on a capture thread pinned to capture_cpu.
+*/
+class StageGraph : public FrameSink{
+public:
+	StageGraph(size_t max_frame_size, unsigned int width, unsigned int height,
+			const graph_config& config = graph_config());
+	~StageGraph();
+
+	// before start() or run(); returns the stage index //
+	unsigned int add_stage(const std::string& name, PipelineStage *stage,
+			unsigned int max_parallel = 1, bool ordered = false);
+
+	void start();
+	// source->run(timeout, count) on the capture thread, then flush() //
+	unsigned int run(CaptureSource *source, int timeout, int count);
+	// wait until every captured item has left the graph //
+	void flush();
+
+	// capture thread only //
+	void consume(const void *p, size_t size, const frame_info& info);
+
+	graph_stats stats() const;
+	stage_stats stats(unsigned int stage) const;
+	unsigned int stages() const { return n_stages; }
+	const LatencyHistogram& stage_latency(unsigned int stage) const { return stage_list[stage]->latency; }
+	// consume() to the end of the last stage //
+	const LatencyHistogram& total_latency() const { return total; }
+	// graph counters and, per stage, <prefix>.<name>.* //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "graph") const;
+private:
+	StageGraph(const StageGraph&);
+	StageGraph& operator=(const StageGraph&);
+
+	struct stage{
+		std::string name;
+		PipelineStage *impl;
+		unsigned int max_parallel;
+		bool ordered;
+
+		BoundedQueue<unsigned int> input;
+		std::atomic<unsigned int> active;	// tasks queued or running
+		std::atomic<unsigned int> running;
+		std::atomic<uint32_t> next_ticket;
+
+		// ordered stages: finished items waiting for the ones before them //
+		std::mutex release_lock;
+		uint32_t next_release;
+		std::vector<int> done;				// per ticket % n_items: 2 item + dropped, -1 pending
+
+		std::atomic<unsigned long> n_processed;
+		std::atomic<unsigned long> n_dropped;
+		std::atomic<unsigned long> n_errors;
+		std::atomic<unsigned int> peak;
+		LatencyHistogram latency;
+	};
+
+	void worker(unsigned int id);
+	bool next_task(unsigned int id, unsigned int *item);
+	void run_task(unsigned int id, unsigned int item);
+	void enter(unsigned int s, unsigned int item, int hint);
+	void dispatch(unsigned int s, int hint);
+	void forward(unsigned int s, unsigned int item, bool ok, int hint);
+	void retire(unsigned int item);
+	void wake();
+
+	graph_config cfg;
+	std::vector<pipe_item> items;
+	BoundedQueue<unsigned int> free_items;
+
+	std::unique_ptr<stage> stage_list[GRAPH_MAX_STAGES];
+	unsigned int n_stages;
+
+	std::vector<std::unique_ptr<BoundedQueue<unsigned int> > > tasks;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned int> next_worker;
+	std::atomic<bool> running;
+	std::atomic<unsigned int> sleeping;
+	std::mutex sleep_lock;
+	std::condition_variable task_ready;
+	std::condition_variable item_free;
+	std::atomic<unsigned int> waiting;	// in consume() or flush() for item_free
+
+	size_t max_size;
+	uint64_t next_seq;
+	std::atomic<unsigned long> n_captured;
+	std::atomic<unsigned long> n_dropped;
+	std::atomic<unsigned long> n_completed;
+	std::atomic<unsigned long> n_retired;
+	std::atomic<unsigned long> n_stolen;
+	std::atomic<unsigned long> n_waits;
+	std::atomic<bool> pin_failed;
+	LatencyHistogram total;
+};
+
+// pin the calling thread to cpu, false if it does not exist or is not allowed //
+bool pin_thread(int cpu);
+
+#endif
@@ -0,0 +1,111 @@
+#include <string.h>
+
+#include <stdexcept>
+
+#include "stereo_sync.h"
+
+using namespace std;
+
+StereoSync::StereoSync(StereoHandler *out, uint64_t tolerance_ns, unsigned int depth, bool duplicate) :
+	out(out), tolerance(tolerance_ns), depth(depth), duplicate(duplicate)
+{
+	unsigned int i;
+
+	if(!out)
+		throw runtime_error("StereoSync : no output handler");
+	if(depth == 0)
+		throw runtime_error("StereoSync : depth must be at least 1");
+
+	for(i = 0; i < 2; ++i){
+		handlers[i].sync = this;
+		handlers[i].side = i;
+		last[i].arrival = 0;
+	}
+	memset(&st, 0, sizeof(st));
+}
+
+void StereoSync::push(unsigned int side, const FrameRef& frame)
+{
+	entry e;
+
+	if(side > 1 || !frame)
+		return;
+
+	e.frame = frame;
+	e.arrival = monotonic_ns();
+
+	// never hold more leases than promised, the oldest frame loses //
+	if(queue[side].size() >= depth){
+		queue[side].pop_front();
+		st.overflow[side]++;
+	}
+	queue[side].push_back(e);
+
+	match();
+}
+
+void StereoSync::emit(const entry& l, const entry& r, bool dup_side[2])
+{
+	int64_t d = (int64_t)(l.frame.timestamp_ns() - r.frame.timestamp_ns());
+	uint64_t first = dup_side[STEREO_LEFT] ? r.arrival
+		: dup_side[STEREO_RIGHT] ? l.arrival
+		: (l.arrival < r.arrival ? l.arrival : r.arrival);
+
+	out->on_pair(l.frame, r.frame, d);
+
+	st.pairs++;
+	skew.record(d < 0 ? -d : d);
+	latency.record(monotonic_ns() - first);
+}
+
+void StereoSync::orphan(unsigned int side)
+{
+	unsigned int other = 1 - side;
+	entry e = queue[side].front();
+	bool dup[2] = { false, false };
+
+	queue[side].pop_front();
+
+	if(!duplicate || !last[other].frame){
+		st.dropped[side]++;
+		return;
+	}
+
+	// the other camera skipped this instant, repeat its previous frame //
+	dup[other] = true;
+	st.duplicated[other]++;
+	if(side == STEREO_LEFT)
+		emit(e, last[other], dup);
+	else
+		emit(last[other], e, dup);
+
+	last[side] = e;
+}
+
+void StereoSync::match()
+{
+	while(!queue[STEREO_LEFT].empty() && !queue[STEREO_RIGHT].empty()){
+		entry& l = queue[STEREO_LEFT].front();
+		entry& r = queue[STEREO_RIGHT].front();
+		uint64_t tl = l.frame.timestamp_ns(), tr = r.frame.timestamp_ns();
+		bool dup[2] = { false, false };
+
+		if(tl + tolerance < tr){
+			// right is already later, left's partner is gone //
+			orphan(STEREO_LEFT);
+			continue;
+		}
+		if(tr + tolerance < tl){
+			orphan(STEREO_RIGHT);
+			continue;
+		}
+
+		emit(l, r, dup);
+		if(duplicate){
+			last[STEREO_LEFT] = l;
+			last[STEREO_RIGHT] = r;
+		}
+		queue[STEREO_LEFT].pop_front();
+		queue[STEREO_RIGHT].pop_front();
+	}
+}
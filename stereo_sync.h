@@ -0,0 +1,86 @@
+#ifndef STEREO_SYNC_H
+#define STEREO_SYNC_H
+
+#include <stdint.h>
+#include <deque>
+
+#include "capture_reactor.h"
+#include "latency_histogram.h"
+
+#define STEREO_LEFT		0
+#define STEREO_RIGHT	1
+
+class StereoHandler{
+public:
+	virtual ~StereoHandler() {}
+
+	// skew_ns is left minus right driver timestamp //
+	virtual void on_pair(const FrameRef& left, const FrameRef& right, int64_t skew_ns) = 0;
+};
+
+struct stereo_stats{
+	unsigned long pairs;
+	unsigned long dropped[2];		// frames that never found a partner
+	unsigned long duplicated[2];	// pairs that reused this side's previous frame
+	unsigned long overflow[2];		// frames dropped because the queue was full
+};
+
+/*
+	StereoSync - pairs frames of two cameras by driver timestamp
+	Frames within tolerance_ns of each other are paired. A frame whose
+	partner cannot arrive any more (the other side is already past it)
+	is dropped, or with duplicate set paired with the other side's last
+	frame so the pair rate stays at the camera rate.
+
+	Queued frames keep their FrameRef lease, so depth must stay below
+	each camera's buffer count; duplicate mode holds one more per side.
+	Both cameras must stamp with the same clock (CLOCK_MONOTONIC for UVC).
+*/
+class StereoSync{
+public:
+	StereoSync(StereoHandler *out, uint64_t tolerance_ns, unsigned int depth = 2, bool duplicate = false);
+
+	void push(unsigned int side, const FrameRef& frame);
+
+	// adapters to register the two cameras with a CaptureReactor //
+	FrameHandler *left() { return &handlers[STEREO_LEFT]; }
+	FrameHandler *right() { return &handlers[STEREO_RIGHT]; }
+
+	stereo_stats stats() const { return st; }
+	// |left - right| timestamp of emitted pairs //
+	const LatencyHistogram& mismatch() const { return skew; }
+	// arrival of the first frame of a pair to the pair being emitted //
+	const LatencyHistogram& pairing_latency() const { return latency; }
+private:
+	struct entry{
+		FrameRef frame;
+		uint64_t arrival;
+	};
+
+	class side_handler : public FrameHandler{
+	public:
+		StereoSync *sync;
+		unsigned int side;
+
+		void on_frame(Picam& cam, const FrameRef& frame) { (void)cam; sync->push(side, frame); }
+	};
+
+	void match();
+	void emit(const entry& l, const entry& r, bool dup_side[2]);
+	void orphan(unsigned int side);
+
+	StereoHandler *out;
+	uint64_t tolerance;
+	unsigned int depth;
+	bool duplicate;
+
+	std::deque<entry> queue[2];
+	entry last[2];
+	side_handler handlers[2];
+
+	stereo_stats st;
+	LatencyHistogram skew;
+	LatencyHistogram latency;
+};
+
+#endif
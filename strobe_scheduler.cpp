@@ -0,0 +1,392 @@
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <chrono>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+
+#include "strobe_scheduler.h"
+
+#define COARSE_MARGIN_NS	2000000LL	// wake this early, then clock_nanosleep the rest
+#define RETARGET_NS			50000LL		// prediction moved later by more than this: sleep again
+#define LATE_NS				1000000LL	// toggled this much after the requested time
+#define MAX_HISTORY			64
+#define HW_COLLECT_NS		2000000LL	// read a driver pulse's edges this long after its planned end
+#define HW_GIVE_UP_NS		200000000LL	// and stop asking after this
+
+using namespace std;
+
+StrobeScheduler::StrobeScheduler(unsigned int nominal_fps, bool realtime, int priority) :
+	have_clock(false), ref_frame(0), ref_start(0), lead(0),
+	realtime(realtime), priority(priority), running(true)
+{
+	if(nominal_fps == 0)
+		throw runtime_error("StrobeScheduler : frame rate must not be 0");
+
+	period = 1000000000ULL / nominal_fps;
+	memset(&st, 0, sizeof(st));
+
+	thread = std::thread(&StrobeScheduler::run, this);
+}
+
+StrobeScheduler::~StrobeScheduler()
+{
+	{
+		lock_guard<mutex> lk(lock);
+		running = false;
+	}
+	changed.notify_all();
+	thread.join();
+
+	cancel();
+}
+
+unsigned int StrobeScheduler::add_output(StrobeOutput *out)
+{
+	lock_guard<mutex> lk(lock);
+
+	if(!out)
+		throw runtime_error("StrobeScheduler : no output");
+
+	outputs.push_back(out);
+	return outputs.size() - 1;
+}
+
+void StrobeScheduler::schedule(unsigned int output, unsigned int first_frame, unsigned int last_frame)
+{
+	pulse p;
+
+	if(last_frame < first_frame)
+		throw runtime_error("StrobeScheduler : empty frame range");
+
+	p.output = output;
+	p.first = first_frame;
+	p.last = last_frame;
+	p.on = false;
+
+	{
+		lock_guard<mutex> lk(lock);
+		if(output >= outputs.size())
+			throw runtime_error("StrobeScheduler : no such output");
+		pulses.push_back(p);
+		if(history.size() == MAX_HISTORY)
+			history.erase(history.begin());
+		history.push_back(p);
+	}
+	changed.notify_all();
+}
+
+void StrobeScheduler::unschedule(unsigned int output, unsigned int first_frame, unsigned int last_frame)
+{
+	lock_guard<mutex> lk(lock);
+	size_t i = 0;
+
+	while(i < pulses.size()){
+		if(pulses[i].output != output || pulses[i].first != first_frame || pulses[i].last != last_frame){
+			++i;
+			continue;
+		}
+		if(pulses[i].on){
+			try{
+				outputs[output]->set(false);
+			}catch(const exception&){
+				st.errors++;
+			}
+		}
+		pulses.erase(pulses.begin() + i);
+	}
+
+	i = 0;
+	while(i < history.size()){
+		if(history[i].output == output && history[i].first == first_frame && history[i].last == last_frame)
+			history.erase(history.begin() + i);
+		else
+			++i;
+	}
+	changed.notify_all();
+}
+
+void StrobeScheduler::cancel()
+{
+	lock_guard<mutex> lk(lock);
+	size_t i;
+
+	for(i = 0; i < pulses.size(); ++i){
+		if(pulses[i].on){
+			try{
+				outputs[pulses[i].output]->set(false);
+			}catch(const exception&){
+				st.errors++;
+			}
+		}
+	}
+	pulses.clear();
+	history.clear();
+	changed.notify_all();
+}
+
+void StrobeScheduler::set_lead(int64_t lead_ns)
+{
+	lock_guard<mutex> lk(lock);
+
+	lead = lead_ns;
+	changed.notify_all();
+}
+
+void StrobeScheduler::observe(const frame_info& info)
+{
+	uint64_t start;
+
+	// without a monotonic driver clock, arrival is the end of readout //
+	if((info.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		start = info.timestamp_ns;
+	else
+		start = monotonic_ns();
+
+	{
+		lock_guard<mutex> lk(lock);
+
+		if((info.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) != V4L2_BUF_FLAG_TSTAMP_SRC_SOE)
+			start -= period;
+
+		if(have_clock && info.frame_number > ref_frame && start > ref_start){
+			uint64_t sample = (start - ref_start) / (info.frame_number - ref_frame);
+
+			// smooth over ~8 frames, a dropped frame shows up as a long gap //
+			if(sample < 2 * period)
+				period += ((int64_t)sample - (int64_t)period) / 8;
+		}
+
+		have_clock = true;
+		ref_frame = info.frame_number;
+		ref_start = start;
+	}
+	changed.notify_all();
+}
+
+bool StrobeScheduler::predict(unsigned int frame_number, uint64_t *t) const
+{
+	if(!have_clock)
+		return false;
+
+	*t = ref_start + ((int64_t)frame_number - (int64_t)ref_frame) * (int64_t)period - lead;
+	return true;
+}
+
+bool StrobeScheduler::next_toggle(size_t *index, uint64_t *t) const
+{
+	bool found = false;
+	size_t i;
+
+	for(i = 0; i < pulses.size(); ++i){
+		uint64_t when;
+
+		if(!predict(pulses[i].on ? pulses[i].last + 1 : pulses[i].first, &when))
+			return false;
+
+		if(!found || when < *t){
+			*index = i;
+			*t = when;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+bool StrobeScheduler::idle()
+{
+	lock_guard<mutex> lk(lock);
+
+	return pulses.empty() && armed.empty();
+}
+
+uint32_t StrobeScheduler::lit(unsigned int frame_number)
+{
+	lock_guard<mutex> lk(lock);
+	uint32_t mask = 0;
+	size_t i;
+
+	for(i = 0; i < history.size(); ++i)
+		if(frame_number >= history[i].first && frame_number <= history[i].last && history[i].output < 32)
+			mask |= 1U << history[i].output;
+
+	return mask;
+}
+
+strobe_stats StrobeScheduler::stats()
+{
+	lock_guard<mutex> lk(lock);
+
+	return st;
+}
+
+void StrobeScheduler::register_metrics(MetricsRegistry *reg, const string& prefix)
+{
+	reg->add(prefix + ".toggles", METRIC_COUNTER, [this]() { return (int64_t)stats().toggles; });
+	reg->add(prefix + ".hw_pulses", METRIC_COUNTER, [this]() { return (int64_t)stats().hw_pulses; });
+	reg->add(prefix + ".hw_unknown", METRIC_COUNTER, [this]() { return (int64_t)stats().hw_unknown; });
+	reg->add(prefix + ".late", METRIC_COUNTER, [this]() { return (int64_t)stats().late; });
+	reg->add(prefix + ".errors", METRIC_COUNTER, [this]() { return (int64_t)stats().errors; });
+	reg->add(prefix + ".jitter_ns", &jit);
+}
+
+bool StrobeScheduler::arm(StrobeOutput *out, uint64_t on, uint64_t off, uint64_t now)
+{
+	// already started: the rest of it in software //
+	if(on <= now)
+		return false;
+
+	try{
+		return out->pulse(on - now, off - on);
+	}catch(const exception&){
+		// busy or an older driver, fall back to timed set() //
+		return false;
+	}
+}
+
+void StrobeScheduler::record(uint64_t actual, uint64_t requested)
+{
+	if((int64_t)(actual - requested) > LATE_NS)
+		st.late++;
+	// an edge before its time is as wrong as one after it //
+	jit.record(actual > requested ? actual - requested : requested - actual);
+}
+
+// edges of finished driver pulses into jitter(); when the next one is due, 0 if none //
+uint64_t StrobeScheduler::collect(uint64_t now)
+{
+	uint64_t next = 0, on, off, due;
+	size_t i = 0;
+
+	while(i < armed.size()){
+		bool done = false;
+
+		due = armed[i].off + HW_COLLECT_NS;
+		if(now >= due){
+			try{
+				done = armed[i].out->pulse_edges(&on, &off);
+			}catch(const exception&){
+				st.errors++;
+			}
+
+			if(done){
+				record(on, armed[i].on);
+				record(off, armed[i].off);
+			}else if(now >= armed[i].off + HW_GIVE_UP_NS){
+				st.hw_unknown++;
+				done = true;
+			}else{
+				due = now + HW_COLLECT_NS;
+			}
+		}
+
+		if(done){
+			armed.erase(armed.begin() + i);
+			continue;
+		}
+		if(!next || due < next)
+			next = due;
+		++i;
+	}
+
+	return next;
+}
+
+void StrobeScheduler::run()
+{
+	unique_lock<mutex> lk(lock);
+
+	if(realtime){
+		struct sched_param sp;
+
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = priority;
+		// needs CAP_SYS_NICE, without it we run at normal priority //
+		pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	}
+
+	while(running){
+		size_t i, j;
+		uint64_t t, t2, now, actual, due;
+		struct timespec ts;
+		StrobeOutput *out;
+		bool on;
+
+		now = monotonic_ns();
+		due = collect(now);
+
+		if(!next_toggle(&i, &t)){
+			if(due)
+				changed.wait_for(lk, chrono::nanoseconds(due - now));
+			else
+				changed.wait(lk);
+			continue;
+		}
+
+		if((int64_t)(t - now) > COARSE_MARGIN_NS){
+			uint64_t wake = t - COARSE_MARGIN_NS;
+
+			changed.wait_for(lk, chrono::nanoseconds((due && due < wake ? due : wake) - now));
+			continue;
+		}
+
+		// a pulse whose frames are already over is not worth a flash //
+		if(!pulses[i].on && predict(pulses[i].last + 1, &t2) && t2 <= now){
+			pulses.erase(pulses.begin() + i);
+			st.late++;
+			continue;
+		}
+
+		out = outputs[pulses[i].output];
+		if(!pulses[i].on && predict(pulses[i].last + 1, &t2) && arm(out, t, t2, now)){
+			hw_pulse h;
+
+			h.out = out;
+			h.on = t;
+			h.off = t2;
+			armed.push_back(h);
+			pulses.erase(pulses.begin() + i);
+			st.hw_pulses++;
+			continue;
+		}
+
+		if(t > now){
+			lk.unlock();
+			ts.tv_sec = t / 1000000000ULL;
+			ts.tv_nsec = t % 1000000000ULL;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+			lk.lock();
+
+			// schedule changed while asleep, or the prediction moved later //
+			if(!running || !next_toggle(&j, &t2) || j != i || (int64_t)(t2 - t) > RETARGET_NS)
+				continue;
+		}
+
+		out = outputs[pulses[i].output];
+		on = !pulses[i].on;
+		if(on)
+			pulses[i].on = true;
+		else
+			pulses.erase(pulses.begin() + i);
+
+		lk.unlock();
+		try{
+			out->set(on);
+		}catch(const exception&){
+			lk.lock();
+			st.errors++;
+			continue;
+		}
+		actual = monotonic_ns();
+		lk.lock();
+
+		st.toggles++;
+		record(actual, t);
+	}
+}
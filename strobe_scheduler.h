@@ -0,0 +1,174 @@
+#ifndef STROBE_SCHEDULER_H
+#define STROBE_SCHEDULER_H
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "frame_sink.h"
+#include "raspi2_gpio.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+
+// something the scheduler can switch, usually an LED on a GPIO //
+class StrobeOutput{
+public:
+	virtual ~StrobeOutput() {}
+
+	virtual void set(bool on) = 0;
+	// hand a whole on pulse to a hardware timer, false if not supported //
+	virtual bool pulse(uint64_t, uint64_t) { return false; }
+	// CLOCK_MONOTONIC times of both edges of the last pulse(), false until it is over //
+	virtual bool pulse_edges(uint64_t *, uint64_t *) { return false; }
+};
+
+class GpioStrobe : public StrobeOutput{
+public:
+	GpioStrobe(Raspi2Gpio *gpio) : gpio(gpio), armed_count(0) {}
+
+	void set(bool on) { gpio->write(on); }
+	// driver hrtimer, microsecond widths however loaded this process is //
+	bool pulse(uint64_t delay_ns, uint64_t width_ns)
+	{
+		armed_count = gpio->pulse_status().count;
+		gpio->start_pulse(true, (width_ns + 500) / 1000, (delay_ns + 500) / 1000);
+		return true;
+	}
+	// the edges the driver timestamped in its hrtimer callbacks //
+	bool pulse_edges(uint64_t *on_ns, uint64_t *off_ns)
+	{
+		raspi2_gpio_pulse_status ps = gpio->pulse_status();
+
+		if(ps.busy || ps.count == armed_count)
+			return false;
+		*on_ns = ps.start_ns;
+		*off_ns = ps.end_ns;
+		return true;
+	}
+private:
+	Raspi2Gpio *gpio;
+	uint32_t armed_count;		// completed pulses before the last pulse()
+};
+
+struct strobe_stats{
+	unsigned long toggles;
+	unsigned long hw_pulses;	// pulses handed to StrobeOutput::pulse()
+	unsigned long hw_unknown;	// of those, no edge times came back
+	unsigned long late;		// toggle time already past when it was reached
+	unsigned long errors;	// output->set() threw
+};
+
+/*
+	StrobeScheduler - switch outputs in step with the camera
+	schedule(out, 60, 61) lights output out for the exposures of frames
+	60 and 61. The frame clock comes from observe(), fed with every
+	captured frame: the last driver timestamp plus a smoothed frame
+	period predict when a future frame_number starts exposing. Start of
+	exposure is the timestamp for V4L2_BUF_FLAG_TSTAMP_SRC_SOE and one
+	period earlier otherwise.
+
+	A timer thread sleeps on a condition variable until shortly before
+	the next toggle, then clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME)
+	to the exact time, optionally under SCHED_FIFO. jitter() records
+	how far each toggle landed from its requested time, early as well
+	as late. Outputs that implement pulse() are armed at that wake-up
+	instead, with both edges timed in the driver; their edge times are
+	read back with pulse_edges() once the pulse is over and go into
+	jitter() the same way.
+
+	Outputs are not owned and must outlive the scheduler: the destructor
+	switches off whatever is still lit, and until then the timer thread
+	may be calling into any of them.
+*/
+class StrobeScheduler{
+public:
+	StrobeScheduler(unsigned int nominal_fps = 60, bool realtime = false, int priority = 50);
+	~StrobeScheduler();
+
+	unsigned int add_output(StrobeOutput *out);
+	// output on from the start of first_frame to the end of last_frame //
+	void schedule(unsigned int output, unsigned int first_frame, unsigned int last_frame);
+	// drop one schedule() call, off at once if lit; a pulse already armed in the driver still runs //
+	void unschedule(unsigned int output, unsigned int first_frame, unsigned int last_frame);
+	void cancel();
+
+	// feed every captured frame, from any single thread //
+	void observe(const frame_info& info);
+
+	// switch this much before the predicted exposure boundary //
+	void set_lead(int64_t lead_ns);
+
+	// true once every scheduled pulse has been switched off and timed //
+	bool idle();
+	// outputs scheduled on for frame_number, bit i is output i //
+	uint32_t lit(unsigned int frame_number);
+
+	strobe_stats stats();
+	const LatencyHistogram& jitter() const { return jit; }
+	// "<prefix>.": strobe_stats as counters and jitter_ns //
+	void register_metrics(MetricsRegistry *reg, const std::string& prefix = "strobe");
+	uint64_t frame_period() const { return period; }
+private:
+	struct pulse{
+		unsigned int output;
+		unsigned int first, last;
+		bool on;
+	};
+
+	struct hw_pulse{
+		StrobeOutput *out;
+		uint64_t on, off;			// requested edge times
+	};
+
+	bool predict(unsigned int frame_number, uint64_t *t) const;
+	bool next_toggle(size_t *index, uint64_t *t) const;
+	bool arm(StrobeOutput *out, uint64_t on, uint64_t off, uint64_t now);
+	uint64_t collect(uint64_t now);
+	void record(uint64_t actual, uint64_t requested);
+	void run();
+
+	std::vector<StrobeOutput*> outputs;
+	std::vector<pulse> pulses;
+	std::vector<pulse> history;		// the last MAX_HISTORY schedule() calls, for lit()
+	std::vector<hw_pulse> armed;		// handed to the driver, edges not read back yet
+
+	// frame clock, protected by lock //
+	bool have_clock;
+	unsigned int ref_frame;
+	uint64_t ref_start;
+	uint64_t period;
+	int64_t lead;
+
+	bool realtime;
+	int priority;
+
+	std::mutex lock;
+	std::condition_variable changed;
+	bool running;
+	std::thread thread;
+
+	strobe_stats st;
+	LatencyHistogram jit;
+};
+
+// FrameSink that feeds a StrobeScheduler and passes the frame on, LED state filled in //
+class StrobeTap : public FrameSink{
+public:
+	StrobeTap(StrobeScheduler *sched, FrameSink *next) : sched(sched), next(next) {}
+
+	void consume(const void *p, size_t size, const frame_info& info)
+	{
+		frame_info tagged = info;
+
+		sched->observe(info);
+		tagged.leds = sched->lit(info.frame_number);
+		next->consume(p, size, tagged);
+	}
+private:
+	StrobeScheduler *sched;
+	FrameSink *next;
+};
+
+#endif
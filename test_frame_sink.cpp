@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+
+#include "frame_sink.h"
+
+#define DEPTH 4
+#define N_FRAMES 200
+#define WRITE_US 2000		// a slow disk, far behind the capture loop
+#define FRAME_US 200		// capture interval, the writer is mid-write on most frames
+
+using namespace std;
+
+/*
+	test_frame_sink - AsyncFrameSink under a saturated writer
+	Feeds N_FRAMES frames, one per FRAME_US, into a DEPTH ring in front of
+	a sink that takes WRITE_US per frame. With BP_DROP_OLDEST the newest
+	DEPTH frames must all reach the target, in order, and every accepted
+	frame must be either written or counted as dropped. Exits non-zero on
+	failure.
+
+	usage : test_frame_sink
+*/
+
+// records the frame numbers it is handed, slowly //
+class SlowSink : public FrameSink{
+public:
+	void consume(const void *p, size_t size, const frame_info& info)
+	{
+		if(size != sizeof(unsigned int) || memcmp(p, &info.frame_number, size) != 0)
+			throw runtime_error("payload does not match frame_info");
+		usleep(WRITE_US);
+		lock_guard<mutex> lk(lock);
+		frames.push_back(info.frame_number);
+	}
+
+	mutex lock;
+	vector<unsigned int> frames;
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+	if(!ok)
+		failures++;
+}
+
+int main()
+{
+	SlowSink slow;
+	sink_stats st;
+	unsigned int i;
+
+	{
+		AsyncFrameSink sink(&slow, sizeof(unsigned int), DEPTH, BP_DROP_OLDEST);
+
+		for(i = 1; i <= N_FRAMES; ++i){
+			frame_info info;
+
+			memset(&info, 0, sizeof(info));
+			info.frame_number = i;
+			sink.consume(&i, sizeof(i), info);
+			usleep(FRAME_US);
+		}
+		sink.flush();
+		st = sink.stats();
+	}
+
+	printf("queued %lu written %lu dropped %lu, %zu frames at the target\n",
+			st.queued, st.written, st.dropped, slow.frames.size());
+
+	check(st.queued == N_FRAMES, "every frame accepted");
+	check(st.written + st.dropped == N_FRAMES, "accepted = written + dropped");
+	check(st.written == slow.frames.size(), "written count matches the target");
+	check(st.dropped > 0, "the writer was saturated");
+
+	bool ordered = true;
+	for(i = 1; i < slow.frames.size(); ++i)
+		ordered = ordered && slow.frames[i] > slow.frames[i - 1];
+	check(ordered, "frames reach the target in capture order");
+
+	bool newest = slow.frames.size() >= DEPTH;
+	for(i = 0; newest && i < DEPTH; ++i)
+		newest = slow.frames[slow.frames.size() - DEPTH + i] == N_FRAMES - DEPTH + 1 + i;
+	check(newest, "the newest DEPTH frames survive");
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+
+#include "pupil_detector.h"
+#include "latency_histogram.h"
+
+#define XRES 640
+#define YRES 480
+#define N_IMAGES 200
+
+// pass thresholds, with headroom over an x86 dev box (100%, 0.1 px, 0.1 px) //
+#define MIN_DETECTED 0.98		// fraction of images
+#define MAX_CENTER_ERR 0.5f		// px, mean over detected images
+#define MAX_RADIUS_ERR 1.0f		// px, mean over detected images
+#define MAX_FALSE_HITS 0		// of 10 empty frames
+
+/*
+	The target is 5 ms per 640x480 frame on a Pi-class core (Cortex-A72,
+	Pi 4). Elsewhere the limit is that divided by how much faster the
+	host core is, estimated at 3 for a desktop or server x86 core on this
+	integer, cache-bound code; build with -DHOST_SPEEDUP=... to change it.
+	An x86 dev box measures about 1 ms.
+*/
+#define PI_MEAN_MS 5.0
+#ifndef HOST_SPEEDUP
+#if defined(__arm__) || defined(__aarch64__)
+#define HOST_SPEEDUP 1.0
+#else
+#define HOST_SPEEDUP 3.0
+#endif
+#endif
+#define MAX_MEAN_MS (PI_MEAN_MS / HOST_SPEEDUP)
+
+using namespace std;
+
+/*
+	test_pupil - accuracy and speed of PupilDetector on synthetic eyes
+	Each image has skin, an iris disc, an elliptical pupil with a corneal
+	glint and sensor noise, at a random position, size and orientation.
+	Exits non-zero if the detection rate, the centre or radius error, the
+	false hits on empty frames or the mean time per frame miss the limits
+	above.
+
+	usage : test_pupil [images] [seed]
+*/
+
+struct eye{
+	float x, y, a, b, angle;
+};
+
+static float noise(void)
+{
+	return (rand() % 21 - 10) * 0.6f;
+}
+
+static void render(vector<unsigned char>& img, const eye& e)
+{
+	float c = cosf(e.angle), s = sinf(e.angle);
+	float iris = e.a * 2.4f;
+	float gx = e.x + e.a * 0.3f, gy = e.y - e.b * 0.3f;
+	int x, y;
+
+	for(y = 0; y < YRES; ++y){
+		for(x = 0; x < XRES; ++x){
+			float dx = x - e.x, dy = y - e.y;
+			float u = (dx * c + dy * s) / e.a, w = (-dx * s + dy * c) / e.b;
+			float v = 160 + (float)y / 16;
+
+			if(dx * dx + dy * dy < iris * iris)
+				v = 95;
+			if(u * u + w * w < 1.0f)
+				v = 25;
+			if((x - gx) * (x - gx) + (y - gy) * (y - gy) < 9)
+				v = 250;
+
+			v += noise();
+			img[y * XRES + x] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+		}
+	}
+}
+
+static bool check(bool ok, const char *what)
+{
+	printf("%-16s %s\n", what, ok ? "ok" : "FAILED");
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	int n_images = argc > 1 ? atoi(argv[1]) : N_IMAGES;
+	vector<unsigned char> img(XRES * YRES);
+	PupilDetector detector(XRES, YRES);
+	LatencyHistogram lat;
+	luma_frame frame;
+	double center_err = 0, radius_err = 0;
+	int i, found = 0, false_hits = 0;
+
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+
+	frame.timestamp_ns = 0;
+	frame.width = XRES;
+	frame.height = YRES;
+	frame.stride = XRES;
+	frame.data = &img[0];
+
+	for(i = 0; i < n_images; ++i){
+		eye e;
+		pupil p;
+		uint64_t t;
+
+		e.a = 12 + rand() % 30;
+		e.b = e.a * (0.75f + (rand() % 25) / 100.0f);
+		e.angle = (rand() % 314) / 100.0f;
+		e.x = 100 + rand() % (XRES - 200);
+		e.y = 100 + rand() % (YRES - 200);
+
+		render(img, e);
+		frame.frame_number = i;
+
+		t = monotonic_ns();
+		p = detector.detect(frame);
+		lat.record(monotonic_ns() - t);
+
+		if(p.found && hypotf(p.x - e.x, p.y - e.y) < e.b){
+			found++;
+			center_err += hypotf(p.x - e.x, p.y - e.y);
+			radius_err += fabsf(p.radius - (e.a + e.b) / 2);
+		}
+	}
+
+	// eye closed : skin only //
+	for(i = 0; i < 10; ++i){
+		eye e = { -1000, -1000, 1, 1, 0 };
+		render(img, e);
+		if(detector.detect(frame).found)
+			false_hits++;
+	}
+
+	printf("%d images %dx%d : detected %d (%.1f%%), false hits on empty frames %d/10\n",
+			n_images, XRES, YRES, found, 100.0 * found / n_images, false_hits);
+	if(found)
+		printf("mean centre error %.2f px, mean radius error %.2f px\n",
+				center_err / found, radius_err / found);
+	printf("detect : mean %.2f ms  p50 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+			lat.mean() / 1e6, lat.percentile(50) / 1e6, lat.percentile(99) / 1e6, lat.max() / 1e6);
+	printf("limit : mean %.2f ms here, %.1f ms on a Pi-class core\n", MAX_MEAN_MS, PI_MEAN_MS);
+
+	bool pass = true;
+
+	pass = check(found >= MIN_DETECTED * n_images, "detection rate") && pass;
+	pass = check(found && center_err / found <= MAX_CENTER_ERR, "centre error") && pass;
+	pass = check(found && radius_err / found <= MAX_RADIUS_ERR, "radius error") && pass;
+	pass = check(false_hits <= MAX_FALSE_HITS, "false hits") && pass;
+	pass = check(lat.mean() / 1e6 <= MAX_MEAN_MS, "time per frame") && pass;
+
+	return pass ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <stdexcept>
+
+#include "bounded_queue.h"
+#include "stage_graph.h"
+
+#define N_ITEMS 8			// pool, far fewer than frames so capture has to wait
+#define N_WORKERS 4
+#define N_FRAMES 400
+#define QUEUE_VALUES 100000	// per producer in the queue test
+#define MAX_WORK_US 400		// per item in the parallel stage
+#define TIMEOUT_S 30		// a stalled ordered stage hangs flush(), fail instead
+
+using namespace std;
+
+/*
+	test_stage_graph - BoundedQueue and StageGraph ordering and backpressure
+	1. BoundedQueue: capacity, FIFO order, and every value popped exactly
+	   once with two producers and two consumers.
+	2. A parallel ordered stage that takes a different time per frame,
+	   drops some and throws on others, in front of a serial stage that
+	   records what reaches it: the survivors arrive in capture order,
+	   captured = completed + dropped, and a blocking capture waits for
+	   items instead of losing frames.
+	3. The same without block: frames past the pool are dropped at
+	   capture and still every captured one is accounted for.
+	Exits non-zero on failure.
+
+	usage : test_stage_graph
+*/
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+	if(!ok)
+		failures++;
+}
+
+static bool dropped_at(uint64_t seq) { return seq % 7 == 3; }
+static bool thrown_at(uint64_t seq) { return seq % 11 == 5; }
+
+// slow, uneven, parallel; rejects some frames and fails on others //
+class Work : public PipelineStage{
+public:
+	bool process(pipe_item& item, unsigned int)
+	{
+		usleep((item.seq * 37) % MAX_WORK_US);
+		if(thrown_at(item.seq))
+			throw runtime_error("stage failure");
+		return !dropped_at(item.seq);
+	}
+};
+
+// serial, the order frames leave the pipeline //
+class Record : public PipelineStage{
+public:
+	bool process(pipe_item& item, unsigned int)
+	{
+		lock_guard<mutex> lk(lock);
+		seqs.push_back(item.seq);
+		return true;
+	}
+
+	mutex lock;
+	vector<uint64_t> seqs;
+};
+
+static void test_queue()
+{
+	BoundedQueue<unsigned int> q(4);
+	vector<unsigned int> seen(2 * QUEUE_VALUES, 0);
+	vector<std::thread> threads;
+	mutex lock;
+	bool fifo = true, once = true;
+	unsigned int i, v;
+
+	for(i = 0; i < 4; ++i)
+		q.push(i);
+	check(!q.push(4), "queue: push on a full queue fails");
+	for(i = 0; i < 4; ++i)
+		fifo = q.pop(&v) && v == i && fifo;
+	check(fifo, "queue: pops in push order");
+	check(!q.pop(&v) && q.empty(), "queue: pop on an empty queue fails");
+
+	q.reset(64);
+	for(i = 0; i < 2; ++i){
+		threads.push_back(std::thread([&q, i]() {
+			unsigned int k;
+
+			for(k = 0; k < QUEUE_VALUES; ++k)
+				while(!q.push(i * QUEUE_VALUES + k))
+					this_thread::yield();
+		}));
+	}
+	for(i = 0; i < 2; ++i){
+		threads.push_back(std::thread([&]() {
+			unsigned int k, x;
+
+			for(k = 0; k < QUEUE_VALUES; ++k){
+				while(!q.pop(&x))
+					this_thread::yield();
+				lock_guard<mutex> lk(lock);
+				seen[x]++;
+			}
+		}));
+	}
+	for(i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	for(i = 0; i < seen.size(); ++i)
+		once = once && seen[i] == 1;
+	check(once && q.empty(), "queue: 2 x 2 threads, every value once");
+}
+
+static void test_graph(bool block)
+{
+	graph_config cfg;
+	Work work;
+	Record record;
+	vector<uint64_t> want;
+	graph_stats gs;
+	stage_stats ws, rs;
+	unsigned int i, thrown = 0;
+
+	cfg.n_items = N_ITEMS;
+	cfg.worker_cpus.assign(N_WORKERS, -1);
+	cfg.block = block;
+
+	{
+		StageGraph graph(sizeof(unsigned int), 1, 1, cfg);
+
+		graph.add_stage("work", &work, N_WORKERS, true);
+		graph.add_stage("record", &record, 1);
+		graph.start();
+
+		for(i = 0; i < N_FRAMES; ++i){
+			frame_info info;
+
+			memset(&info, 0, sizeof(info));
+			info.frame_number = i;
+			graph.consume(&i, sizeof(i), info);
+			// bursts of twice the pool, then a pause for the workers to catch up //
+			if(!block && i % (2 * N_ITEMS) == 2 * N_ITEMS - 1)
+				usleep(2 * MAX_WORK_US);
+		}
+		graph.flush();
+
+		gs = graph.stats();
+		ws = graph.stats(0);
+		rs = graph.stats(1);
+	}
+
+	for(i = 0; i < gs.captured; ++i){
+		if(thrown_at(i))
+			thrown++;
+		else if(!dropped_at(i))
+			want.push_back(i);
+	}
+
+	printf("%s : captured %lu completed %lu dropped at capture %lu, stage dropped %lu errors %lu, "
+			"%lu waits, peak parallel %u\n", block ? "block" : "drop", gs.captured, gs.completed, gs.dropped,
+			ws.dropped, ws.errors, gs.waits, ws.peak_parallel);
+
+	check(gs.captured + gs.dropped == N_FRAMES, "every frame captured or dropped at capture");
+	check(gs.captured == gs.completed + ws.dropped + rs.dropped, "captured = completed + dropped");
+	check(ws.errors == thrown, "stage exceptions counted as errors");
+	check(ws.peak_parallel > 1, "the ordered stage ran in parallel");
+	check(record.seqs.size() == gs.completed, "completed items reached the last stage");
+	if(block){
+		check(gs.dropped == 0 && gs.waits > 0, "block: capture waited, lost nothing");
+		check(record.seqs == want, "block: survivors in capture order");
+	}else{
+		bool ordered = true;
+
+		for(i = 1; i < record.seqs.size(); ++i)
+			ordered = ordered && record.seqs[i - 1] < record.seqs[i];
+		check(gs.dropped > 0, "drop: frames past the pool dropped");
+		check(ordered, "drop: survivors in capture order");
+	}
+}
+
+int main()
+{
+	alarm(TIMEOUT_S);
+
+	test_queue();
+	test_graph(true);
+	test_graph(false);
+
+	return failures ? 1 : 0;
+}